@@ -0,0 +1,277 @@
+/// Benchmark harness: run git-prompt repeatedly and report latency and cost
+///
+/// For every repository and format string, time `runs` invocations and
+/// report p50/p95/p99 wall time and peak RSS (of git-prompt or any git it
+/// ran). One extra run under ptrace counts child processes and syscalls;
+/// tracing slows it down, so it is not part of the timings.
+#define _GNU_SOURCE // for setenv, ptrace options
+#include <errno.h>        // for errno, ECHILD, EINTR
+#include <fcntl.h>        // for open, O_WRONLY
+#include <getopt.h>       // for getopt, optarg, optind
+#include <limits.h>       // for PATH_MAX
+#include <libgen.h>       // for dirname
+#include <signal.h>       // for kill, raise, SIGKILL, SIGSTOP, SIGTRAP
+#include <stdbool.h>      // for bool
+#include <stdio.h>        // for printf, fprintf, snprintf, fopen, fgets, sscanf
+#include <stdlib.h>       // for qsort, strtoul, setenv, malloc, free, exit
+#include <string.h>       // for strerror, strlen, memmove
+#include <sys/ptrace.h>   // for ptrace, PTRACE_*
+#include <sys/resource.h> // for rusage
+#include <sys/wait.h>     // for wait4, waitpid, WIFEXITED, __WALL
+#include <time.h>         // for clock_gettime, timespec
+#include <unistd.h>       // for fork, execv, dup2, readlink, access, _exit
+
+#define MAX_FORMATS 32
+
+static const char *DEFAULT_FORMATS[] = {"%b", "%b@%c", "%b %m", "%b %M %U", "%b %a%A%z%Z", NULL};
+
+/// Cost of one traced run
+struct trace_counts
+{
+    unsigned long children;
+    unsigned long syscalls;
+};
+
+/// Command line of the benchmark
+struct bench_opts
+{
+    const char *prompt;
+    const char *formats[MAX_FORMATS + 1];
+    unsigned runs;
+    unsigned warmup;
+    bool trace;
+};
+
+static double elapsed_ms(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e3 + (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/// Nearest-rank percentile of sorted samples
+static double percentile(const double *sorted, size_t n, unsigned p)
+{
+    size_t rank = (p * n + 99) / 100;
+    return sorted[rank ? rank - 1 : 0];
+}
+
+/// Start git-prompt on `repo` with stdout and stderr discarded
+///
+/// With `traced`, the child stops itself before exec so that the tracer can
+/// attach options first.
+static pid_t spawn_prompt(const struct bench_opts *opts, const char *format, const char *repo,
+                          bool traced)
+{
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+    int null = open("/dev/null", O_WRONLY);
+    if (null >= 0) {
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+    }
+    if (traced) {
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0) _exit(126);
+        raise(SIGSTOP);
+    }
+    char *argv[] = {(char *)opts->prompt, "-q", "-f", (char *)format, (char *)repo, NULL};
+    execv(argv[0], argv);
+    _exit(127);
+}
+
+/// Run git-prompt once; set wall time in ms and peak RSS in KiB
+static int timed_run(const struct bench_opts *opts, const char *format, const char *repo,
+                     double *ms, long *maxrss)
+{
+    struct timespec start, end;
+    struct rusage usage;
+    int status;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = spawn_prompt(opts, format, repo, false);
+    if (pid < 0) return 0;
+    while (wait4(pid, &status, 0, &usage) < 0)
+        if (errno != EINTR) return 0;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    *ms = elapsed_ms(&start, &end);
+    // usage covers git-prompt and the children it waited for; the peak is
+    // the largest single process
+    *maxrss = usage.ru_maxrss;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/// Whether task `tid` is a thread rather than the main task of a process
+static bool is_thread(unsigned long tid)
+{
+    char path[64], line[128];
+    snprintf(path, sizeof(path), "/proc/%lu/status", tid);
+    FILE *f = fopen(path, "r");
+    if (!f) return false;
+    unsigned long tgid = tid;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "Tgid: %lu", &tgid) == 1) break;
+    fclose(f);
+    return tgid != tid;
+}
+
+/// Run git-prompt once under ptrace, counting processes and syscalls of the tree
+///
+/// Return 0 if tracing is not permitted.
+static int traced_run(const struct bench_opts *opts, const char *format, const char *repo,
+                      struct trace_counts *counts)
+{
+    int status;
+    pid_t pid = spawn_prompt(opts, format, repo, true);
+    if (pid < 0) return 0;
+    if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status)) return 0;
+    long flags = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK |
+                 PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL;
+    if (ptrace(PTRACE_SETOPTIONS, pid, NULL, flags) < 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return 0;
+    }
+    counts->children = counts->syscalls = 0;
+    ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+    // every traced task stops on syscall entry and exit; count entries only
+    // by halving at the end (a task killed mid-syscall adds half a count)
+    unsigned long stops = 0;
+    pid_t stopped;
+    while ((stopped = waitpid(-1, &status, __WALL)) > 0) {
+        if (WIFEXITED(status) || WIFSIGNALED(status)) continue;
+        int sig = 0;
+        if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+            ++stops;
+        } else if (status >> 8 == (SIGTRAP | PTRACE_EVENT_FORK << 8) ||
+                   status >> 8 == (SIGTRAP | PTRACE_EVENT_VFORK << 8)) {
+            ++counts->children;
+        } else if (status >> 8 == (SIGTRAP | PTRACE_EVENT_CLONE << 8)) {
+            // posix_spawn clones too; git's worker threads are not children
+            unsigned long tid;
+            if (ptrace(PTRACE_GETEVENTMSG, stopped, NULL, &tid) == 0 && !is_thread(tid))
+                ++counts->children;
+        } else if (WSTOPSIG(status) != SIGSTOP && WSTOPSIG(status) != SIGTRAP) {
+            sig = WSTOPSIG(status);
+        }
+        ptrace(PTRACE_SYSCALL, stopped, NULL, (void *)(long)sig);
+    }
+    counts->syscalls = stops / 2;
+    return errno == ECHILD;
+}
+
+/// Benchmark every format on one repository; return 0 if any run failed
+static int bench_repo(const struct bench_opts *opts, const char *repo)
+{
+    int ok = 1;
+    double *samples = malloc(opts->runs * sizeof(*samples));
+    if (!samples) return 0;
+    for (const char *const *format = opts->formats; *format; ++format) {
+        double ms;
+        long rss, maxrss = 0;
+        for (unsigned i = 0; i < opts->warmup; ++i) timed_run(opts, *format, repo, &ms, &rss);
+        unsigned failed = 0;
+        for (unsigned i = 0; i < opts->runs; ++i) {
+            if (!timed_run(opts, *format, repo, &samples[i], &rss)) ++failed;
+            if (rss > maxrss) maxrss = rss;
+        }
+        qsort(samples, opts->runs, sizeof(*samples), cmp_double);
+        char children[32] = "-", syscalls[32] = "-";
+        struct trace_counts counts;
+        if (opts->trace && traced_run(opts, *format, repo, &counts)) {
+            snprintf(children, sizeof(children), "%lu", counts.children);
+            snprintf(syscalls, sizeof(syscalls), "%lu", counts.syscalls);
+        }
+        printf("%-24s %-16s %5u %9.2f %9.2f %9.2f %8s %9s %9ld%s\n", repo, *format, opts->runs,
+               percentile(samples, opts->runs, 50), percentile(samples, opts->runs, 95),
+               percentile(samples, opts->runs, 99), children, syscalls, maxrss,
+               failed ? "  (failed runs)" : "");
+        fflush(stdout);
+        if (failed) ok = 0;
+    }
+    free(samples);
+    return ok;
+}
+
+/// Default to git-prompt built next to this binary
+static const char *default_prompt(void)
+{
+    static char path[PATH_MAX];
+    ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (len < 0) return "git-prompt";
+    path[len] = '\0';
+    char *dir = dirname(path);
+    size_t dirlen = strlen(dir);
+    memmove(path, dir, dirlen);
+    snprintf(path + dirlen, sizeof(path) - dirlen, "/git-prompt");
+    return path;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-n RUNS] [-w WARMUP] [-p PROMPT] [-f FORMAT]... [-c] [-s] REPO...\n"
+            "\nFlags:\n"
+            "  -n   timed runs per repository and format (default 50)\n"
+            "  -w   untimed warmup runs (default 3)\n"
+            "  -p   git-prompt binary (default: next to this binary)\n"
+            "  -f   format string to measure; may be repeated\n"
+            "  -c   cold: keep git-prompt from using its result cache\n"
+            "  -s   skip the traced run counting children and syscalls\n"
+            "\nColumns: p50/p95/p99 wall time in ms, child processes and syscalls\n"
+            "of one traced run, peak RSS in KiB of git-prompt or any git it ran.\n"
+            "Repositories can be made with bench/gen-repo.sh.\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_opts opts = {.runs = 50, .warmup = 3, .trace = true};
+    size_t nr_formats = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:w:p:f:csh")) != -1) {
+        switch (opt) {
+        case 'n':
+            opts.runs = strtoul(optarg, NULL, 10);
+            break;
+        case 'w':
+            opts.warmup = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            opts.prompt = optarg;
+            break;
+        case 'f':
+            if (nr_formats == MAX_FORMATS) usage(argv[0]);
+            opts.formats[nr_formats++] = optarg;
+            break;
+        case 'c':
+            // the cache directory cannot be created under a file
+            setenv("XDG_RUNTIME_DIR", "/dev/null", 1);
+            break;
+        case 's':
+            opts.trace = false;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind == argc || !opts.runs) usage(argv[0]);
+    if (!opts.prompt) opts.prompt = default_prompt();
+    if (!nr_formats)
+        for (; DEFAULT_FORMATS[nr_formats]; ++nr_formats)
+            opts.formats[nr_formats] = DEFAULT_FORMATS[nr_formats];
+    opts.formats[nr_formats] = NULL;
+    if (access(opts.prompt, X_OK) < 0) {
+        fprintf(stderr, "error: %s: %s\n", opts.prompt, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    printf("%-24s %-16s %5s %9s %9s %9s %8s %9s %9s\n", "repo", "format", "runs", "p50", "p95",
+           "p99", "children", "syscalls", "rss");
+    int ok = 1;
+    for (int i = optind; i < argc; ++i) ok &= bench_repo(&opts, argv[i]);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,18 @@
+#!/bin/sh
+# Stand-in core.fsmonitor hook (protocol version 2) reporting a fixed change set
+#
+# Prints a constant token, then the worktree paths listed one per line in
+# .git/fsmonitor-changes. If that file is missing, reports "/" so that git
+# and git-prompt check everything.
+#
+#   git config core.fsmonitor "$PWD/bench/fsmonitor-hook.sh"
+set -eu
+
+[ "${1:-}" = 2 ] || exit 1
+changes=$(git rev-parse --git-dir)/fsmonitor-changes
+printf 'fixed-token\0'
+if [ -f "$changes" ]; then
+    tr '\n' '\0' <"$changes"
+else
+    printf '/\0'
+fi
@@ -0,0 +1,117 @@
+#!/bin/sh
+# Generate a synthetic git repository for benchmarking git-prompt
+#
+# Presets (override any value with the flags below):
+#   small    1k tracked files
+#   medium   100k tracked files, 10k untracked, 100 modified
+#   large    1M tracked files, 100k untracked, 1k modified
+#   history  10k commits, 500 ahead and 2000 behind upstream
+#   refs     100k packed tags
+set -eu
+
+usage() {
+    cat >&2 <<EOF
+Usage: $(basename "$0") [-p PRESET] [-t TRACKED] [-u UNTRACKED] [-m MODIFIED]
+                        [-c COMMITS] [-a AHEAD] [-b BEHIND] [-r REFS] [-g] DIR
+
+  -p   preset: small, medium, large, history, refs (default small)
+  -t   tracked files, 1000 per directory
+  -u   untracked files, spread over the tracked directories
+  -m   tracked files modified in the worktree
+  -c   commits of shared history
+  -a   commits on main not on the upstream origin/main
+  -b   commits on origin/main not on main
+  -r   tags, all in packed-refs
+  -g   write a commit-graph
+EOF
+    exit 1
+}
+
+tracked=1000 untracked=0 modified=0 commits=1 ahead=0 behind=0 refs=0 graph=0
+preset() {
+    case $1 in
+    small) ;;
+    medium) tracked=100000 untracked=10000 modified=100 ;;
+    large) tracked=1000000 untracked=100000 modified=1000 ;;
+    history) commits=10000 ahead=500 behind=2000 graph=1 ;;
+    refs) refs=100000 ;;
+    *) usage ;;
+    esac
+}
+
+# apply the preset first so that other flags override it
+while getopts p:t:u:m:c:a:b:r:gh opt; do
+    case $opt in
+    p) preset "$OPTARG" ;;
+    h | \?) usage ;;
+    esac
+done
+OPTIND=1
+while getopts p:t:u:m:c:a:b:r:gh opt; do
+    case $opt in
+    t) tracked=$OPTARG ;;
+    u) untracked=$OPTARG ;;
+    m) modified=$OPTARG ;;
+    c) commits=$OPTARG ;;
+    a) ahead=$OPTARG ;;
+    b) behind=$OPTARG ;;
+    r) refs=$OPTARG ;;
+    g) graph=1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+[ $# -eq 1 ] || usage
+dir=$1
+[ ! -e "$dir" ] || { echo "error: $dir exists" >&2; exit 1; }
+[ "$commits" -ge 1 ] || commits=1
+
+git init -q -b main "$dir"
+cd "$dir"
+git config user.name bench
+git config user.email bench@example.com
+git remote add origin "file://$PWD/.git" 2>/dev/null || true
+git config branch.main.remote origin
+git config branch.main.merge refs/heads/main
+
+# One fast-import stream: the tree in the first commit, then one small
+# change per commit. All tracked files share one blob.
+awk -v tracked="$tracked" -v commits="$commits" -v ahead="$ahead" -v behind="$behind" \
+    -v refs="$refs" '
+function commit(ref, mark, parent, n) {
+    printf "commit %s\nmark :%d\ncommitter bench <bench@example.com> %d +0000\n", ref, mark, 1000000000 + mark
+    printf "data 7\ncommit\n"
+    if (parent) printf "from :%d\n", parent
+    printf "M 100644 inline history/%s\ndata %d\n%s\n", ref ~ /origin/ ? "upstream" : "local", length(n) + 1, n
+}
+BEGIN {
+    printf "blob\nmark :1\ndata 2\nx\n"
+    printf "commit refs/heads/main\nmark :2\ncommitter bench <bench@example.com> 1000000000 +0000\ndata 5\ntree\n"
+    for (i = 0; i < tracked; ++i)
+        printf "M 100644 :1 d%04d/f%06d\n", int(i / 1000), i
+    mark = 2
+    for (i = 1; i < commits; ++i) { commit("refs/heads/main", mark + 1, mark, i); ++mark }
+    base = mark
+    for (i = 0; i < behind; ++i) {
+        commit("refs/remotes/origin/main", mark + 1, i ? mark : base, i); ++mark
+    }
+    if (!behind) printf "reset refs/remotes/origin/main\nfrom :%d\n\n", base
+    for (i = 0; i < ahead; ++i) {
+        commit("refs/heads/main", mark + 1, i ? mark : base, i); ++mark
+    }
+    for (i = 0; i < refs; ++i) printf "reset refs/tags/t%06d\nfrom :%d\n\n", i, base
+}' | git fast-import --quiet
+
+git pack-refs --all
+[ "$graph" -eq 0 ] || git commit-graph write --reachable
+git checkout -q -f main
+
+if [ "$untracked" -gt 0 ]; then
+    awk -v n="$untracked" -v dirs=$(((tracked + 999) / 1000)) \
+        'BEGIN { for (i = 0; i < n; ++i) printf "d%04d/u%06d\n", i % dirs, i }' |
+        xargs touch
+fi
+if [ "$modified" -gt 0 ]; then
+    git ls-files | head -n "$modified" | while read -r f; do echo y >>"$f"; done
+fi
+echo "$dir: $tracked tracked, $untracked untracked, $modified modified," \
+    "$commits commits (+$ahead/-$behind), $refs refs"
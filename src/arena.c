@@ -0,0 +1,116 @@
+#include "arena.h"
+#include <stdlib.h> // for malloc, realloc, free
+#include <string.h> // for memcpy, memset, strlen, strnlen
+
+// Smallest block taken from the heap; larger allocations get a block of their own
+#define ARENA_BLOCK_SIZE 16384
+// Alignment of every allocation, enough for any scalar type
+#define ARENA_ALIGN 16
+#define ALIGN_UP(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct arena_block
+{
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+};
+
+#define BLOCK_HEADER ALIGN_UP(sizeof(struct arena_block))
+
+static char *block_data(struct arena_block *block) { return (char *)block + BLOCK_HEADER; }
+
+/// Put a new block of at least `size` bytes at the head of `arena`
+static struct arena_block *new_block(struct arena *arena, size_t size)
+{
+    if (size < ARENA_BLOCK_SIZE) size = ARENA_BLOCK_SIZE;
+    struct arena_block *block = malloc(BLOCK_HEADER + size);
+    if (!block) return NULL;
+    block->size = size;
+    block->used = 0;
+    block->next = arena->head;
+    arena->head = block;
+    ++arena->heap_blocks;
+    return block;
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    if (!arena) return malloc(size);
+    size = ALIGN_UP(size ? size : 1);
+    struct arena_block *block = arena->head;
+    if (!block || block->size - block->used < size) {
+        if (!(block = new_block(arena, size))) return NULL;
+    }
+    char *p = block_data(block) + block->used;
+    block->used += size;
+    arena->last = p;
+    arena->last_size = size;
+    ++arena->allocs;
+    arena->bytes += size;
+    return p;
+}
+
+void *arena_calloc(struct arena *arena, size_t size)
+{
+    void *p = arena_alloc(arena, size);
+    return p ? memset(p, 0, size) : NULL;
+}
+
+void *arena_grow(struct arena *arena, void *ptr, size_t old_size, size_t new_size)
+{
+    if (!arena) return realloc(ptr, new_size);
+    if (!ptr) return arena_alloc(arena, new_size);
+    struct arena_block *block = arena->head;
+    if (ptr == arena->last) {
+        size_t start = arena->last - block_data(block);
+        size_t size = ALIGN_UP(new_size);
+        if (size <= block->size - start) {
+            block->used = start + size;
+            arena->bytes += size - arena->last_size;
+            arena->last_size = size;
+            return ptr;
+        }
+    }
+    void *p = arena_alloc(arena, new_size);
+    if (p) memcpy(p, ptr, old_size < new_size ? old_size : new_size);
+    return p;
+}
+
+char *arena_strndup(struct arena *arena, const char *str, size_t n)
+{
+    const size_t len = n == 0 ? strlen(str) : strnlen(str, n);
+    char *p = arena_alloc(arena, len + 1);
+    if (!p) return NULL;
+    p[len] = '\0';
+    return memcpy(p, str, len);
+}
+
+void arena_drop(struct arena *arena, void *ptr)
+{
+    if (!arena) free(ptr);
+}
+
+void arena_reset(struct arena *arena)
+{
+    struct arena_block *block = arena->head;
+    if (block && block->next) {
+        // merge into one block holding everything this round needed
+        size_t size = 0;
+        for (struct arena_block *b = block; b; b = b->next) size += b->used;
+        arena_free(arena);
+        new_block(arena, size);
+    } else if (block) {
+        block->used = 0;
+    }
+    arena->last = NULL;
+    arena->last_size = arena->allocs = arena->bytes = arena->heap_blocks = 0;
+}
+
+void arena_free(struct arena *arena)
+{
+    for (struct arena_block *block = arena->head, *next; block; block = next) {
+        next = block->next;
+        free(block);
+    }
+    memset(arena, 0, sizeof(*arena));
+}
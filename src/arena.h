@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stddef.h> // for size_t
+
+struct arena_block;
+
+/// Region allocator for memory that lives as long as one prompt or request
+///
+/// Allocations are bumped off large blocks and released all at once. An
+/// arena is used by one thread at a time. Functions taking an arena also
+/// accept NULL, meaning plain malloc(3) memory the caller frees itself; long-
+/// lived state (the daemon's repositories) is kept that way.
+struct arena
+{
+    /// Newest block first
+    struct arena_block *head;
+    /// Most recent allocation and its rounded-up size, which may grow in place
+    char *last;
+    size_t last_size;
+    /// Since the last reset: allocations served, bytes handed out, and blocks
+    /// taken from the heap for them (0 once the arena has warmed up)
+    size_t allocs;
+    size_t bytes;
+    size_t heap_blocks;
+};
+
+/// Allocate `size` bytes, aligned for any type; return NULL if out of memory
+void *arena_alloc(struct arena *arena, size_t size);
+
+/// Allocate `size` zeroed bytes
+void *arena_calloc(struct arena *arena, size_t size);
+
+/// Resize `ptr` (allocated with `old_size` bytes, or NULL) to `new_size` bytes
+///
+/// The most recent allocation grows in place while its block has room;
+/// others are copied. Return NULL if out of memory, leaving `ptr` valid.
+void *arena_grow(struct arena *arena, void *ptr, size_t old_size, size_t new_size);
+
+/// Copy string into the arena, like str_ndup()
+char *arena_strndup(struct arena *arena, const char *str, size_t n);
+
+/// Give back `ptr`: freed if `arena` is NULL, else left for arena_reset()
+void arena_drop(struct arena *arena, void *ptr);
+
+/// Release everything allocated so far, keeping the memory for reuse
+///
+/// Blocks are merged into one big enough for everything since the last
+/// reset, so a long-lived caller that resets per request stops taking
+/// memory from the heap after the first few requests.
+void arena_reset(struct arena *arena);
+
+/// Release everything, including the memory kept for reuse
+void arena_free(struct arena *arena);
@@ -0,0 +1,121 @@
+#include "async.h"
+#include "cache.h"     // for status_cache, cache_load, cache_load_stale, cache_store
+#include "format.h"    // for format_render, FORMAT_MAX_OUTPUT
+#include "log.h"       // for log_debug, log_warn
+#include "operation.h" // for read_operation
+#include "options.h"   // for options
+#include "plan.h"      // for PLAN_OPERATION
+#include "profile.h"   // for profile_enabled, profile_mark
+#include "repo.h"      // for git_repo, new_git_repo, parse_porcelain, render_prompt
+#include "util.h"      // for write_all
+#include <errno.h>     // for errno
+#include <fcntl.h>     // for open, O_RDONLY, O_RDWR, O_WRONLY, O_NONBLOCK, O_CLOEXEC
+#include <signal.h>    // for kill, SIGUSR1
+#include <stdlib.h>    // for strtol
+#include <string.h>    // for memcpy, strcmp, strerror, strlen
+#include <sys/file.h>  // for flock, LOCK_EX, LOCK_NB
+#include <sys/stat.h>  // for fstat, S_ISFIFO
+#include <sys/wait.h>  // for waitpid
+#include <unistd.h>    // for close, dup2, fork, setsid, _exit
+
+/// Tell `target` (process id or named pipe) that the prompt is now `prompt`
+static void notify(const char *target, const char *prompt)
+{
+    char *end;
+    long pid = strtol(target, &end, 10);
+    if (*target && !*end) {
+        if (pid > 0) kill(pid, SIGUSR1);
+        return;
+    }
+    // nobody reading the pipe means nobody to redraw
+    int fd = open(target, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st;
+    char line[FORMAT_MAX_OUTPUT + 1];
+    size_t len = strlen(prompt);
+    memcpy(line, prompt, len);
+    line[len++] = '\n';
+    if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode)) write_all(fd, line, len);
+    close(fd);
+}
+
+/// Recompute sources `todo` of `repo`, store them and notify; run in the refresher
+static void refresh(const struct options *opts, struct status_cache *cache,
+                    struct git_repo *repo, unsigned todo, const char *shown)
+{
+    setsid();
+    // the shell waits for the prompt's stdout to close
+    int null = open("/dev/null", O_RDWR);
+    if (null >= 0) {
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        if (null > STDERR_FILENO) close(null);
+    }
+    profile_enabled = false;
+    struct options local = *opts;
+    local.plan = todo;
+    // nobody is waiting, so git gets all the time it needs
+    local.timeout = 0;
+    repo->clear(repo, todo);
+    unsigned late = parse_porcelain(repo, &local);
+    cache_store(cache, repo, todo & ~late);
+    char buf[FORMAT_MAX_OUTPUT];
+    format_render(opts->compiled_format, repo, buf, sizeof(buf));
+    // an unchanged prompt needs no redraw, which also ends the redraw-refresh cycle
+    if (opts->notify && strcmp(buf, shown)) notify(opts->notify, buf);
+    _exit(0);
+}
+
+/// Start a detached refresher for `repo` unless one is running already
+///
+/// The refresher holds a lock on the record file while it computes. The
+/// file it replaces keeps the lock, but by then the refresher is done.
+static void spawn_refresher(const struct options *opts, struct status_cache *cache,
+                            struct git_repo *repo, unsigned todo, const char *shown)
+{
+    int lock = open(cache->path, O_RDONLY | O_CLOEXEC);
+    if (lock < 0) return;
+    if (flock(lock, LOCK_EX | LOCK_NB) < 0) {
+        log_debug("async: refresh of %s already running", repo->gitdir);
+        close(lock);
+        return;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        // orphan the refresher so that nobody has to wait for it
+        if (fork() == 0) refresh(opts, cache, repo, todo, shown);
+        _exit(0);
+    }
+    if (pid < 0)
+        log_warn("async: cannot start refresher: %s", strerror(errno));
+    else
+        waitpid(pid, NULL, 0);
+    close(lock);
+}
+
+size_t render_async(const struct options *opts, struct arena *arena, char *buf, size_t size)
+{
+    struct git_repo *repo = new_git_repo(arena);
+    if (!repo) return render_prompt(opts, arena, buf, size);
+    repo->count_cap = opts->count_cap;
+    struct status_cache cache;
+    unsigned todo = cache_load(&cache, repo, opts->directory, opts->plan);
+    if (todo && !cache.have_old) {
+        // nothing to show yet (or not a repository)
+        repo->free(repo);
+        return render_prompt(opts, arena, buf, size);
+    }
+    if (todo) cache_load_stale(&cache, repo, todo);
+    // cheaper to look at than to leave to the refresher
+    if (todo & PLAN_OPERATION) {
+        read_operation(repo);
+        todo &= ~PLAN_OPERATION;
+    }
+    profile_mark(PROFILE_PARSE);
+    size_t len = format_render(opts->compiled_format, repo, buf, size);
+    profile_mark(PROFILE_RENDER);
+    if (todo) spawn_refresher(opts, &cache, repo, todo, buf);
+    repo->free(repo);
+    return len;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stddef.h> // for size_t
+
+struct arena;
+struct options;
+
+/// Render the prompt from the last results on disk and refresh them in the background
+///
+/// Whatever is not known to be current is shown as last recorded, and a
+/// detached process recomputes it and stores the results for the next
+/// prompt. Only one such refresher runs per repository. If the refreshed
+/// prompt differs from the one shown, it tells `opts->notify`: a process id
+/// gets SIGUSR1, a named pipe gets the new prompt as one line. Without any
+/// recorded results the prompt is computed as usual. Write the prompt into
+/// `buf` of `size` bytes like render_prompt() and return its length.
+size_t render_async(const struct options *opts, struct arena *arena, char *buf, size_t size);
@@ -0,0 +1,180 @@
+#include "batch.h"
+#include "arena.h"   // for arena, arena_reset, arena_free
+#include "format.h"  // for FORMAT_MAX_OUTPUT
+#include "log.h"     // for log_error, log_debug
+#include "options.h" // for options
+#include "repo.h"    // for render_prompt
+#include "util.h"    // for write_all
+#include <errno.h>   // for errno, EINTR
+#include <limits.h>  // for PATH_MAX
+#include <pthread.h> // for pthread_create, pthread_join, pthread_mutex_lock
+#include <stdbool.h> // for bool
+#include <stdio.h>   // for getdelim, stdin
+#include <stdlib.h>  // for calloc, free, malloc, realloc, realpath
+#include <string.h>  // for memcpy, strerror, strlen
+#include <unistd.h>  // for sysconf, STDOUT_FILENO, _SC_NPROCESSORS_ONLN
+
+#define MAX_JOBS 64
+
+/// Result of one directory
+struct batch_item
+{
+    const char *dir;
+    /// Rendered record, ready to write
+    char *out;
+    size_t len;
+    bool done;
+};
+
+/// Work shared by the workers; `lock` guards everything below it
+struct batch
+{
+    const struct options *opts;
+    struct batch_item *items;
+    size_t nr;
+    pthread_mutex_t lock;
+    /// Next item to hand out
+    size_t next;
+    /// Next item to print in input order
+    size_t next_out;
+    bool failed;
+};
+
+/// Compute the record for one directory: "<dir>\t<prompt>" and terminator
+///
+/// The repository data is kept in the worker's `arena`; only the record
+/// outlives the call.
+static void run_item(const struct batch *b, struct batch_item *item, struct arena *arena)
+{
+    char prompt[FORMAT_MAX_OUTPUT];
+    size_t prompt_len = 0;
+    char real[PATH_MAX];
+    if (realpath(item->dir, real)) {
+        struct options opts = *b->opts;
+        opts.directory = real;
+        prompt_len = render_prompt(&opts, arena, prompt, sizeof(prompt));
+    } else {
+        log_debug("batch: %s: %s", item->dir, strerror(errno));
+    }
+    size_t dir_len = strlen(item->dir);
+    if ((item->out = malloc(dir_len + prompt_len + 2))) {
+        memcpy(item->out, item->dir, dir_len);
+        item->out[dir_len] = '\t';
+        memcpy(item->out + dir_len + 1, prompt, prompt_len);
+        item->out[dir_len + prompt_len + 1] = b->opts->null_terminated ? '\0' : '\n';
+        item->len = dir_len + prompt_len + 2;
+    }
+    arena_reset(arena);
+}
+
+/// Print finished items as the output order allows; call with the lock held
+static void flush_items(struct batch *b, struct batch_item *item)
+{
+    if (!b->opts->ordered) {
+        if (item->out && !write_all(STDOUT_FILENO, item->out, item->len)) b->failed = true;
+        free(item->out);
+        item->out = NULL;
+        return;
+    }
+    for (; b->next_out < b->nr && b->items[b->next_out].done; ++b->next_out) {
+        struct batch_item *ready = &b->items[b->next_out];
+        if (ready->out && !write_all(STDOUT_FILENO, ready->out, ready->len)) b->failed = true;
+        free(ready->out);
+        ready->out = NULL;
+    }
+}
+
+static void *worker(void *arg)
+{
+    struct batch *b = arg;
+    struct arena arena = {0};
+    pthread_mutex_lock(&b->lock);
+    while (b->next < b->nr) {
+        struct batch_item *item = &b->items[b->next++];
+        pthread_mutex_unlock(&b->lock);
+        run_item(b, item, &arena);
+        pthread_mutex_lock(&b->lock);
+        item->done = true;
+        flush_items(b, item);
+    }
+    pthread_mutex_unlock(&b->lock);
+    arena_free(&arena);
+    return NULL;
+}
+
+/// Read directories from stdin into `lines`; return their number or -1
+static ssize_t read_dirs(char ***lines, int delim)
+{
+    char **list = NULL;
+    size_t nr = 0, alloc = 0;
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    while ((len = getdelim(&line, &size, delim, stdin)) >= 0) {
+        if (len && line[len - 1] == delim) line[--len] = '\0';
+        if (!len) continue;
+        if (nr == alloc) {
+            alloc = alloc ? alloc * 2 : 64;
+            char **tmp = realloc(list, alloc * sizeof(*list));
+            if (!tmp) goto err;
+            list = tmp;
+        }
+        list[nr++] = line;
+        line = NULL;
+        size = 0;
+    }
+    free(line);
+    *lines = list;
+    return nr;
+err:
+    free(line);
+    for (size_t i = 0; i < nr; ++i) free(list[i]);
+    free(list);
+    return -1;
+}
+
+int run_batch(const struct options *opts)
+{
+    char **lines = NULL;
+    size_t nr = opts->nr_paths;
+    if (!nr) {
+        ssize_t n = read_dirs(&lines, opts->null_terminated ? '\0' : '\n');
+        if (n < 0) {
+            log_error("batch: out of memory reading directories");
+            return 1;
+        }
+        nr = n;
+    }
+    struct batch b = {.opts = opts, .nr = nr};
+    int status = 1;
+    if (nr && !(b.items = calloc(nr, sizeof(*b.items)))) goto out;
+    for (size_t i = 0; i < nr; ++i) b.items[i].dir = lines ? lines[i] : opts->paths[i];
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t jobs = opts->jobs ? opts->jobs : cpus > 0 ? (size_t)cpus : 1;
+    if (jobs > MAX_JOBS) jobs = MAX_JOBS;
+    if (jobs > nr) jobs = nr;
+    log_debug("batch: %zu directories, %zu workers", nr, jobs);
+
+    pthread_t threads[MAX_JOBS];
+    size_t started = 0;
+    pthread_mutex_init(&b.lock, NULL);
+    for (; started < jobs; ++started) {
+        int err = pthread_create(&threads[started], NULL, worker, &b);
+        if (err) {
+            log_error("batch: cannot start worker: %s", strerror(err));
+            break;
+        }
+    }
+    // with no worker at all, do the work on this thread
+    if (!started && nr) worker(&b);
+    for (size_t i = 0; i < started; ++i) pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&b.lock);
+    status = b.failed;
+out:
+    free(b.items);
+    if (lines)
+        for (size_t i = 0; i < nr; ++i) free(lines[i]);
+    free(lines);
+    return status;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+struct options;
+
+/// Print prompts for many directories, computed by a pool of worker threads
+///
+/// Directories come from `opts->paths`, or from stdin (one per line, or
+/// NUL-terminated with `opts->null_terminated`) if there are none. Each
+/// result is printed as "<dir>\t<prompt>" followed by newline (or NUL),
+/// in completion order unless `opts->ordered`. Return process exit status.
+int run_batch(const struct options *opts);
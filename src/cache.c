@@ -0,0 +1,334 @@
+#define _GNU_SOURCE // for mkostemp
+#include "cache.h"
+#include "discover.h"  // for discover_repo, DISCOVER_FOUND
+#include "log.h"       // for log_debug, log_warn
+#include "plan.h"      // for PLAN_REFS, PLAN_INDEX, PLAN_WORKTREE, PLAN_UNTRACKED, PLAN_UPSTREAM, PLAN_SUBMODULES, PLAN_STASH
+#include "refs.h"      // for refs_resolve, refs_upstream, REF_ERROR
+#include "repo.h"      // for git_repo
+#include "sha1.h"      // for SHA1_RAWSZ
+#include "util.h"      // for path_join, private_dir, runtime_path
+#include <dirent.h>    // for opendir, readdir, closedir
+#include <errno.h>     // for errno
+#include <fcntl.h>     // for AT_FDCWD, O_CLOEXEC
+#include <stdbool.h>   // for bool
+#include <stdint.h>    // for uint64_t, uint8_t
+#include <stdio.h>     // for FILE, fdopen, fopen, fgets, fprintf, rename, snprintf, sscanf
+#include <stdlib.h>    // for free, mkostemp, realloc, qsort
+#include <string.h>    // for memcpy, memset, strchr, strcmp, strcpy, strcspn, strerror, strlen
+#include <sys/stat.h>  // for stat, utimensat
+#include <unistd.h>    // for close, unlink
+
+#define CACHE_VERSION 4
+// Repositories kept before the least recently used one is dropped
+#define MAX_CACHE_FILES 128
+// Temporary files of writers that died are removed after this many seconds
+#define STALE_TMP_SECS 60
+
+/// Sources fully decided by the fingerprinted files
+#define CACHEABLE (PLAN_REFS | PLAN_UPSTREAM | PLAN_STASH)
+
+/// FNV-1a, to turn a git dir into a file name
+static uint64_t hash_path(const char *path)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; *path; ++path) hash = (hash ^ (unsigned char)*path) * 0x100000001b3ULL;
+    return hash;
+}
+
+static void take_fingerprint(struct fingerprint *fp, const char *dir, const char *name)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    memset(fp, 0, sizeof(*fp));
+    if (!name || !path_join(path, sizeof(path), dir, name) || lstat(path, &st) < 0) return;
+    fp->dev = st.st_dev;
+    fp->ino = st.st_ino;
+    fp->size = st.st_size;
+    fp->mtime = st.st_mtim;
+    fp->ctime = st.st_ctim;
+}
+
+/// Fingerprint HEAD, config, packed-refs, the branch ref, its upstream and the stash reflog
+static int take_fingerprints(struct status_cache *cache, const struct git_repo *repo)
+{
+    uint8_t oid[SHA1_RAWSZ];
+    char branch[PATH_MAX], upstream[PATH_MAX];
+    if (refs_resolve(repo, "HEAD", oid, branch, sizeof(branch)) == REF_ERROR) return 0;
+    bool detached = !strcmp(branch, "HEAD");
+    int tracking = detached ? 0 : refs_upstream(repo, branch, upstream, sizeof(upstream));
+    // without knowing the upstream ref there is nothing to validate against
+    if (tracking < 0) return 0;
+    take_fingerprint(&cache->fp[CACHE_HEAD], repo->gitdir, "HEAD");
+    take_fingerprint(&cache->fp[CACHE_CONFIG], repo->commondir, "config");
+    take_fingerprint(&cache->fp[CACHE_PACKED_REFS], repo->commondir, "packed-refs");
+    take_fingerprint(&cache->fp[CACHE_BRANCH], repo->commondir, detached ? NULL : branch);
+    take_fingerprint(&cache->fp[CACHE_UPSTREAM], repo->commondir, tracking > 0 ? upstream : NULL);
+    take_fingerprint(&cache->fp[CACHE_STASH], repo->commondir, "logs/refs/stash");
+    return 1;
+}
+
+static int fingerprint_eq(const struct fingerprint *a, const struct fingerprint *b)
+{
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+           a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec &&
+           a->ctime.tv_sec == b->ctime.tv_sec && a->ctime.tv_nsec == b->ctime.tv_nsec;
+}
+
+/// Read next line of `file` into `buf` without the newline
+static int read_line(FILE *file, char *buf, size_t bufsize)
+{
+    if (!fgets(buf, bufsize, file)) return 0;
+    buf[strcspn(buf, "\n")] = '\0';
+    return 1;
+}
+
+/// Parse cache file at `path` for git dir `gitdir` into `rec`
+static int read_record(const char *path, const char *gitdir, struct cache_record *rec)
+{
+    FILE *file = fopen(path, "re");
+    if (!file) return 0;
+    char line[PATH_MAX + 64];
+    int version, ok = 0;
+    memset(rec, 0, sizeof(*rec));
+    if (!read_line(file, line, sizeof(line)) ||
+        sscanf(line, "git-prompt-cache %d", &version) != 1 || version != CACHE_VERSION)
+        goto out;
+    // a different repository whose git dir hashes the same
+    if (!read_line(file, line, sizeof(line)) || strcmp(line, gitdir)) goto out;
+    if (!read_line(file, line, sizeof(line)) ||
+        sscanf(line, "valid %u known %u", &rec->valid, &rec->known) != 2)
+        goto out;
+    for (int i = 0; i < CACHE_FILES; ++i) {
+        struct fingerprint *fp = &rec->fp[i];
+        unsigned long long dev, ino;
+        long long size, msec, csec;
+        long mnsec, cnsec;
+        if (!read_line(file, line, sizeof(line)) ||
+            sscanf(line, "fp %llu %llu %lld %lld.%ld %lld.%ld", &dev, &ino, &size, &msec, &mnsec,
+                   &csec, &cnsec) != 7)
+            goto out;
+        fp->dev = dev;
+        fp->ino = ino;
+        fp->size = size;
+        fp->mtime = (struct timespec){.tv_sec = msec, .tv_nsec = mnsec};
+        fp->ctime = (struct timespec){.tv_sec = csec, .tv_nsec = cnsec};
+    }
+    ok = read_line(file, rec->branch, sizeof(rec->branch)) &&
+         read_line(file, rec->commit, sizeof(rec->commit)) &&
+         read_line(file, line, sizeof(line)) &&
+         sscanf(line, "%u %u %u %u %u %u %u", &rec->changed, &rec->untracked, &rec->unmerged,
+                &rec->ahead, &rec->behind, &rec->dirty_submodules, &rec->stashes) == 7;
+out:
+    fclose(file);
+    return ok;
+}
+
+/// Copy sources in `plan` from `rec` to `repo`; return bits copied
+static unsigned apply_record(const struct cache_record *rec, struct git_repo *repo, unsigned plan)
+{
+    unsigned filled = 0;
+    if (plan & PLAN_REFS) {
+        if (!repo->set_branch(repo, rec->branch, 0) || !repo->set_commit(repo, rec->commit, 0))
+            return 0;
+        filled |= PLAN_REFS;
+    }
+    if (plan & (PLAN_INDEX | PLAN_WORKTREE)) {
+        repo->changed = rec->changed;
+        repo->unmerged = rec->unmerged;
+        filled |= plan & (PLAN_INDEX | PLAN_WORKTREE);
+    }
+    if (plan & PLAN_UNTRACKED) {
+        repo->untracked = rec->untracked;
+        filled |= PLAN_UNTRACKED;
+    }
+    if (plan & PLAN_UPSTREAM) {
+        repo->ahead = rec->ahead;
+        repo->behind = rec->behind;
+        filled |= PLAN_UPSTREAM;
+    }
+    if (plan & PLAN_SUBMODULES) {
+        repo->dirty_submodules = rec->dirty_submodules;
+        filled |= PLAN_SUBMODULES;
+    }
+    if (plan & PLAN_STASH) {
+        repo->stashes = rec->stashes;
+        filled |= PLAN_STASH;
+    }
+    return filled;
+}
+
+int cache_file_path(char *buf, size_t bufsize, const char *gitdir, const char *suffix)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "cache/%016llx%s", (unsigned long long)hash_path(gitdir), suffix);
+    return runtime_path(buf, bufsize, "cache") && private_dir(buf) &&
+           runtime_path(buf, bufsize, name);
+}
+
+unsigned cache_load(struct status_cache *cache, struct git_repo *repo, const char *dir,
+                    unsigned plan)
+{
+    memset(cache, 0, sizeof(*cache));
+    if (!plan || (!repo->gitdir && discover_repo(repo, dir) != DISCOVER_FOUND)) return plan;
+    if (!take_fingerprints(cache, repo)) return plan;
+    if (!cache_file_path(cache->path, sizeof(cache->path), repo->gitdir, "")) {
+        cache->path[0] = '\0';
+        return plan;
+    }
+    cache->have_old = read_record(cache->path, repo->gitdir, &cache->old);
+    cache->fresh = cache->have_old;
+    for (int i = 0; cache->fresh && i < CACHE_FILES; ++i) {
+        if (!fingerprint_eq(&cache->old.fp[i], &cache->fp[i])) {
+            log_debug("cache: fingerprint %d changed", i);
+            cache->fresh = false;
+        }
+    }
+    if (cache->fresh) cache->loaded = apply_record(&cache->old, repo, plan & cache->old.valid);
+    if (cache->loaded) {
+        // mark as recently used for eviction
+        utimensat(AT_FDCWD, cache->path, NULL, 0);
+        log_debug("cache: hit for %s", repo->gitdir);
+    }
+    return plan & ~cache->loaded;
+}
+
+struct cache_file_age
+{
+    struct timespec mtime;
+    char name[32];
+};
+
+static int cmp_age(const void *a, const void *b)
+{
+    const struct timespec *x = &((const struct cache_file_age *)a)->mtime;
+    const struct timespec *y = &((const struct cache_file_age *)b)->mtime;
+    if (x->tv_sec != y->tv_sec) return x->tv_sec < y->tv_sec ? -1 : 1;
+    return (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+/// Remove least recently used cache files beyond MAX_CACHE_FILES
+static void evict(const char *cachedir)
+{
+    DIR *d = opendir(cachedir);
+    if (!d) return;
+    struct cache_file_age *files = NULL;
+    size_t nr = 0, alloc = 0;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        char path[PATH_MAX];
+        struct stat st;
+        if (de->d_name[0] == '.' || strlen(de->d_name) >= sizeof(files->name) ||
+            !path_join(path, sizeof(path), cachedir, de->d_name) || lstat(path, &st) < 0)
+            continue;
+        if (strchr(de->d_name, '.')) {
+            // temporary file of a writer that did not get to rename it
+            if (now.tv_sec - st.st_mtim.tv_sec > STALE_TMP_SECS) unlink(path);
+            continue;
+        }
+        if (nr == alloc) {
+            alloc = alloc ? alloc * 2 : 64;
+            struct cache_file_age *tmp = realloc(files, alloc * sizeof(*files));
+            if (!tmp) goto out;
+            files = tmp;
+        }
+        files[nr].mtime = st.st_mtim;
+        strcpy(files[nr++].name, de->d_name);
+    }
+    if (nr > MAX_CACHE_FILES) {
+        qsort(files, nr, sizeof(*files), cmp_age);
+        for (size_t i = 0; i < nr - MAX_CACHE_FILES; ++i) {
+            char path[PATH_MAX];
+            if (path_join(path, sizeof(path), cachedir, files[i].name)) unlink(path);
+        }
+        log_debug("cache: evicted %zu entries", nr - MAX_CACHE_FILES);
+    }
+out:
+    closedir(d);
+    free(files);
+}
+
+unsigned cache_load_stale(const struct status_cache *cache, struct git_repo *repo, unsigned plan)
+{
+    if (!cache->have_old) return 0;
+    return apply_record(&cache->old, repo, plan & cache->old.known);
+}
+
+/// Check whether two records would be written the same
+static int record_eq(const struct cache_record *a, const struct cache_record *b)
+{
+    for (int i = 0; i < CACHE_FILES; ++i)
+        if (!fingerprint_eq(&a->fp[i], &b->fp[i])) return 0;
+    return a->valid == b->valid && a->known == b->known && !strcmp(a->branch, b->branch) &&
+           !strcmp(a->commit, b->commit) && a->changed == b->changed &&
+           a->untracked == b->untracked && a->unmerged == b->unmerged && a->ahead == b->ahead &&
+           a->behind == b->behind && a->dirty_submodules == b->dirty_submodules &&
+           a->stashes == b->stashes;
+}
+
+void cache_store(struct status_cache *cache, const struct git_repo *repo, unsigned plan)
+{
+    if (!cache->path[0] || !plan) return;
+    // start from what is on disk so that sources not computed now are kept
+    struct cache_record rec = cache->old;
+    unsigned now = plan | cache->loaded;
+    // git failed to report refs
+    if (!repo->branch || !repo->commit) now &= ~PLAN_REFS;
+    if (!cache->have_old) rec.known = 0;
+    rec.valid = (now | (cache->fresh ? rec.valid : 0)) & CACHEABLE;
+    rec.known |= now;
+    memcpy(rec.fp, cache->fp, sizeof(rec.fp));
+    if (now & PLAN_REFS) {
+        snprintf(rec.branch, sizeof(rec.branch), "%s", repo->branch);
+        snprintf(rec.commit, sizeof(rec.commit), "%s", repo->commit);
+    }
+    if (now & (PLAN_INDEX | PLAN_WORKTREE)) {
+        rec.changed = repo->changed;
+        rec.unmerged = repo->unmerged;
+    }
+    if (now & PLAN_UNTRACKED) rec.untracked = repo->untracked;
+    if (now & PLAN_UPSTREAM) {
+        rec.ahead = repo->ahead;
+        rec.behind = repo->behind;
+    }
+    if (now & PLAN_SUBMODULES) rec.dirty_submodules = repo->dirty_submodules;
+    if (now & PLAN_STASH) rec.stashes = repo->stashes;
+    if (cache->have_old && record_eq(&rec, &cache->old)) return;
+
+    char tmp[PATH_MAX];
+    // unique per writer, also between batch mode threads of one process
+    int len = snprintf(tmp, sizeof(tmp), "%s.XXXXXX", cache->path);
+    if (len < 0 || (size_t)len >= sizeof(tmp)) return;
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    FILE *file = fd < 0 ? NULL : fdopen(fd, "w");
+    if (!file) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp);
+        }
+        log_warn("cache: cannot write %s: %s", tmp, strerror(errno));
+        return;
+    }
+    fprintf(file, "git-prompt-cache %d\n%s\nvalid %u known %u\n", CACHE_VERSION, repo->gitdir,
+            rec.valid, rec.known);
+    for (int i = 0; i < CACHE_FILES; ++i) {
+        const struct fingerprint *fp = &rec.fp[i];
+        fprintf(file, "fp %llu %llu %lld %lld.%09ld %lld.%09ld\n", (unsigned long long)fp->dev,
+                (unsigned long long)fp->ino, (long long)fp->size, (long long)fp->mtime.tv_sec,
+                fp->mtime.tv_nsec, (long long)fp->ctime.tv_sec, fp->ctime.tv_nsec);
+    }
+    fprintf(file, "%s\n%s\n%u %u %u %u %u %u %u\n", rec.branch, rec.commit, rec.changed,
+            rec.untracked, rec.unmerged, rec.ahead, rec.behind, rec.dirty_submodules, rec.stashes);
+    // readers see either the old file or the complete new one
+    if (fclose(file) != 0 || rename(tmp, cache->path) < 0) {
+        log_warn("cache: cannot replace %s: %s", cache->path, strerror(errno));
+        unlink(tmp);
+        return;
+    }
+    cache->old = rec;
+    // only a new repository can push the cache over its bound
+    char cachedir[PATH_MAX];
+    if (!cache->have_old && runtime_path(cachedir, sizeof(cachedir), "cache")) evict(cachedir);
+    cache->have_old = cache->fresh = true;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <limits.h>    // for PATH_MAX
+#include <stdbool.h>   // for bool
+#include <sys/types.h> // for dev_t, ino_t, off_t
+#include <time.h>      // for timespec
+
+struct git_repo;
+
+/// Files whose stat data decide whether cached results are still good
+enum cache_file {
+    CACHE_HEAD,
+    CACHE_CONFIG,
+    CACHE_PACKED_REFS,
+    CACHE_BRANCH,
+    CACHE_UPSTREAM,
+    CACHE_STASH,
+    CACHE_FILES
+};
+
+/// Stat data of one file; all zero if it does not exist
+struct fingerprint
+{
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+};
+
+/// Results of one repository as stored on disk
+struct cache_record
+{
+    /// `plan_source` bits still exact while the fingerprints match
+    unsigned valid;
+    /// `plan_source` bits computed at some point, possibly outdated
+    unsigned known;
+    struct fingerprint fp[CACHE_FILES];
+    char branch[256];
+    char commit[64];
+    unsigned changed;
+    unsigned untracked;
+    unsigned unmerged;
+    unsigned ahead;
+    unsigned behind;
+    unsigned dirty_submodules;
+    unsigned stashes;
+};
+
+/// Cache lookup state carried from cache_load() to cache_store()
+struct status_cache
+{
+    /// Cache file of this repository; empty if caching is not possible
+    char path[PATH_MAX];
+    /// Taken before anything is computed, so that later changes invalidate
+    struct fingerprint fp[CACHE_FILES];
+    /// `plan_source` bits filled from the cache
+    unsigned loaded;
+    /// Record found on disk, if any
+    bool have_old;
+    /// Whether the fingerprints of `old` match the current ones
+    bool fresh;
+    struct cache_record old;
+};
+
+/// Set `buf` to the cache file of git dir `gitdir` plus `suffix`, creating the directory
+///
+/// Other per-repository caches name their files with a suffix. Return 0 on
+/// failure.
+int cache_file_path(char *buf, size_t bufsize, const char *gitdir, const char *suffix);
+
+/// Fill `repo` from the on-disk cache for `dir` as far as it is still valid
+///
+/// Only branch/commit, ahead/behind and the stash count are cached: they are
+/// fully decided by HEAD, refs, config and the stash reflog, while worktree
+/// changes leave no trace in those files. Discover the repository if needed. Return the bits of `plan` that
+/// still have to be computed.
+unsigned cache_load(struct status_cache *cache, struct git_repo *repo, const char *dir,
+                    unsigned plan);
+
+/// Fill sources in `plan` from the last results on disk, however old
+///
+/// For rendering something when computing took too long. Return the bits
+/// that could be filled.
+unsigned cache_load_stale(const struct status_cache *cache, struct git_repo *repo, unsigned plan);
+
+/// Save results of `repo` for `plan` plus what cache_load() filled in
+///
+/// Changed and untracked counts are kept for cache_load_stale() only. The
+/// file is replaced atomically; least recently used files of other
+/// repositories are removed to keep the cache bounded.
+void cache_store(struct status_cache *cache, const struct git_repo *repo, unsigned plan);
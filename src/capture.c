@@ -1,27 +1,38 @@
+#define _GNU_SOURCE // for pipe2
 #include "capture.h"
-#include "log.h"        // for log_get_level, log_trace, log_debug, LOG_TRACE
-#include <errno.h>      // for errno
-#include <stdio.h>      // for NULL, size_t
-#include <stdlib.h>     // for free, malloc, realloc, WEXITSTATUS, WIFEXITED
-#include <string.h>     // for strcat, strerror
-#include <sys/select.h> // for select, FD_ISSET, FD_SET, FD_ZERO, fd_set
-#include <sys/wait.h>   // for waitpid
-#include <unistd.h>     // for close, _exit, dup2, pipe, execvp, fork, read
-
-static void init_dynbuf(struct dynbuf *dbuf, int bufsize)
+#include "arena.h"    // for arena_alloc, arena_grow, arena_drop
+#include "log.h"      // for log_get_level, log_get_quiet, log_trace, log_debug, LOG_TRACE
+#include "profile.h"  // for profile_mark, profile_read
+#include "util.h"     // for deadline_remaining_ms
+#include <errno.h>    // for errno, EINTR
+#include <fcntl.h>    // for O_CLOEXEC, O_WRONLY
+#include <limits.h>   // for INT_MAX
+#include <poll.h>     // for poll, pollfd, POLLIN
+#include <signal.h>   // for kill, SIGKILL
+#include <spawn.h>    // for posix_spawnp, posix_spawn_file_actions_t, posix_spawnattr_t
+#include <stdbool.h>  // for bool
+#include <stdio.h>    // for NULL, size_t, snprintf
+#include <stdlib.h>   // for WEXITSTATUS, WIFEXITED
+#include <string.h>   // for strcpy, strerror
+#include <sys/wait.h> // for waitpid
+#include <unistd.h>   // for close, pipe2, read, environ
+
+static void init_dynbuf(struct arena *arena, struct dynbuf *dbuf, int bufsize)
 {
     dbuf->size = bufsize;
     dbuf->len = 0;
-    dbuf->buf = malloc(bufsize); // caller handles NULL
+    dbuf->buf = arena_alloc(arena, bufsize); // caller handles NULL
     dbuf->eof = 0;
 }
 
-static ssize_t read_dynbuf(int fd, struct dynbuf *dbuf)
+static ssize_t read_dynbuf(struct arena *arena, int fd, struct dynbuf *dbuf)
 {
     size_t avail = dbuf->size - dbuf->len;
     if (avail < 1024) {
+        char *buf = arena_grow(arena, dbuf->buf, dbuf->size, dbuf->size * 2);
+        if (!buf) return -1;
+        dbuf->buf = buf;
         dbuf->size *= 2;
-        dbuf->buf = realloc(dbuf->buf, dbuf->size);
         avail = dbuf->size - dbuf->len;
     }
     // read avail-1 bytes to leave room for termininating NULL
@@ -35,6 +46,7 @@ static ssize_t read_dynbuf(int fd, struct dynbuf *dbuf)
         return 0;
     }
     log_trace("capture: read %zu bytes from child via fd %d", nread, fd);
+    profile_read(nread);
     dbuf->len += nread;
     return nread;
 }
@@ -42,23 +54,25 @@ static ssize_t read_dynbuf(int fd, struct dynbuf *dbuf)
 static void free_capture(struct capture *self)
 {
     if (self) {
-        if (self->childout.buf) free(self->childout.buf);
-        if (self->childerr.buf) free(self->childerr.buf);
-        free(self);
+        arena_drop(self->arena, self->childout.buf);
+        arena_drop(self->arena, self->childerr.buf);
+        arena_drop(self->arena, self);
     }
 }
 
-struct capture *new_capture()
+struct capture *new_capture(struct arena *arena)
 {
     int bufsize = 4096;
-    struct capture *result = malloc(sizeof(struct capture));
+    struct capture *result = arena_alloc(arena, sizeof(struct capture));
     if (!result) return NULL;
+    result->arena = arena;
     result->free = free_capture;
+    result->childout.buf = result->childerr.buf = NULL;
 
-    init_dynbuf(&result->childout, bufsize);
+    init_dynbuf(arena, &result->childout, bufsize);
     if (!result->childout.buf) goto err;
 
-    init_dynbuf(&result->childerr, bufsize);
+    init_dynbuf(arena, &result->childerr, bufsize);
     if (!result->childerr.buf) goto err;
 
     return result;
@@ -68,89 +82,142 @@ err:
     return NULL;
 }
 
-struct capture *capture_child(char *const argv[])
+// One pipe's worth (default pipe capacity), so a read takes all git has written
+#define STREAM_BUFSIZE 65536
+
+/// Log command line at trace level, shortened to fit the log line
+static void trace_command(char *const argv[])
+{
+    char cmd_debug[1024];
+    size_t len = 0;
+    for (char *const *p = argv; *p && len < sizeof(cmd_debug); ++p)
+        len += snprintf(cmd_debug + len, sizeof(cmd_debug) - len, "%s%s", p == argv ? "" : " ", *p);
+    if (len >= sizeof(cmd_debug)) strcpy(cmd_debug + sizeof(cmd_debug) - 4, "...");
+    log_trace("capture: %s", cmd_debug);
+}
+
+struct capture *capture_stream(char *const argv[], const struct timespec *deadline,
+                               struct arena *arena, capture_sink sink, void *data)
 {
     const char *file = *argv;
-    if (log_get_level() >= LOG_TRACE) {
-        char cmd_debug[256] = "";
-        for (char *const *p = argv; *p; ++p) {
-            strcat(cmd_debug, *p);
-            strcat(cmd_debug, " \0");
-        }
-        log_trace("capture: %s", cmd_debug);
-    }
+    // child stderr only ever goes to the debug log
+    bool want_stderr = !log_get_quiet() && log_get_level() <= LOG_DEBUG;
+    if (!log_get_quiet() && log_get_level() <= LOG_TRACE) trace_command(argv);
+
     int stdout_pipe[] = {-1, -1};
     int stderr_pipe[] = {-1, -1};
     struct capture *result = NULL;
-    if (pipe(stdout_pipe) < 0) goto err;
-    if (pipe(stderr_pipe) < 0) goto err;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    pid_t pid = -1;
+    // close-on-exec keeps our ends out of the child (and out of any other
+    // child spawned meanwhile by a multi-threaded host)
+    if (pipe2(stdout_pipe, O_CLOEXEC) < 0) goto err;
+    if (want_stderr && pipe2(stderr_pipe, O_CLOEXEC) < 0) goto err;
+    if (!(result = new_capture(arena))) goto err;
+    result->timed_out = result->stopped = 0;
+    if (sink) {
+        // fixed buffer, emptied into the sink after every read
+        char *buf = arena_grow(arena, result->childout.buf, result->childout.size, STREAM_BUFSIZE);
+        if (!buf) goto err;
+        result->childout.buf = buf;
+        result->childout.size = STREAM_BUFSIZE;
+    }
 
-    pid_t pid = fork();
-    if (pid < 0) {
+    // dup2 onto 1 and 2 clears close-on-exec for those
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, stdout_pipe[1], STDOUT_FILENO);
+    if (want_stderr)
+        posix_spawn_file_actions_adddup2(&actions, stderr_pipe[1], STDERR_FILENO);
+    else
+        posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    // own process group, so that git and its helpers can be killed together
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    // glibc spawns with CLONE_VM | CLONE_VFORK: no page tables are copied,
+    // so the cost does not grow with the size of the calling process
+    int rc = posix_spawnp(&pid, file, &actions, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (rc != 0) {
+        log_error("error executing %s: %s", file, strerror(rc));
         goto err;
     }
-    if (pid == 0) {            // in the child
-        close(stdout_pipe[0]); // don't need the read ends of the pipes
-        close(stderr_pipe[0]);
-        if (dup2(stdout_pipe[1], STDOUT_FILENO) < 0) _exit(1);
-        if (dup2(stderr_pipe[1], STDERR_FILENO) < 0) _exit(1);
-
-        execvp(file, argv);
-        log_error("error executing %s: %s", file, strerror(errno));
-        _exit(127);
-    }
+
+    profile_mark(PROFILE_SPAWN);
 
     // parent: don't need write ends of the pipes
     close(stdout_pipe[1]);
-    close(stderr_pipe[1]);
-
-    result = new_capture();
-    if (!result) goto err;
-
-    int cstdout = stdout_pipe[0];
-    int cstderr = stderr_pipe[0];
+    if (stderr_pipe[1] > -1) close(stderr_pipe[1]);
+    stdout_pipe[1] = stderr_pipe[1] = -1;
+    if (!want_stderr) {
+        result->childerr.buf[0] = '\0';
+        result->childerr.eof = 1;
+    }
 
-    for (int done = 0; !done;) {
-        int maxfd = -1;
-        fd_set child_fds;
-        FD_ZERO(&child_fds);
-        if (!result->childout.eof) {
-            FD_SET(cstdout, &child_fds);
-            maxfd = cstdout;
-        }
-        if (!result->childerr.eof) {
-            FD_SET(cstderr, &child_fds);
-            maxfd = cstderr;
+    struct pollfd fds[] = {{.fd = stdout_pipe[0], .events = POLLIN},
+                           {.fd = stderr_pipe[0], .events = POLLIN}};
+    struct dynbuf *bufs[] = {&result->childout, &result->childerr};
+    while (!result->stopped && (!result->childout.eof || !result->childerr.eof)) {
+        int timeout = -1;
+        if (deadline) {
+            long ms = deadline_remaining_ms(deadline);
+            if (ms <= 0) {
+                log_warn("capture: %s did not finish in time; killing it", file);
+                result->timed_out = 1;
+                break;
+            }
+            timeout = ms > INT_MAX ? INT_MAX : ms;
         }
-        int numavail = select(maxfd + 1, &child_fds, NULL, NULL, NULL);
-        if (numavail < 0)
-            goto err;
-        else if (numavail == 0) // EOF on both pipes
-            break;
-
-        if (FD_ISSET(cstdout, &child_fds)) {
-            if (read_dynbuf(cstdout, &result->childout) < 0) goto err;
+        // poll ignores negative fds, which is how finished pipes drop out
+        for (int i = 0; i < 2; ++i) fds[i].fd = bufs[i]->eof ? -1 : fds[i].fd;
+        int numavail = poll(fds, 2, timeout);
+        if (numavail < 0) {
+            if (errno == EINTR) continue;
+            goto kill;
         }
-        if (FD_ISSET(cstderr, &child_fds)) {
-            if (read_dynbuf(cstderr, &result->childerr) < 0) goto err;
+        for (int i = 0; i < 2; ++i) {
+            // POLLHUP without POLLIN still needs a read to see EOF
+            if (fds[i].fd >= 0 && fds[i].revents && read_dynbuf(arena, fds[i].fd, bufs[i]) < 0 &&
+                errno != EINTR)
+                goto kill;
+            if (i == 0 && fds[0].fd >= 0 && fds[0].revents)
+                profile_mark(bufs[0]->eof ? PROFILE_EOF : PROFILE_FIRST_BYTE);
+            if (i == 0 && sink && bufs[0]->len > 0) {
+                if (!sink(data, bufs[0]->buf, bufs[0]->len)) {
+                    log_debug("capture: no more output wanted from %s; killing it", file);
+                    result->stopped = 1;
+                    break;
+                }
+                bufs[0]->len = 0;
+            }
         }
-        done = result->childout.eof && result->childerr.eof;
     }
 
     int status;
-    waitpid(pid, &status, 0);
+    if (result->timed_out || result->stopped) kill(-pid, SIGKILL);
+    close(stdout_pipe[0]);
+    if (stderr_pipe[0] > -1) close(stderr_pipe[0]);
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
     result->status = result->signal = 0;
     if (WIFEXITED(status))
         result->status = WEXITSTATUS(status);
     else if (WIFSIGNALED(status))
         result->signal = WTERMSIG(status);
 
-    if (result->status != 0)
+    if (result->status != 0 && !result->stopped)
         log_debug("child process %s exited with status %d", file, result->status);
-    if (result->signal != 0) log_warn("child process %s killed by signal %d", file, result->signal);
+    if (result->signal != 0 && !result->timed_out && !result->stopped)
+        log_warn("child process %s killed by signal %d", file, result->signal);
     if (result->childerr.len > 0)
         log_debug("child process %s wrote to stderr:%s", file, result->childerr.buf);
     return result;
+kill:
+    // don't leave the child running (or a zombie) when giving up on it
+    kill(-pid, SIGKILL);
+    waitpid(pid, NULL, 0);
 err:
     if (stdout_pipe[0] > -1) close(stdout_pipe[0]);
     if (stdout_pipe[1] > -1) close(stdout_pipe[1]);
@@ -159,3 +226,9 @@ err:
     free_capture(result);
     return NULL;
 }
+
+struct capture *capture_child(char *const argv[], const struct timespec *deadline,
+                              struct arena *arena)
+{
+    return capture_stream(argv, deadline, arena, NULL, NULL);
+}
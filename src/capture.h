@@ -1,6 +1,9 @@
 #pragma once
 
 #include <stdio.h> // for size_t
+#include <time.h>  // for timespec
+
+struct arena;
 
 /// Dynamically allocated buffer for reading files
 struct dynbuf
@@ -18,12 +21,31 @@ struct capture
     struct dynbuf childerr;
     int status; // exit status that child passed (if any)
     int signal; // signal that killed the child (if any)
+    int timed_out; // child was killed at the deadline; output is partial
+    int stopped; // child was killed because the sink wanted no more output
+    struct arena *arena; // where the buffers come from (NULL: heap)
 
     void (*free)(struct capture *);
 };
 
-/// Allocate new Subprocess capture
-struct capture *new_capture();
+/// Allocate new Subprocess capture and its buffers from `arena` (NULL: heap)
+struct capture *new_capture(struct arena *arena);
 
 /// Spawn subprocess to capture command
-struct capture *capture_child(char *const argv[]);
+///
+/// If `deadline` (CLOCK_MONOTONIC) is not NULL and passes before the child
+/// exits, kill the child's process group and set `timed_out`. The result
+/// and its buffers come from `arena` (NULL: heap).
+struct capture *capture_child(char *const argv[], const struct timespec *deadline,
+                              struct arena *arena);
+
+/// Receive the next `len` bytes of child stdout; return 0 to stop (and kill) the child
+typedef int (*capture_sink)(void *data, const char *buf, size_t len);
+
+/// Spawn subprocess like capture_child(), passing stdout to `sink` as it arrives
+///
+/// Output is read into a fixed buffer and not kept, so `childout` of the
+/// result is empty. If `sink` asks to stop, kill the child's process group
+/// and set `stopped`.
+struct capture *capture_stream(char *const argv[], const struct timespec *deadline,
+                               struct arena *arena, capture_sink sink, void *data);
@@ -0,0 +1,209 @@
+#include "config.h"
+#include "util.h"     // for map_file, path_join, str_ndup
+#include <ctype.h>    // for isspace, isalnum, tolower
+#include <limits.h>   // for PATH_MAX
+#include <stdlib.h>   // for free, getenv, malloc
+#include <string.h>   // for strchr, strlen, strncasecmp, strrchr
+#include <strings.h>  // for strcasecmp
+#include <sys/mman.h> // for munmap
+
+/// Parsed form of a lookup key
+struct config_key
+{
+    const char *section;
+    size_t section_len;
+    const char *subsection; // NULL if key has no subsection
+    size_t subsection_len;
+    const char *name;
+};
+
+static int split_key(const char *key, struct config_key *k)
+{
+    const char *first = strchr(key, '.');
+    const char *last = strrchr(key, '.');
+    if (!first || !last[1]) return 0;
+    k->section = key;
+    k->section_len = first - key;
+    k->subsection = first == last ? NULL : first + 1;
+    k->subsection_len = first == last ? 0 : (size_t)(last - first - 1);
+    k->name = last + 1;
+    return 1;
+}
+
+/// Parse section header starting after '['; return whether it matches key
+static int parse_header(const char **pp, const char *end, const struct config_key *k)
+{
+    const char *p = *pp;
+    const char *name = p;
+    while (p < end && (isalnum(*p) || *p == '-' || *p == '.')) ++p;
+    const char *dot = memchr(name, '.', p - name);
+    size_t name_len = (dot ? dot : p) - name;
+    int match = name_len == k->section_len && !strncasecmp(name, k->section, name_len);
+
+    char sub[256];
+    size_t sub_len = 0;
+    int has_sub = 0;
+    if (dot) {
+        // deprecated [section.subsection] syntax, matched case-insensitively
+        has_sub = 1;
+        sub_len = p - dot - 1;
+        if (!k->subsection || sub_len != k->subsection_len ||
+            strncasecmp(dot + 1, k->subsection, sub_len))
+            match = 0;
+    } else {
+        while (p < end && (*p == ' ' || *p == '\t')) ++p;
+        if (p < end && *p == '"') {
+            has_sub = 1;
+            for (++p; p < end && *p != '"' && *p != '\n'; ++p) {
+                if (*p == '\\' && p + 1 < end) ++p;
+                if (sub_len < sizeof(sub)) sub[sub_len++] = *p;
+            }
+            if (p < end && *p == '"') ++p;
+            if (!k->subsection || sub_len != k->subsection_len ||
+                memcmp(sub, k->subsection, sub_len))
+                match = 0;
+        }
+    }
+    if (!has_sub && k->subsection) match = 0;
+    while (p < end && *p != ']' && *p != '\n') ++p;
+    if (p < end && *p == ']') ++p;
+    *pp = p;
+    return match;
+}
+
+/// Parse value after '=' up to end of (possibly continued) line
+static char *parse_value(const char **pp, const char *end)
+{
+    const char *p = *pp;
+    size_t cap = 64, len = 0, trim = 0;
+    char *val = malloc(cap);
+    if (!val) return NULL;
+    int quoted = 0;
+    for (; p < end && *p != '\n'; ++p) {
+        char c = *p;
+        if (!quoted && (c == ';' || c == '#')) {
+            while (p < end && *p != '\n') ++p;
+            break;
+        }
+        if (c == '"') {
+            quoted = !quoted;
+            trim = len + 1;
+            continue;
+        }
+        if (c == '\\' && p + 1 < end) {
+            c = *++p;
+            if (c == '\n') continue; // line continuation
+            if (c == 'n') c = '\n';
+            else if (c == 't') c = '\t';
+            else if (c == 'b') c = '\b';
+            trim = len + 1;
+        } else if (!quoted && isspace((unsigned char)c) && len == 0) {
+            continue;
+        }
+        if (len + 1 >= cap) {
+            char *tmp = realloc(val, cap *= 2);
+            if (!tmp) {
+                free(val);
+                return NULL;
+            }
+            val = tmp;
+        }
+        val[len++] = c;
+        if (quoted) trim = len;
+    }
+    // strip unquoted trailing whitespace
+    while (len > trim && isspace((unsigned char)val[len - 1])) --len;
+    val[len] = '\0';
+    *pp = p;
+    return val;
+}
+
+char *config_get(const char *path, const char *key)
+{
+    struct config_key k;
+    if (!split_key(key, &k)) return NULL;
+    size_t size;
+    const char *map = map_file(path, &size);
+    if (!map) return NULL;
+
+    const char *p = map, *end = map + size;
+    char *result = NULL;
+    int in_section = 0;
+    while (p < end) {
+        while (p < end && isspace((unsigned char)*p)) ++p;
+        if (p >= end) break;
+        if (*p == '[') {
+            ++p;
+            in_section = parse_header(&p, end, &k);
+            continue;
+        }
+        if (*p == '#' || *p == ';' || !in_section) {
+            while (p < end && *p != '\n') ++p;
+            continue;
+        }
+        const char *name = p;
+        while (p < end && (isalnum(*p) || *p == '-')) ++p;
+        size_t name_len = p - name;
+        int match = name_len == strlen(k.name) && !strncasecmp(name, k.name, name_len);
+        while (p < end && (*p == ' ' || *p == '\t')) ++p;
+        char *val = NULL;
+        if (p < end && *p == '=') {
+            ++p;
+            val = parse_value(&p, end);
+        } else {
+            val = str_ndup("true", 0);
+            while (p < end && *p != '\n') ++p;
+        }
+        if (match) {
+            free(result);
+            result = val;
+        } else {
+            free(val);
+        }
+    }
+    munmap((void *)map, size);
+    return result;
+}
+
+char *config_get_all(const char *commondir, const char *key)
+{
+    char path[PATH_MAX];
+    char *val = NULL;
+    if (commondir && path_join(path, sizeof(path), commondir, "config") &&
+        (val = config_get(path, key)))
+        return val;
+
+    const char *home = getenv("HOME");
+    const char *xdg = getenv("XDG_CONFIG_HOME");
+    if (home && path_join(path, sizeof(path), home, ".gitconfig") && (val = config_get(path, key)))
+        return val;
+    if (xdg && *xdg) {
+        if (path_join(path, sizeof(path), xdg, "git/config") && (val = config_get(path, key)))
+            return val;
+    } else if (home && path_join(path, sizeof(path), home, ".config/git/config") &&
+               (val = config_get(path, key))) {
+        return val;
+    }
+    return config_get("/etc/gitconfig", key);
+}
+
+bool config_bool(const char *value, bool def)
+{
+    if (!value) return def;
+    if (!*value || !strcasecmp(value, "false") || !strcasecmp(value, "no") ||
+        !strcasecmp(value, "off") || !strcmp(value, "0"))
+        return false;
+    return true;
+}
+
+int config_maybe_bool(const char *value)
+{
+    if (!value) return -1;
+    if (!*value || !strcasecmp(value, "false") || !strcasecmp(value, "no") ||
+        !strcasecmp(value, "off") || !strcmp(value, "0"))
+        return 0;
+    if (!strcasecmp(value, "true") || !strcasecmp(value, "yes") || !strcasecmp(value, "on") ||
+        !strcmp(value, "1"))
+        return 1;
+    return -1;
+}
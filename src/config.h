@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h> // for bool
+
+/// Look up `key` in the git config file at `path`
+///
+/// Key is given as "section.name" or "section.subsection.name". Section and
+/// name are matched case-insensitively, subsection case-sensitively. The last
+/// matching value wins, as with `git config --get`. A key without '=' has the
+/// value "true". Return allocated value or `NULL` if not found.
+char *config_get(const char *path, const char *key);
+
+/// Look up `key` in repository config, then global and system config
+///
+/// `commondir` is the shared git directory holding the repository `config`.
+char *config_get_all(const char *commondir, const char *key);
+
+/// Interpret config value as boolean, using `def` if value is `NULL`
+bool config_bool(const char *value, bool def);
+
+/// Interpret config value as boolean if it is one
+///
+/// Return 1 or 0 for a boolean value and -1 for `NULL` or anything else
+/// (such as a path), like git_config_maybe_bool().
+int config_maybe_bool(const char *value);
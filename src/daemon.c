@@ -0,0 +1,348 @@
+#include "daemon.h"
+#include "arena.h"      // for arena, arena_alloc, arena_reset, arena_free
+#include "discover.h"   // for discover_repo, DISCOVER_FOUND, DISCOVER_NONE
+#include "format.h"     // for format, format_cached, format_render, format_cache_clear
+#include "log.h"        // for log_info, log_error, log_debug, log_warn
+#include "options.h"    // for options
+#include "plan.h"       // for plan_sprint, PLAN_INDEX, PLAN_WORKTREE, PLAN_UNTRACKED, PLAN_SUBMODULES, ...
+#include "repo.h"       // for git_repo, new_git_repo, parse_porcelain
+#include "status.h"     // for new_status_ctx, native_update_paths, native_untracked_dirs
+#include "util.h"       // for runtime_path, str_ndup, write_all
+#include "watch.h"      // for repo_watch, watch_init, watch_repo, watch_read, watch_clear, watch_untracked
+#include <errno.h>      // for errno, EINTR
+#include <fcntl.h>      // for fcntl, F_SETFD, FD_CLOEXEC
+#include <limits.h>     // for PATH_MAX
+#include <poll.h>       // for poll, pollfd, POLLIN
+#include <signal.h>     // for sigaction, SIGINT, SIGTERM, SIGPIPE, SIG_IGN
+#include <stdint.h>     // for uint64_t
+#include <stdio.h>      // for snprintf
+#include <stdlib.h>     // for free, strtoul
+#include <string.h>     // for memchr, strcmp, strlen, strerror, strnlen
+#include <sys/socket.h> // for socket, bind, listen, accept, connect, setsockopt
+#include <sys/time.h>   // for timeval
+#include <sys/un.h>     // for sockaddr_un
+#include <unistd.h>     // for close, read, write, unlink
+
+// Wire protocol, one request per connection:
+//   request:  <directory> NUL <format> NUL <timeout> NUL, then the client
+//             shuts down writing; <timeout> is the client's -t in decimal
+//   response: one status byte ('o' ok, 'e' error) followed by the rendered
+//             prompt or an error message; the daemon then closes the socket
+
+#define MAX_REPOS 64
+#define MAX_REQUEST (PATH_MAX + 4096)
+#define CLIENT_TIMEOUT_MS 2000
+#define REQUEST_TIMEOUT_MS 1000
+// Longest any request waits for git: requests are served one at a time, and
+// the client gives up after CLIENT_TIMEOUT_MS
+#define GIT_TIMEOUT_MS 1000
+
+/// Repository state kept warm between requests
+struct repo_slot
+{
+    char *directory;
+    struct git_repo *repo;
+    /// Changes since the last request, or NULL if results cannot be reused
+    struct repo_watch *watch;
+    /// `plan_source` bits computed by an earlier request
+    unsigned valid;
+    uint64_t last_used;
+};
+
+static struct repo_slot slots[MAX_REPOS];
+static uint64_t tick;
+/// Memory for one request, released after its reply
+static struct arena request_arena;
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+int daemon_socket_path(char *buf, size_t bufsize)
+{
+    return runtime_path(buf, bufsize, "daemon.sock");
+}
+
+static int fill_addr(struct sockaddr_un *addr)
+{
+    char path[PATH_MAX];
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (!daemon_socket_path(path, sizeof(path)) || strlen(path) >= sizeof(addr->sun_path)) {
+        log_error("daemon: cannot determine socket path");
+        return 0;
+    }
+    strcpy(addr->sun_path, path);
+    return 1;
+}
+
+static void set_timeout(int fd, int ms)
+{
+    struct timeval tv = {.tv_sec = ms / 1000, .tv_usec = (ms % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/// Read until EOF or `bufsize` bytes; return bytes read or -1
+static ssize_t read_all(int fd, char *buf, size_t bufsize)
+{
+    size_t len = 0;
+    while (len < bufsize) {
+        ssize_t n = read(fd, buf + len, bufsize - len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) break;
+        len += n;
+    }
+    return len;
+}
+
+static void free_slot(struct repo_slot *slot)
+{
+    watch_free(slot->watch);
+    if (slot->repo) slot->repo->free(slot->repo);
+    free(slot->directory);
+    memset(slot, 0, sizeof(*slot));
+}
+
+/// Find state for `directory`, evicting the least recently used slot if full
+///
+/// Empty slots may sit anywhere in the table, left by failed allocations.
+static struct repo_slot *get_slot(const char *directory)
+{
+    struct repo_slot *victim = NULL;
+    for (int i = 0; i < MAX_REPOS; ++i) {
+        struct repo_slot *slot = &slots[i];
+        if (!slot->directory) {
+            if (!victim || victim->directory) victim = slot;
+            continue;
+        }
+        if (!strcmp(slot->directory, directory)) {
+            slot->last_used = ++tick;
+            return slot;
+        }
+        if (!victim || (victim->directory && slot->last_used < victim->last_used)) victim = slot;
+    }
+    if (victim->directory) {
+        log_debug("daemon: evicting %s", victim->directory);
+        free_slot(victim);
+    }
+    victim->directory = str_ndup(directory, 0);
+    victim->repo = new_git_repo(NULL);
+    victim->last_used = ++tick;
+    if (!victim->directory || !victim->repo || !(victim->repo->status = new_status_ctx(victim->repo))) {
+        free_slot(victim);
+        return NULL;
+    }
+    // watch before the first scan so that no change slips in between
+    if (discover_repo(victim->repo, directory) == DISCOVER_FOUND) victim->watch = watch_repo(victim->repo);
+    return victim;
+}
+
+/// Return the sources in `plan` that have to be recomputed for `slot`
+///
+/// Worktree edits alone are applied to the results kept from the last scan.
+static unsigned stale_sources(struct repo_slot *slot, unsigned plan)
+{
+    struct repo_watch *w = slot->watch;
+    if (!w || w->incomplete) return plan;
+    if (w->rewatch) watch_refresh(w);
+    unsigned stale = plan & ~(slot->valid & ~w->dirty);
+    if ((stale & (PLAN_INDEX | PLAN_WORKTREE)) == PLAN_WORKTREE && !w->paths_lost &&
+        native_update_paths(slot->repo, (const char *const *)w->paths, w->nr_paths))
+        stale &= ~PLAN_WORKTREE;
+    // both feed the same count, which is cleared and recomputed as a whole
+    if (stale & (PLAN_INDEX | PLAN_WORKTREE)) stale |= PLAN_INDEX | PLAN_WORKTREE;
+    // changes inside submodules are not watched, nor is the stash reflog,
+    // which may be rewritten without touching refs/stash, nor are the
+    // markers of operations in progress; the latter two are cheap to read
+    unsigned always = PLAN_SUBMODULES | PLAN_STASH | PLAN_OPERATION;
+    // untracked directories left unwatched by the last count
+    if (w->untracked_unwatched) always |= PLAN_UNTRACKED;
+    return stale | (plan & always);
+}
+
+static void reply(int fd, char status, const char *msg, size_t len)
+{
+    if (!write_all(fd, &status, 1) || !write_all(fd, msg, len))
+        log_warn("daemon: failed to write reply: %s", strerror(errno));
+}
+
+static void handle_client(int fd)
+{
+    char req[MAX_REQUEST];
+    set_timeout(fd, REQUEST_TIMEOUT_MS);
+    ssize_t len = read_all(fd, req, sizeof(req));
+    const char *directory = req;
+    size_t dir_len = len > 0 ? strnlen(req, len) : (size_t)len;
+    if (len <= 0 || dir_len + 1 >= (size_t)len || !memchr(req + dir_len + 1, '\0', len - dir_len - 1)) {
+        const char *msg = "malformed request";
+        reply(fd, 'e', msg, strlen(msg));
+        return;
+    }
+    const char *format = req + dir_len + 1;
+    // clients from before the timeout was sent leave it out
+    size_t fmt_end = dir_len + 1 + strlen(format) + 1;
+    unsigned timeout = fmt_end < (size_t)len && memchr(req + fmt_end, '\0', len - fmt_end)
+                           ? strtoul(req + fmt_end, NULL, 10)
+                           : 0;
+    if (!timeout || timeout > GIT_TIMEOUT_MS) timeout = GIT_TIMEOUT_MS;
+    // compiled once, then reused by every request in the same format
+    const struct format *fmt = format_cached(format);
+    if (!fmt) {
+        const char *msg = "invalid format string";
+        reply(fd, 'e', msg, strlen(msg));
+        return;
+    }
+    struct repo_slot *slot = get_slot(directory);
+    if (!slot) {
+        const char *msg = "out of memory";
+        reply(fd, 'e', msg, strlen(msg));
+        return;
+    }
+    struct git_repo *repo = slot->repo;
+    if (!repo->gitdir) {
+        // outside a repository there is nothing to show; one created since is taken up here
+        if (discover_repo(repo, directory) == DISCOVER_NONE) {
+            reply(fd, 'o', "", 0);
+            return;
+        }
+        if (repo->gitdir && !slot->watch) slot->watch = watch_repo(repo);
+    }
+    unsigned plan = fmt->plan;
+    struct options opts = {.directory = (char *)directory,
+                           .format = (char *)format,
+                           .plan = stale_sources(slot, plan),
+                           .timeout = timeout};
+    char sources[128];
+    plan_sprint(opts.plan, sources, sizeof(sources));
+    log_debug("daemon: %s: recomputing %s", directory, sources);
+    unsigned late = 0;
+    if (opts.plan) {
+        repo->clear(repo, opts.plan);
+        late = parse_porcelain(repo, &opts);
+    }
+    slot->valid = (slot->valid | plan) & ~late;
+    if (slot->watch) {
+        watch_clear(slot->watch, plan & ~late);
+        if (opts.plan & PLAN_UNTRACKED & ~late)
+            watch_untracked(slot->watch, native_untracked_dirs(repo));
+    }
+    char *out = arena_alloc(&request_arena, FORMAT_MAX_OUTPUT);
+    if (out)
+        reply(fd, 'o', out, format_render(fmt, repo, out, FORMAT_MAX_OUTPUT));
+    else
+        reply(fd, 'e', "", 0);
+    log_debug("daemon: arena: %zu allocations, %zu bytes, %zu heap blocks", request_arena.allocs,
+              request_arena.bytes, request_arena.heap_blocks);
+    arena_reset(&request_arena);
+}
+
+int run_daemon(const struct options *opts)
+{
+    (void)opts;
+    struct sockaddr_un addr;
+    if (!fill_addr(&addr)) return 1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_error("daemon: socket: %s", strerror(errno));
+        return 1;
+    }
+    // a socket file nobody answers on is left over from a dead daemon
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        log_error("daemon: already running on %s", addr.sun_path);
+        close(fd);
+        return 1;
+    }
+    unlink(addr.sun_path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0) {
+        log_error("daemon: cannot listen on %s: %s", addr.sun_path, strerror(errno));
+        close(fd);
+        return 1;
+    }
+
+    struct sigaction sa = {.sa_handler = on_signal};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    log_info("daemon: listening on %s", addr.sun_path);
+
+    // without inotify every request recomputes everything
+    struct pollfd fds[] = {{.fd = fd, .events = POLLIN}, {.fd = watch_init(), .events = POLLIN}};
+    while (!stop) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno != EINTR) log_warn("daemon: poll: %s", strerror(errno));
+            continue;
+        }
+        // drain events while idle so the kernel queue does not overflow
+        if (fds[1].revents & POLLIN) watch_read();
+        if (!(fds[0].revents & POLLIN)) continue;
+        int client = accept(fd, NULL, NULL);
+        if (client < 0) {
+            if (errno != EINTR) log_warn("daemon: accept: %s", strerror(errno));
+            continue;
+        }
+        // keep the connection out of git processes spawned for the request
+        fcntl(client, F_SETFD, FD_CLOEXEC);
+        // pick up changes made right before the request
+        watch_read();
+        handle_client(client);
+        close(client);
+    }
+
+    log_info("daemon: shutting down");
+    close(fd);
+    unlink(addr.sun_path);
+    for (int i = 0; i < MAX_REPOS; ++i)
+        if (slots[i].directory) free_slot(&slots[i]);
+    arena_free(&request_arena);
+    format_cache_clear();
+    watch_close();
+    return 0;
+}
+
+int run_client(const struct options *opts)
+{
+    // a directory that cannot be resolved is outside any repository
+    if (!opts->directory) return 1;
+    struct sockaddr_un addr;
+    if (!fill_addr(&addr)) return 0;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return 0;
+    set_timeout(fd, CLIENT_TIMEOUT_MS);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        log_debug("client: daemon not reachable: %s", strerror(errno));
+        close(fd);
+        return 0;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    char buf[MAX_REQUEST];
+    int req_len = snprintf(buf, sizeof(buf), "%s%c%s%c%u%c", opts->directory, '\0', opts->format,
+                           '\0', opts->timeout, '\0');
+    if (req_len < 0 || (size_t)req_len >= sizeof(buf)) {
+        close(fd);
+        return 0;
+    }
+    ssize_t len = -1;
+    if (write_all(fd, buf, req_len) && shutdown(fd, SHUT_WR) == 0)
+        len = read_all(fd, buf, sizeof(buf));
+    close(fd);
+    if (len < 1) {
+        log_debug("client: no reply from daemon");
+        return 0;
+    }
+    if (buf[0] != 'o') {
+        log_error("client: daemon error: %.*s", (int)len - 1, buf + 1);
+        return 0;
+    }
+    write_all(STDOUT_FILENO, buf + 1, len - 1);
+    return 1;
+}
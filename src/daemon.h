@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h> // for size_t
+
+struct options;
+
+/// Write path of the daemon socket to `buf`; return 0 if it does not fit
+///
+/// The socket lives in `$XDG_RUNTIME_DIR/git-prompt/`, falling back to a
+/// per-user directory under /tmp.
+int daemon_socket_path(char *buf, size_t bufsize);
+
+/// Serve prompt requests on the daemon socket until SIGINT/SIGTERM
+///
+/// Repository state is kept between requests. Return process exit status.
+int run_daemon(const struct options *opts);
+
+/// Ask the daemon to render `opts->format` for `opts->directory` and print it
+///
+/// Return 1 on success, 0 if the daemon could not be reached or did not
+/// answer in time; the caller should then compute the prompt itself. Print
+/// nothing for a directory that could not be resolved.
+int run_client(const struct options *opts);
@@ -0,0 +1,271 @@
+#include "discover.h"
+#include "arena.h"    // for arena_drop, arena_strndup
+#include "config.h"   // for config_bool
+#include "log.h"      // for log_debug
+#include "profile.h"  // for profile_mark
+#include "repo.h"     // for git_repo
+#include "util.h"     // for path_join, read_file, read_file_at, str_ndup
+#include <fcntl.h>    // for open, O_CLOEXEC, O_DIRECTORY, O_RDONLY
+#include <limits.h>   // for PATH_MAX
+#include <pthread.h>  // for pthread_mutex_lock, pthread_mutex_unlock
+#include <stdbool.h>  // for bool
+#include <stdlib.h>   // for realpath, free, getenv
+#include <string.h>   // for memcpy, strchr, strcmp, strcpy, strncmp, strrchr, strlen
+#include <sys/stat.h> // for stat, S_ISDIR, S_ISREG
+#include <time.h>     // for time, time_t, timespec
+#include <unistd.h>   // for close, faccessat, F_OK
+
+// Directories outside any repository remembered per process
+#define NEGATIVE_CACHE_SIZE 16
+// Deepest walk that can be remembered
+#define MAX_WALK_DEPTH 32
+
+/// Stat data of a directory walked, enough to tell whether `.git` appeared in it
+struct walked_dir
+{
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+};
+
+/// Directory found outside any repository and the directories walked from it
+struct negative_entry
+{
+    char *dir;
+    size_t depth;
+    struct walked_dir walked[MAX_WALK_DEPTH];
+};
+
+static struct negative_entry negative[NEGATIVE_CACHE_SIZE];
+/// Slot the next directory found outside a repository goes to
+static size_t negative_next;
+/// Batch mode discovers on several threads
+static pthread_mutex_t negative_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void set_walked(struct walked_dir *w, const struct stat *st)
+{
+    *w = (struct walked_dir){.dev = st->st_dev, .ino = st->st_ino, .mtime = st->st_mtim};
+}
+
+/// Check whether `dir` was found outside a repository and nothing changed since
+///
+/// Creating `.git` anywhere on the way up changes the mtime of the
+/// directory it is created in; directories modified in the second they
+/// were walked are not remembered, as with git's racily clean index entries.
+static bool known_outside(const char *dir)
+{
+    struct negative_entry entry;
+    bool found = false;
+    pthread_mutex_lock(&negative_lock);
+    for (size_t i = 0; i < NEGATIVE_CACHE_SIZE && !found; ++i) {
+        if ((found = negative[i].dir && !strcmp(negative[i].dir, dir))) entry = negative[i];
+    }
+    pthread_mutex_unlock(&negative_lock);
+    if (!found) return false;
+
+    char cur[PATH_MAX];
+    strcpy(cur, dir);
+    for (size_t i = 0; i < entry.depth; ++i) {
+        struct stat st;
+        const struct walked_dir *w = &entry.walked[i];
+        if (stat(cur, &st) < 0 || st.st_dev != w->dev || st.st_ino != w->ino ||
+            st.st_mtim.tv_sec != w->mtime.tv_sec || st.st_mtim.tv_nsec != w->mtime.tv_nsec)
+            return false;
+        char *slash = strrchr(cur, '/');
+        if (slash && cur[1]) slash[slash == cur] = '\0';
+    }
+    log_debug("discover: %s is still outside any repository", dir);
+    return true;
+}
+
+/// Remember `dir` as outside any repository, having walked `depth` directories
+static void remember_outside(const char *dir, const struct walked_dir *walked, size_t depth)
+{
+    char *copy = str_ndup(dir, 0);
+    if (!copy) return;
+    pthread_mutex_lock(&negative_lock);
+    struct negative_entry *entry = &negative[negative_next++ % NEGATIVE_CACHE_SIZE];
+    free(entry->dir);
+    entry->dir = copy;
+    entry->depth = depth;
+    memcpy(entry->walked, walked, depth * sizeof(*walked));
+    pthread_mutex_unlock(&negative_lock);
+}
+
+/// Length of the longest entry of `$GIT_CEILING_DIRECTORIES` above `dir`, or -1
+///
+/// Only absolute entries count, as with git.
+static long ceiling_len(const char *dir)
+{
+    const char *env = getenv("GIT_CEILING_DIRECTORIES");
+    long best = -1;
+    for (const char *p = env; p && *p;) {
+        const char *end = strchr(p, ':');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        const char *next = end ? end + 1 : p + len;
+        // "/" strips to "", which is above every directory
+        while (len && p[len - 1] == '/') --len;
+        if (*p == '/' && !strncmp(dir, p, len) && dir[len] == '/' && (long)len > best) best = len;
+        p = next;
+    }
+    return best;
+}
+
+/// Open `path` if it holds the minimum set of files git itself requires in a git dir
+///
+/// Return the descriptor, or -1 if it is no git dir.
+static int open_git_dir(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    if (faccessat(fd, "HEAD", F_OK, 0) == 0 &&
+        (faccessat(fd, "commondir", F_OK, 0) == 0 || faccessat(fd, "objects", F_OK, 0) == 0))
+        return fd;
+    close(fd);
+    return -1;
+}
+
+/// Resolve `path` relative to `base` (if not absolute) into allocated canonical path
+static char *resolve_relative(const char *base, const char *path)
+{
+    char buf[PATH_MAX];
+    if (*path == '/') return realpath(path, NULL);
+    if (!path_join(buf, sizeof(buf), base, path)) return NULL;
+    return realpath(buf, NULL);
+}
+
+/// Read `gitdir: <path>` file written for linked worktrees and submodules
+static char *read_gitfile(const char *dir, const char *gitfile)
+{
+    char buf[PATH_MAX];
+    const char *prefix = "gitdir: ";
+    if (read_file(gitfile, buf, sizeof(buf)) < 0) return NULL;
+    if (strncmp(buf, prefix, strlen(prefix)) != 0) {
+        log_debug("discover: invalid gitfile format: %s", gitfile);
+        return NULL;
+    }
+    return resolve_relative(dir, buf + strlen(prefix));
+}
+
+/// Take the repository named by `$GIT_DIR` (relative to `dir`, as for `git -C`)
+static enum discover_status use_git_dir_env(const char *dir, const char *env, char **gitdir,
+                                            char **workdir, int *fd)
+{
+    struct stat st;
+    if (stat(dir, &st) < 0 || !S_ISDIR(st.st_mode)) return DISCOVER_NONE;
+    if (!(*gitdir = resolve_relative(dir, env)) || (*fd = open_git_dir(*gitdir)) < 0) {
+        log_debug("discover: GIT_DIR=%s is no git dir", env);
+        return DISCOVER_NONE;
+    }
+    const char *worktree = getenv("GIT_WORK_TREE");
+    *workdir = worktree && *worktree ? resolve_relative(dir, worktree) : str_ndup(dir, 0);
+    return *workdir ? DISCOVER_FOUND : DISCOVER_ERROR;
+}
+
+/// Walk up from `dir` to the first directory with a `.git` that is a git dir
+static enum discover_status walk_up(const char *dir, char **gitdir, char **workdir, int *fd)
+{
+    char cur[PATH_MAX], dotgit[PATH_MAX];
+    struct walked_dir walked[MAX_WALK_DEPTH];
+    size_t depth = 0;
+    // a `.git` that is not (yet) a git dir could become one unnoticed
+    bool remember = true;
+    struct stat st;
+    strcpy(cur, dir);
+    if (stat(cur, &st) < 0) return DISCOVER_NONE;
+    dev_t dev = st.st_dev;
+    long ceiling = ceiling_len(dir);
+    bool across = config_bool(getenv("GIT_DISCOVERY_ACROSS_FILESYSTEM"), false);
+
+    time_t now = time(NULL);
+
+    for (;;) {
+        if (depth < MAX_WALK_DEPTH)
+            set_walked(&walked[depth], &st);
+        else
+            remember = false;
+        // another change within the same timestamp tick would go unseen
+        if (st.st_mtim.tv_sec >= now) remember = false;
+        ++depth;
+        struct stat git_st;
+        if (path_join(dotgit, sizeof(dotgit), cur[1] ? cur : "", ".git") &&
+            stat(dotgit, &git_st) == 0) {
+            if (S_ISDIR(git_st.st_mode) && (*fd = open_git_dir(dotgit)) >= 0) {
+                *gitdir = str_ndup(dotgit, 0);
+                break;
+            }
+            if (S_ISREG(git_st.st_mode)) {
+                if ((*gitdir = read_gitfile(cur, dotgit)) && (*fd = open_git_dir(*gitdir)) >= 0)
+                    break;
+                // git gives up on a broken gitfile rather than look further up
+                log_debug("discover: %s does not lead to a git dir", dotgit);
+                return DISCOVER_NONE;
+            }
+            remember = false;
+        }
+        char *slash = strrchr(cur, '/');
+        if (!slash || !cur[1] || slash - cur <= ceiling) break;
+        // "/" is the last directory looked at, as with git
+        slash[slash == cur] = '\0';
+        if (stat(cur, &st) < 0) break;
+        if (!across && st.st_dev != dev) {
+            log_debug("discover: stopping at filesystem boundary below %s", cur);
+            break;
+        }
+    }
+    if (!*gitdir) {
+        log_debug("discover: no repository found above %s", dir);
+        if (remember) remember_outside(dir, walked, depth);
+        return DISCOVER_NONE;
+    }
+    *workdir = str_ndup(cur, 0);
+    return *workdir ? DISCOVER_FOUND : DISCOVER_ERROR;
+}
+
+enum discover_status discover_repo(struct git_repo *repo, const char *dir)
+{
+    char *gitdir = NULL, *workdir = NULL, *commondir = NULL;
+    int fd = -1;
+    // a directory that could not be resolved is in no repository; nor is one
+    // that is gone, which the walk finds on its first stat(2)
+    if (!dir) return DISCOVER_NONE;
+    if (strlen(dir) >= PATH_MAX) return DISCOVER_ERROR;
+    const char *env = getenv("GIT_DIR");
+    enum discover_status status;
+    if (env && *env)
+        status = use_git_dir_env(dir, env, &gitdir, &workdir, &fd);
+    else if (known_outside(dir))
+        status = DISCOVER_NONE;
+    else
+        status = walk_up(dir, &gitdir, &workdir, &fd);
+    if (status != DISCOVER_FOUND) goto out;
+
+    // linked worktrees keep refs, objects and config in the common dir
+    char buf[PATH_MAX];
+    if (read_file_at(fd, "commondir", buf, sizeof(buf)) > 0)
+        commondir = resolve_relative(gitdir, buf);
+    if (!commondir) commondir = str_ndup(gitdir, 0);
+
+    arena_drop(repo->arena, repo->workdir);
+    arena_drop(repo->arena, repo->gitdir);
+    arena_drop(repo->arena, repo->commondir);
+    if (repo->gitdir_fd >= 0) close(repo->gitdir_fd);
+    repo->workdir = arena_strndup(repo->arena, workdir, 0);
+    repo->gitdir = arena_strndup(repo->arena, gitdir, 0);
+    repo->commondir = commondir ? arena_strndup(repo->arena, commondir, 0) : NULL;
+    repo->gitdir_fd = fd;
+    fd = -1;
+    if (!repo->workdir || !repo->gitdir || !repo->commondir) {
+        status = DISCOVER_ERROR;
+        goto out;
+    }
+    log_debug("discover: workdir=%s gitdir=%s commondir=%s", repo->workdir, repo->gitdir,
+              repo->commondir);
+    profile_mark(PROFILE_DISCOVER);
+out:
+    if (fd >= 0) close(fd);
+    free(gitdir);
+    free(workdir);
+    free(commondir);
+    return status;
+}
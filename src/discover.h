@@ -0,0 +1,26 @@
+#pragma once
+
+struct git_repo;
+
+/// Outcome of looking for a repository
+enum discover_status {
+    DISCOVER_ERROR = -1, // layout not understood; ask git instead
+    DISCOVER_NONE = 0,   // not inside a repository
+    DISCOVER_FOUND = 1,
+};
+
+/// Locate the repository containing `dir` without running git
+///
+/// Walk up from `dir` looking for `.git`, which may be a directory or a
+/// `gitdir:` file (linked worktrees and submodules). Like git, stop below
+/// the directories in `$GIT_CEILING_DIRECTORIES` and at filesystem
+/// boundaries unless `$GIT_DISCOVERY_ACROSS_FILESYSTEM` is set; with
+/// `$GIT_DIR` set, use it and `$GIT_WORK_TREE` (default: `dir`) instead.
+/// On success set `repo->workdir`, `repo->gitdir` and `repo->commondir`
+/// and keep the git dir open as `repo->gitdir_fd`. A NULL or missing `dir`
+/// is in no repository.
+///
+/// Directories found to be outside any repository are remembered for the
+/// life of the process, so that asking again takes one stat(2) per level
+/// walked, until one of those directories changes.
+enum discover_status discover_repo(struct git_repo *repo, const char *dir);
@@ -0,0 +1,254 @@
+#include "format.h"
+#include "arena.h"  // for arena_alloc, arena_drop
+#include "log.h"    // for log_warn
+#include "plan.h"   // for compile_plan
+#include "repo.h"   // for git_repo
+#include <stdlib.h> // for free, getenv
+#include <string.h> // for memcpy, strcmp, strlen
+
+// Constants
+static const char *AHEAD_GLYPH = "↑";
+static const char *BEHIND_GLYPH = "↓";
+static const char *DIRTY_GLYPH = "*";
+static const char *UNTRACKED_GLYPH = "…";
+static const char *STASH_GLYPH = "$";
+static const char *STALE_GLYPH = "~";
+
+static struct format *cache[FORMAT_CACHE_SIZE];
+/// Slot the next newly compiled format goes to
+static size_t cache_next;
+
+static void add_op(struct format *fmt, enum format_op_kind kind, enum format_field field,
+                   bool capped, const char *text)
+{
+    fmt->ops[fmt->nr++] = (struct format_op){
+        .kind = kind, .field = field, .capped = capped, .text = text, .len = text ? strlen(text) : 0};
+}
+
+/// Append literal `c` at `*text`, extending the previous op if it is a literal too
+static void add_literal(struct format *fmt, char **text, char c)
+{
+    struct format_op *last = fmt->nr ? &fmt->ops[fmt->nr - 1] : NULL;
+    if (!last || last->kind != FORMAT_LITERAL)
+        fmt->ops[fmt->nr++] = (struct format_op){.kind = FORMAT_LITERAL, .text = *text};
+    fmt->ops[fmt->nr - 1].len++;
+    *(*text)++ = c;
+}
+
+struct format *format_compile(struct arena *arena, const char *source)
+{
+    // ops, then the source and literal text; every op takes at least one
+    // character of the source
+    size_t len = strlen(source);
+    size_t size = sizeof(struct format) + (len + 1) * sizeof(struct format_op) + 2 * len + 1;
+    struct format *fmt = arena_alloc(arena, size);
+    if (!fmt) return NULL;
+    fmt->ops = (struct format_op *)(fmt + 1);
+    fmt->nr = 0;
+    char *text = (char *)(fmt->ops + len + 1);
+    fmt->source = memcpy(text, source, len + 1);
+    text += len + 1;
+    fmt->plan = compile_plan(source);
+
+    for (const char *p = source; *p; ++p) {
+        if (*p == '\\') {
+            if (p[1] == 'n') {
+                add_literal(fmt, &text, '\n');
+            } else {
+                log_warn("invalid escape sequence in format string: %s", p);
+            }
+            if (p[1]) ++p;
+            continue;
+        }
+        if (*p != '%') {
+            add_literal(fmt, &text, *p);
+            continue;
+        }
+        switch (*++p) {
+        case 'b':
+            add_op(fmt, FORMAT_STRING, FIELD_BRANCH, false, NULL);
+            break;
+        case 'c':
+            add_op(fmt, FORMAT_STRING, FIELD_COMMIT, false, NULL);
+            break;
+        case 'u':
+            add_op(fmt, FORMAT_GLYPH, FIELD_UNTRACKED, false, UNTRACKED_GLYPH);
+            break;
+        case 'U':
+            add_op(fmt, FORMAT_COUNT, FIELD_UNTRACKED, true, NULL);
+            break;
+        case 'm':
+            add_op(fmt, FORMAT_GLYPH, FIELD_CHANGED, false, DIRTY_GLYPH);
+            break;
+        case 'M':
+            add_op(fmt, FORMAT_COUNT, FIELD_CHANGED, true, NULL);
+            break;
+        case 'a':
+            add_op(fmt, FORMAT_GLYPH, FIELD_AHEAD, false, AHEAD_GLYPH);
+            break;
+        case 'A':
+            add_op(fmt, FORMAT_COUNT, FIELD_AHEAD, false, NULL);
+            break;
+        case 'z':
+            add_op(fmt, FORMAT_GLYPH, FIELD_BEHIND, false, BEHIND_GLYPH);
+            break;
+        case 'Z':
+            add_op(fmt, FORMAT_COUNT, FIELD_BEHIND, false, NULL);
+            break;
+        case 'D':
+            add_op(fmt, FORMAT_COUNT, FIELD_SUBMODULES, false, NULL);
+            break;
+        case 's':
+            add_op(fmt, FORMAT_GLYPH, FIELD_STASH, false, STASH_GLYPH);
+            break;
+        case 'S':
+            add_op(fmt, FORMAT_COUNT, FIELD_STASH, false, NULL);
+            break;
+        case 'r':
+            add_op(fmt, FORMAT_OPERATION, 0, false, NULL);
+            break;
+        case 't':
+            add_op(fmt, FORMAT_STALE, 0, false, NULL);
+            break;
+        case '%':
+            add_literal(fmt, &text, '%');
+            break;
+        case '\\':
+            // escape sequence; anything but "\n" is dropped
+            if (p[1] == 'n') add_literal(fmt, &text, '\n');
+            if (p[1]) ++p;
+            break;
+        default:
+            arena_drop(arena, fmt);
+            return NULL;
+        }
+    }
+    return fmt;
+}
+
+const struct format *format_cached(const char *source)
+{
+    for (size_t i = 0; i < FORMAT_CACHE_SIZE && cache[i]; ++i)
+        if (!strcmp(cache[i]->source, source)) return cache[i];
+    struct format *fmt = format_compile(NULL, source);
+    if (!fmt) return NULL;
+    struct format **slot = &cache[cache_next++ % FORMAT_CACHE_SIZE];
+    free(*slot);
+    *slot = fmt;
+    return fmt;
+}
+
+void format_cache_clear(void)
+{
+    for (size_t i = 0; i < FORMAT_CACHE_SIZE; ++i) {
+        free(cache[i]);
+        cache[i] = NULL;
+    }
+    cache_next = 0;
+}
+
+/// Output being rendered; `size` leaves room for the terminating NULL
+struct render
+{
+    char *buf;
+    size_t len;
+    size_t size;
+};
+
+static inline bool is_space(char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+
+/// Append `len` bytes of `str`, dropping whitespace that follows whitespace
+/// or starts the prompt
+static void emit(struct render *out, const char *str, size_t len)
+{
+    for (size_t i = 0; i < len && out->len < out->size; ++i) {
+        if (is_space(str[i]) && (!out->len || is_space(out->buf[out->len - 1]))) continue;
+        out->buf[out->len++] = str[i];
+    }
+}
+
+/// Append `val` in decimal, followed by '+' if `plus`
+static void emit_uint(struct render *out, unsigned val, bool plus)
+{
+    char num[16];
+    char *p = num + sizeof(num);
+    if (plus) *--p = '+';
+    do {
+        *--p = '0' + val % 10;
+    } while (val /= 10);
+    emit(out, p, num + sizeof(num) - p);
+}
+
+static unsigned count_field(const struct git_repo *repo, enum format_field field)
+{
+    switch (field) {
+    case FIELD_CHANGED:
+        return repo->changed;
+    case FIELD_UNTRACKED:
+        return repo->untracked;
+    case FIELD_AHEAD:
+        return repo->ahead;
+    case FIELD_BEHIND:
+        return repo->behind;
+    case FIELD_SUBMODULES:
+        return repo->dirty_submodules;
+    case FIELD_STASH:
+        return repo->stashes;
+    default:
+        return 0;
+    }
+}
+
+size_t format_render(const struct format *fmt, const struct git_repo *repo, char *buf,
+                     size_t size)
+{
+    if (!size) return 0;
+    struct render out = {.buf = buf, .size = size - 1};
+    for (size_t i = 0; i < fmt->nr; ++i) {
+        const struct format_op *op = &fmt->ops[i];
+        switch (op->kind) {
+        case FORMAT_LITERAL:
+            emit(&out, op->text, op->len);
+            break;
+        case FORMAT_STRING: {
+            // not known outside a repository or if git failed
+            const char *str = op->field == FIELD_BRANCH ? repo->branch : repo->commit;
+            if (str) emit(&out, str, strlen(str));
+            break;
+        }
+        case FORMAT_GLYPH:
+            if (count_field(repo, op->field)) emit(&out, op->text, op->len);
+            break;
+        case FORMAT_COUNT: {
+            unsigned count = count_field(repo, op->field);
+            if (!count) break;
+            if (op->capped && repo->count_cap && count > repo->count_cap)
+                emit_uint(&out, repo->count_cap, true);
+            else
+                emit_uint(&out, count, false);
+            break;
+        }
+        case FORMAT_OPERATION:
+            if (!repo->operation) break;
+            emit(&out, repo->operation, strlen(repo->operation));
+            if (repo->steps) {
+                emit(&out, " ", 1);
+                emit_uint(&out, repo->step, false);
+                emit(&out, "/", 1);
+                emit_uint(&out, repo->steps, false);
+            }
+            break;
+        case FORMAT_STALE:
+            if (repo->stale) {
+                const char *glyph = getenv("GITPROMPT_STALE");
+                if (!glyph) glyph = STALE_GLYPH;
+                emit(&out, glyph, strlen(glyph));
+            }
+            break;
+        }
+    }
+    // nothing left if it was all whitespace
+    if (out.len && is_space(buf[out.len - 1])) --out.len;
+    buf[out.len] = '\0';
+    return out.len;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdbool.h> // for bool
+#include <stddef.h>  // for size_t
+
+struct arena;
+struct git_repo;
+
+/// Largest rendered prompt, NULL included; longer prompts are cut off
+#define FORMAT_MAX_OUTPUT 8192
+/// Formats kept compiled by format_cached()
+#define FORMAT_CACHE_SIZE 8
+
+/// What a compiled format op renders
+enum format_op_kind {
+    /// `text` as is
+    FORMAT_LITERAL,
+    /// String `field`, if known
+    FORMAT_STRING,
+    /// `text` if count `field` is not 0
+    FORMAT_GLYPH,
+    /// Count `field` if not 0, capped at `count_cap` if `capped`
+    FORMAT_COUNT,
+    /// Stale marker, if results are stale
+    FORMAT_STALE,
+    /// Operation in progress and its step out of how many, if any
+    FORMAT_OPERATION,
+};
+
+/// git_repo field an op refers to
+enum format_field {
+    FIELD_BRANCH,
+    FIELD_COMMIT,
+    FIELD_CHANGED,
+    FIELD_UNTRACKED,
+    FIELD_AHEAD,
+    FIELD_BEHIND,
+    FIELD_SUBMODULES,
+    FIELD_STASH,
+};
+
+struct format_op
+{
+    unsigned char kind;
+    unsigned char field;
+    bool capped;
+    unsigned len;
+    const char *text;
+};
+
+/// Format string compiled into a list of ops, with escapes resolved
+struct format
+{
+    /// Format string it was compiled from
+    const char *source;
+    /// Data sources needed to render it (`plan_source` bits)
+    unsigned plan;
+    struct format_op *ops;
+    size_t nr;
+};
+
+/// Compile `source` into a single allocation from `arena` (NULL: heap)
+///
+/// Return NULL if it holds an unknown token or out of memory.
+struct format *format_compile(struct arena *arena, const char *source);
+
+/// Compiled `source`, from a small cache of recently used formats
+///
+/// Meant for the daemon, which sees the same few formats over and over; not
+/// thread-safe. The result stays valid until the cache has taken in
+/// FORMAT_CACHE_SIZE other formats. Return NULL as format_compile() does.
+const struct format *format_cached(const char *source);
+
+/// Free formats held by format_cached()
+void format_cache_clear(void);
+
+/// Render `repo` in format `fmt` into `buf` of `size` bytes
+///
+/// Runs of whitespace collapse to their first character and leading and
+/// trailing whitespace is dropped as the prompt is written. The result is
+/// NULL-terminated and cut off if `buf` is too small. Return its length.
+size_t format_render(const struct format *fmt, const struct git_repo *repo, char *buf,
+                     size_t size);
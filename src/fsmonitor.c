@@ -0,0 +1,258 @@
+#define _GNU_SOURCE // for memrchr
+#include "fsmonitor.h"
+#include "capture.h"    // for capture, capture_child
+#include "config.h"     // for config_get_all, config_maybe_bool
+#include "index.h"      // for git_index
+#include "log.h"        // for log_debug
+#include "repo.h"       // for git_repo
+#include "util.h"       // for deadline_set, path_join, write_all
+#include <errno.h>      // for errno, EINTR
+#include <limits.h>     // for PATH_MAX
+#include <stdio.h>      // for snprintf
+#include <stdlib.h>     // for free, malloc, realloc, qsort, bsearch, strtol
+#include <string.h>     // for memcmp, memcpy, memchr, memrchr, strlen, strerror
+#include <sys/socket.h> // for socket, connect, setsockopt, AF_UNIX, SOCK_STREAM
+#include <sys/time.h>   // for timeval
+#include <sys/un.h>     // for sockaddr_un
+#include <unistd.h>     // for close, read
+
+// Time the hook or daemon gets to answer before everything is scanned instead
+#define FSMONITOR_TIMEOUT_MS 1000
+// Socket of git's builtin fsmonitor daemon, in the git dir
+#define FSMONITOR_IPC_NAME "fsmonitor--daemon.ipc"
+// Largest pkt-line payload
+#define PKT_DATA_MAX 65516
+
+/// Run hook `hook` with protocol `version`; return its output or NULL on failure
+static char *query_hook(const struct git_repo *repo, const char *hook, int version,
+                        const char *token, size_t *len)
+{
+    char script[PATH_MAX + 32], ver[4];
+    // git runs the hook through the shell in the worktree root
+    if ((size_t)snprintf(script, sizeof(script), "cd \"$1\" && shift && %s \"$@\"", hook) >=
+        sizeof(script))
+        return NULL;
+    snprintf(ver, sizeof(ver), "%d", version);
+    char *argv[] = {"/bin/sh", "-c",          script, "fsmonitor", (char *)repo->workdir,
+                    ver,       (char *)token, NULL};
+    struct timespec deadline;
+    deadline_set(&deadline, FSMONITOR_TIMEOUT_MS);
+    struct capture *result = capture_child(argv, &deadline, NULL);
+    if (!result) return NULL;
+    char *answer = NULL;
+    if (result->status || result->signal || result->timed_out || !result->childout.buf) {
+        log_debug("fsmonitor: hook failed (version %d, exit status %d)", version, result->status);
+    } else {
+        answer = result->childout.buf;
+        *len = result->childout.len;
+        result->childout.buf = NULL;
+    }
+    result->free(result);
+    return answer;
+}
+
+static int read_all(int fd, char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        buf += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/// Ask git's builtin daemon over its socket; return the answer or NULL on failure
+///
+/// Request and answer are pkt-lines ended by a flush packet "0000": the
+/// request holds the token, the answer what a version 2 hook prints.
+static char *query_ipc(const struct git_repo *repo, const char *token, size_t *len)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    char path[PATH_MAX];
+    if (!path_join(path, sizeof(path), repo->gitdir, FSMONITOR_IPC_NAME) ||
+        strlen(path) >= sizeof(addr.sun_path))
+        return NULL;
+    memcpy(addr.sun_path, path, strlen(path) + 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return NULL;
+    struct timeval tv = {.tv_sec = FSMONITOR_TIMEOUT_MS / 1000,
+                         .tv_usec = FSMONITOR_TIMEOUT_MS % 1000 * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    char *answer = NULL;
+    size_t size = 0, alloc = 0;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        log_debug("fsmonitor: daemon not reachable: %s", strerror(errno));
+        goto err;
+    }
+
+    char hdr[5];
+    for (size_t off = 0, n, token_len = strlen(token); off < token_len; off += n) {
+        n = token_len - off < PKT_DATA_MAX ? token_len - off : PKT_DATA_MAX;
+        snprintf(hdr, sizeof(hdr), "%04zx", n + 4);
+        if (!write_all(fd, hdr, 4) || !write_all(fd, token + off, n)) goto err;
+    }
+    if (!write_all(fd, "0000", 4)) goto err;
+
+    for (;;) {
+        if (!read_all(fd, hdr, 4)) goto err;
+        hdr[4] = '\0';
+        char *end;
+        long n = strtol(hdr, &end, 16);
+        if (end != hdr + 4 || n < 0) goto err;
+        if (n == 0) break;
+        // delimiter and response-end packets are not part of this protocol
+        if (n < 4) goto err;
+        n -= 4;
+        if (size + n + 1 > alloc) {
+            alloc = alloc ? alloc * 2 : 4096;
+            while (alloc < size + n + 1) alloc *= 2;
+            char *tmp = realloc(answer, alloc);
+            if (!tmp) goto err;
+            answer = tmp;
+        }
+        if (!read_all(fd, answer + size, n)) goto err;
+        size += n;
+    }
+    close(fd);
+    if (!answer) return NULL;
+    answer[size] = '\0';
+    *len = size;
+    return answer;
+err:
+    close(fd);
+    free(answer);
+    return NULL;
+}
+
+static int cmp_path(const void *a, const void *b)
+{
+    const struct fsmonitor_path *x = a, *y = b;
+    int c = memcmp(x->name, y->name, x->len < y->len ? x->len : y->len);
+    return c ? c : (x->len > y->len) - (x->len < y->len);
+}
+
+/// Sort `list` and drop duplicates; return the new length
+static size_t sort_unique(struct fsmonitor_path *list, size_t nr)
+{
+    if (!nr) return 0;
+    qsort(list, nr, sizeof(*list), cmp_path);
+    size_t out = 1;
+    for (size_t i = 1; i < nr; ++i)
+        if (cmp_path(&list[out - 1], &list[i])) list[out++] = list[i];
+    return out;
+}
+
+static bool has_path(const struct fsmonitor_path *list, size_t nr, const char *name, size_t len)
+{
+    struct fsmonitor_path key = {.name = name, .len = len};
+    return nr && bsearch(&key, list, nr, sizeof(key), cmp_path);
+}
+
+/// Collect the NULL-separated paths of `len` bytes at `p`
+///
+/// Return 0 if the answer asks for everything to be checked (a path
+/// starting with '/') or memory runs out.
+static int parse_paths(struct fsmonitor *fsm, char *p, size_t len)
+{
+    size_t max = 1;
+    for (size_t i = 0; i < len; ++i) max += !p[i];
+    fsm->paths = malloc(max * sizeof(*fsm->paths));
+    fsm->dirs = malloc(max * sizeof(*fsm->dirs));
+    if (!fsm->paths || !fsm->dirs) return 0;
+    for (char *end = p + len; p < end;) {
+        size_t n = strnlen(p, end - p);
+        if (*p == '/') return 0;
+        char *name = p;
+        p += n + 1;
+        // "dir/" stands for everything below dir
+        while (n && name[n - 1] == '/') --n;
+        if (!n) continue;
+        fsm->paths[fsm->nr++] = (struct fsmonitor_path){.name = name, .len = n};
+        const char *slash = memrchr(name, '/', n);
+        size_t dir_len = slash ? (size_t)(slash - name) + 1 : 0;
+        fsm->dirs[fsm->nr_dirs++] = (struct fsmonitor_path){.name = name, .len = dir_len};
+    }
+    fsm->nr = sort_unique(fsm->paths, fsm->nr);
+    fsm->nr_dirs = sort_unique(fsm->dirs, fsm->nr_dirs);
+    return 1;
+}
+
+bool fsmonitor_query(struct fsmonitor *fsm, const struct git_repo *repo,
+                     const struct git_index *index)
+{
+    if (fsm->queried) return fsm->valid;
+    fsm->queried = true;
+    if (!index->fsmonitor_token) return false;
+    char *hook = config_get_all(repo->commondir, "core.fsmonitor");
+    int ipc = config_maybe_bool(hook);
+    // git drops the extension when the fsmonitor is switched off
+    if (!hook || !ipc) {
+        free(hook);
+        return false;
+    }
+
+    const char *token = index->fsmonitor_token;
+    size_t len = 0;
+    int version = 2;
+    if (ipc > 0) {
+        fsm->answer = query_ipc(repo, token, &len);
+    } else {
+        char *val = config_get_all(repo->commondir, "core.fsmonitorhookversion");
+        int want = val ? (int)strtol(val, NULL, 10) : 0;
+        free(val);
+        // without a configured version, try 2 and fall back to 1 like git
+        if (want != 1) fsm->answer = query_hook(repo, hook, 2, token, &len);
+        if (!fsm->answer && want != 2) {
+            version = 1;
+            fsm->answer = query_hook(repo, hook, 1, token, &len);
+        }
+    }
+    free(hook);
+    if (!fsm->answer) return false;
+
+    char *paths = fsm->answer;
+    if (version == 2) {
+        // the new token comes first; git would record it in the index
+        size_t token_len = strnlen(paths, len);
+        if (!token_len || token_len == len) {
+            log_debug("fsmonitor: answer without token");
+            return false;
+        }
+        paths += token_len + 1;
+        len -= token_len + 1;
+    }
+    if (len && !parse_paths(fsm, paths, len)) {
+        log_debug("fsmonitor: token %s not recognized, checking everything", token);
+        return false;
+    }
+    fsm->valid = true;
+    log_debug("fsmonitor: %zu paths in %zu directories changed since %s", fsm->nr, fsm->nr_dirs,
+              token);
+    return true;
+}
+
+bool fsmonitor_changed(const struct fsmonitor *fsm, const char *path, size_t len)
+{
+    if (!fsm->nr) return false;
+    if (has_path(fsm->paths, fsm->nr, path, len)) return true;
+    for (size_t i = 0; i < len; ++i)
+        if (path[i] == '/' && has_path(fsm->paths, fsm->nr, path, i)) return true;
+    return false;
+}
+
+bool fsmonitor_dir_changed(const struct fsmonitor *fsm, const char *dir, size_t len)
+{
+    return (len && fsmonitor_changed(fsm, dir, len - 1)) ||
+           has_path(fsm->dirs, fsm->nr_dirs, dir, len);
+}
+
+void fsmonitor_clear(struct fsmonitor *fsm)
+{
+    free(fsm->answer);
+    free(fsm->paths);
+    free(fsm->dirs);
+    memset(fsm, 0, sizeof(*fsm));
+}
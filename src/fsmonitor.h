@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h> // for bool
+#include <stddef.h>  // for size_t
+
+struct git_index;
+struct git_repo;
+
+/// Path reported by the fsmonitor, pointing into its answer
+struct fsmonitor_path
+{
+    const char *name; // not NULL-terminated
+    size_t len;
+};
+
+/// Worktree changes since the index was last synced with core.fsmonitor
+struct fsmonitor
+{
+    /// Whether the fsmonitor was asked already
+    bool queried;
+    /// Whether the answer lists every change; if not, everything must be checked
+    bool valid;
+    char *answer;
+    /// Reported paths without trailing slash, sorted
+    struct fsmonitor_path *paths;
+    size_t nr;
+    /// Directories holding reported paths, "" or ending in '/', sorted
+    struct fsmonitor_path *dirs;
+    size_t nr_dirs;
+};
+
+/// Ask the hook or daemon set in core.fsmonitor what changed since the
+/// token recorded in `index`, unless `fsm` holds an answer already
+///
+/// Hook protocol versions 1 and 2 and the IPC protocol of git's builtin
+/// daemon are understood. Return whether the answer can be used; if not
+/// (no fsmonitor, no token, the token was not recognized, the query failed
+/// or timed out), every path has to be checked.
+bool fsmonitor_query(struct fsmonitor *fsm, const struct git_repo *repo,
+                     const struct git_index *index);
+
+/// Whether the fsmonitor reported `len` bytes of `path` or a directory above it
+bool fsmonitor_changed(const struct fsmonitor *fsm, const char *path, size_t len);
+
+/// Whether the listing of directory `dir` ("" or ending in '/', `len` bytes)
+/// may have changed: it, a directory above it or an entry in it was reported
+bool fsmonitor_dir_changed(const struct fsmonitor *fsm, const char *dir, size_t len);
+
+/// Free memory held by `fsm`
+void fsmonitor_clear(struct fsmonitor *fsm);
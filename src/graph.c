@@ -0,0 +1,553 @@
+#include "graph.h"
+#include "log.h"      // for log_debug
+#include "odb.h"      // for odb, odb_read, OBJ_COMMIT
+#include "sha1.h"     // for SHA1_RAWSZ, SHA1_HEXSZ, hex_to_oid
+#include "util.h"     // for get_be32, map_file, path_join
+#include <limits.h>   // for PATH_MAX
+#include <pthread.h>  // for pthread_mutex_lock, pthread_mutex_unlock
+#include <stdbool.h>  // for bool, true, false
+#include <stdint.h>   // for uint32_t, uint64_t, UINT32_MAX
+#include <stdio.h>    // for FILE, fopen, fgets, snprintf
+#include <stdlib.h>   // for calloc, free, malloc, realloc
+#include <string.h>   // for memcmp, memcpy, memset, strchr, strncmp
+#include <sys/mman.h> // for munmap
+#include <sys/stat.h> // for stat
+
+// commit-graph file format (Documentation/gitformat-commit-graph.txt)
+#define GRAPH_SIGNATURE 0x43475048 // "CGPH"
+#define CHUNK_OIDF 0x4f494446
+#define CHUNK_OIDL 0x4f49444c
+#define CHUNK_CDAT 0x43444154
+#define CHUNK_EDGE 0x45444745
+#define GRAPH_HEADER_SIZE 8
+#define CHUNK_TOC_ENTRY 12
+#define CDAT_SIZE (SHA1_RAWSZ + 16)
+#define PARENT_NONE 0x70000000
+#define EXTRA_EDGES 0x80000000
+#define LAST_EDGE 0x80000000
+
+#define MAX_LAYERS 64
+// Commits outside the graph read from the object database before giving up
+#define MAX_NEW_COMMITS 10000
+#define MEMO_SIZE 16
+
+#define NOT_IN_GRAPH UINT32_MAX
+// Walk flags
+#define LEFT 0x1
+#define RIGHT 0x2
+#define BOTH (LEFT | RIGHT)
+#define QUEUED 0x4
+#define PARSED 0x8
+
+/// One commit-graph file; a split graph is a chain of these
+struct graph_layer
+{
+    void *map;
+    size_t size;
+    /// Commits in this layer and in the layers below it
+    uint32_t nr, base;
+    const uint8_t *fanout;
+    const uint8_t *oids;
+    const uint8_t *cdat;
+    const uint8_t *edge;
+    uint32_t edge_nr;
+};
+
+struct commit_graph
+{
+    struct graph_layer layers[MAX_LAYERS];
+    size_t nr_layers;
+    uint32_t total;
+};
+
+/// Commit seen by the walk
+struct node
+{
+    uint8_t oid[SHA1_RAWSZ];
+    /// Topological level; 0 until known for commits outside the graph
+    uint32_t gen;
+    /// Position in the graph, or NOT_IN_GRAPH
+    uint32_t pos;
+    /// Parents of commits outside the graph, as indexes into `walk.parents`
+    uint32_t first_parent, nr_parents;
+    uint8_t flags;
+};
+
+struct walk
+{
+    struct commit_graph graph;
+    struct odb *odb;
+    struct node *nodes;
+    uint32_t nr_nodes, alloc_nodes;
+    /// Open addressing hash of node index + 1 by oid; 0 is empty
+    uint32_t *table;
+    uint32_t table_size;
+    uint32_t *parents;
+    uint32_t nr_parents, alloc_parents;
+    uint32_t nr_new;
+    /// Max-heap of node indexes by generation
+    uint32_t *heap;
+    uint32_t heap_nr, heap_alloc;
+};
+
+/// Results remembered across calls (the daemon asks about the same pairs)
+static struct
+{
+    uint8_t left[SHA1_RAWSZ];
+    uint8_t right[SHA1_RAWSZ];
+    unsigned ahead, behind;
+    uint64_t used;
+} memo[MEMO_SIZE];
+static uint64_t memo_tick;
+/// Batch mode walks several repositories at once
+static pthread_mutex_t memo_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t get_be64(const uint8_t *p)
+{
+    return (uint64_t)get_be32(p) << 32 | get_be32(p + 4);
+}
+
+/// Map and check one commit-graph file
+static int load_layer(struct graph_layer *layer, const char *path, uint32_t base)
+{
+    memset(layer, 0, sizeof(*layer));
+    if (!(layer->map = map_file(path, &layer->size))) return 0;
+    const uint8_t *map = layer->map;
+    size_t size = layer->size;
+    // version 1, SHA-1
+    if (size < GRAPH_HEADER_SIZE || get_be32(map) != GRAPH_SIGNATURE || map[4] != 1 ||
+        map[5] != 1)
+        goto err;
+    unsigned nr_chunks = map[6];
+    uint64_t cdat_len = 0;
+    if (size < GRAPH_HEADER_SIZE + (nr_chunks + 1) * CHUNK_TOC_ENTRY) goto err;
+    for (unsigned i = 0; i < nr_chunks; ++i) {
+        const uint8_t *toc = map + GRAPH_HEADER_SIZE + i * CHUNK_TOC_ENTRY;
+        uint32_t id = get_be32(toc);
+        uint64_t off = get_be64(toc + 4), end = get_be64(toc + CHUNK_TOC_ENTRY + 4);
+        if (off > end || end > size) goto err;
+        uint64_t len = end - off;
+        switch (id) {
+        case CHUNK_OIDF:
+            if (len != 256 * 4) goto err;
+            layer->fanout = map + off;
+            break;
+        case CHUNK_OIDL:
+            layer->oids = map + off;
+            layer->nr = len / SHA1_RAWSZ;
+            break;
+        case CHUNK_CDAT:
+            layer->cdat = map + off;
+            cdat_len = len;
+            break;
+        case CHUNK_EDGE:
+            layer->edge = map + off;
+            layer->edge_nr = len / 4;
+            break;
+        }
+    }
+    if (!layer->fanout || !layer->oids || !layer->cdat || cdat_len != (uint64_t)layer->nr * CDAT_SIZE ||
+        get_be32(layer->fanout + 255 * 4) != layer->nr)
+        goto err;
+    layer->base = base;
+    return 1;
+err:
+    log_debug("graph: %s is not a commit-graph we can read", path);
+    munmap(layer->map, layer->size);
+    layer->map = NULL;
+    return 0;
+}
+
+static void free_graph(struct commit_graph *graph)
+{
+    for (size_t i = 0; i < graph->nr_layers; ++i) munmap(graph->layers[i].map, graph->layers[i].size);
+    graph->nr_layers = 0;
+}
+
+/// Load `objects/info/commit-graph`, or else the split chain in `commit-graphs/`
+static int load_graph(struct commit_graph *graph, const char *commondir)
+{
+    char path[PATH_MAX], line[SHA1_HEXSZ + 8];
+    memset(graph, 0, sizeof(*graph));
+    if (!path_join(path, sizeof(path), commondir, "objects/info/commit-graph")) return 0;
+    if (load_layer(&graph->layers[0], path, 0)) {
+        graph->nr_layers = 1;
+        graph->total = graph->layers[0].nr;
+        return 1;
+    }
+    if (!path_join(path, sizeof(path), commondir, "objects/info/commit-graphs/commit-graph-chain"))
+        return 0;
+    FILE *chain = fopen(path, "re");
+    if (!chain) return 0;
+    // base layer first
+    while (fgets(line, sizeof(line), chain)) {
+        uint8_t oid[SHA1_RAWSZ];
+        if (*line == '\n') continue;
+        if (!hex_to_oid(line, oid) || graph->nr_layers == MAX_LAYERS) goto err;
+        snprintf(path, sizeof(path), "%s/objects/info/commit-graphs/graph-%.*s.graph", commondir,
+                 SHA1_HEXSZ, line);
+        struct graph_layer *layer = &graph->layers[graph->nr_layers];
+        if (!load_layer(layer, path, graph->total)) goto err;
+        ++graph->nr_layers;
+        graph->total += layer->nr;
+    }
+    fclose(chain);
+    return graph->nr_layers > 0;
+err:
+    fclose(chain);
+    free_graph(graph);
+    return 0;
+}
+
+/// Find global position of `oid` in the graph
+static uint32_t graph_find(const struct commit_graph *graph, const uint8_t *oid)
+{
+    for (size_t i = graph->nr_layers; i-- > 0;) {
+        const struct graph_layer *layer = &graph->layers[i];
+        uint32_t lo = oid[0] ? get_be32(layer->fanout + (oid[0] - 1) * 4) : 0;
+        uint32_t hi = get_be32(layer->fanout + oid[0] * 4);
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            int cmp = memcmp(layer->oids + (size_t)mid * SHA1_RAWSZ, oid, SHA1_RAWSZ);
+            if (!cmp) return layer->base + mid;
+            if (cmp < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+    }
+    return NOT_IN_GRAPH;
+}
+
+static const struct graph_layer *graph_layer_of(const struct commit_graph *graph, uint32_t pos)
+{
+    for (size_t i = 0; i < graph->nr_layers; ++i)
+        if (pos < graph->layers[i].base + graph->layers[i].nr) return &graph->layers[i];
+    return NULL;
+}
+
+/// Look up or create node for `oid`; return its index or -1
+static int64_t add_node(struct walk *walk, const uint8_t *oid)
+{
+    uint32_t mask = walk->table_size - 1;
+    uint32_t slot = get_be32(oid) & mask;
+    for (; walk->table[slot]; slot = (slot + 1) & mask) {
+        uint32_t idx = walk->table[slot] - 1;
+        if (!memcmp(walk->nodes[idx].oid, oid, SHA1_RAWSZ)) return idx;
+    }
+    if (walk->nr_nodes == walk->alloc_nodes) {
+        uint32_t alloc = walk->alloc_nodes * 2;
+        struct node *tmp = realloc(walk->nodes, alloc * sizeof(struct node));
+        if (!tmp) return -1;
+        walk->nodes = tmp;
+        walk->alloc_nodes = alloc;
+    }
+    uint32_t idx = walk->nr_nodes++;
+    struct node *node = &walk->nodes[idx];
+    memset(node, 0, sizeof(*node));
+    memcpy(node->oid, oid, SHA1_RAWSZ);
+    node->pos = graph_find(&walk->graph, oid);
+    if (node->pos != NOT_IN_GRAPH) {
+        const struct graph_layer *layer = graph_layer_of(&walk->graph, node->pos);
+        const uint8_t *cdat = layer->cdat + (size_t)(node->pos - layer->base) * CDAT_SIZE;
+        node->gen = get_be32(cdat + SHA1_RAWSZ + 8) >> 2;
+        // written by a git too old to compute generation numbers
+        if (!node->gen) return -1;
+    } else if (++walk->nr_new > MAX_NEW_COMMITS) {
+        log_debug("graph: too many commits outside the commit-graph");
+        return -1;
+    }
+    walk->table[slot] = idx + 1;
+    // keep the load factor at or below one half
+    if (walk->nr_nodes * 2 > walk->table_size) {
+        uint32_t size = walk->table_size * 2;
+        uint32_t *table = calloc(size, sizeof(uint32_t));
+        if (!table) return -1;
+        for (uint32_t i = 0; i < walk->nr_nodes; ++i) {
+            uint32_t s = get_be32(walk->nodes[i].oid) & (size - 1);
+            while (table[s]) s = (s + 1) & (size - 1);
+            table[s] = i + 1;
+        }
+        free(walk->table);
+        walk->table = table;
+        walk->table_size = size;
+    }
+    return idx;
+}
+
+static int push_parent(struct walk *walk, uint32_t parent)
+{
+    if (walk->nr_parents == walk->alloc_parents) {
+        uint32_t alloc = walk->alloc_parents ? walk->alloc_parents * 2 : 64;
+        uint32_t *tmp = realloc(walk->parents, alloc * sizeof(uint32_t));
+        if (!tmp) return 0;
+        walk->parents = tmp;
+        walk->alloc_parents = alloc;
+    }
+    walk->parents[walk->nr_parents++] = parent;
+    return 1;
+}
+
+/// Read parents of commit `idx` (outside the graph) from the object database
+static int parse_commit(struct walk *walk, uint32_t idx)
+{
+    enum object_type type;
+    size_t size;
+    char *buf = odb_read(walk->odb, walk->nodes[idx].oid, &type, &size);
+    if (!buf) return 0;
+    int ok = type == OBJ_COMMIT;
+    uint32_t first = walk->nr_parents, nr = 0;
+    // header lines up to the blank line; parents follow the tree line
+    for (char *line = buf; ok && *line && *line != '\n';) {
+        if (!strncmp(line, "parent ", 7)) {
+            uint8_t oid[SHA1_RAWSZ];
+            int64_t parent;
+            if (!hex_to_oid(line + 7, oid) || (parent = add_node(walk, oid)) < 0 ||
+                !push_parent(walk, parent))
+                ok = 0;
+            ++nr;
+        }
+        char *next = strchr(line, '\n');
+        if (!next) break;
+        line = next + 1;
+    }
+    free(buf);
+    walk->nodes[idx].first_parent = first;
+    walk->nodes[idx].nr_parents = nr;
+    walk->nodes[idx].flags |= PARSED;
+    return ok;
+}
+
+/// Work out generation numbers of `idx` and its ancestors outside the graph
+///
+/// A commit's generation is one more than the largest of its parents';
+/// commits in the graph already have theirs, and the graph is closed under
+/// reachability, so the search stops at the first graph commit on each path.
+static int resolve_generation(struct walk *walk, uint32_t idx)
+{
+    uint32_t *stack = NULL;
+    size_t nr = 0, alloc = 0;
+    int ok = 1;
+#define PUSH(i)                                                                                    \
+    do {                                                                                           \
+        if (nr == alloc) {                                                                         \
+            alloc = alloc ? alloc * 2 : 64;                                                        \
+            uint32_t *tmp = realloc(stack, alloc * sizeof(uint32_t));                              \
+            if (!tmp) {                                                                            \
+                ok = 0;                                                                            \
+                goto out;                                                                          \
+            }                                                                                      \
+            stack = tmp;                                                                           \
+        }                                                                                          \
+        stack[nr++] = (i);                                                                         \
+    } while (0)
+    PUSH(idx);
+    while (nr) {
+        uint32_t top = stack[nr - 1];
+        if (walk->nodes[top].gen) {
+            --nr;
+            continue;
+        }
+        if (!(walk->nodes[top].flags & PARSED) && !parse_commit(walk, top)) {
+            ok = 0;
+            goto out;
+        }
+        const struct node *node = &walk->nodes[top];
+        uint32_t gen = 0;
+        bool pending = false;
+        for (uint32_t i = 0; i < node->nr_parents; ++i) {
+            uint32_t parent = walk->parents[node->first_parent + i];
+            if (!walk->nodes[parent].gen) {
+                PUSH(parent);
+                pending = true;
+            } else if (walk->nodes[parent].gen > gen) {
+                gen = walk->nodes[parent].gen;
+            }
+        }
+        if (!pending) {
+            walk->nodes[top].gen = gen + 1;
+            --nr;
+        }
+    }
+#undef PUSH
+out:
+    free(stack);
+    return ok;
+}
+
+static int heap_push(struct walk *walk, uint32_t idx)
+{
+    if (walk->heap_nr == walk->heap_alloc) {
+        uint32_t alloc = walk->heap_alloc ? walk->heap_alloc * 2 : 64;
+        uint32_t *tmp = realloc(walk->heap, alloc * sizeof(uint32_t));
+        if (!tmp) return 0;
+        walk->heap = tmp;
+        walk->heap_alloc = alloc;
+    }
+    uint32_t i = walk->heap_nr++;
+    uint32_t gen = walk->nodes[idx].gen;
+    while (i > 0 && walk->nodes[walk->heap[(i - 1) / 2]].gen < gen) {
+        walk->heap[i] = walk->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    walk->heap[i] = idx;
+    return 1;
+}
+
+static uint32_t heap_pop(struct walk *walk)
+{
+    uint32_t top = walk->heap[0];
+    uint32_t last = walk->heap[--walk->heap_nr];
+    uint32_t gen = walk->nodes[last].gen;
+    uint32_t i = 0;
+    for (;;) {
+        uint32_t child = 2 * i + 1;
+        if (child >= walk->heap_nr) break;
+        if (child + 1 < walk->heap_nr &&
+            walk->nodes[walk->heap[child + 1]].gen > walk->nodes[walk->heap[child]].gen)
+            ++child;
+        if (walk->nodes[walk->heap[child]].gen <= gen) break;
+        walk->heap[i] = walk->heap[child];
+        i = child;
+    }
+    if (walk->heap_nr) walk->heap[i] = last;
+    return top;
+}
+
+/// Pass `flags` on to `parent`, queueing it; keep count of queued nodes not on both sides
+static int visit_parent(struct walk *walk, int64_t parent, uint8_t flags, uint32_t *active)
+{
+    if (parent < 0) return 0;
+    struct node *node = &walk->nodes[parent];
+    uint8_t old = node->flags;
+    node->flags |= flags;
+    if (!(old & QUEUED)) {
+        node->flags |= QUEUED;
+        if ((node->flags & BOTH) != BOTH) ++*active;
+        return heap_push(walk, parent);
+    }
+    if ((old & BOTH) != BOTH && (node->flags & BOTH) == BOTH) --*active;
+    return 1;
+}
+
+/// Walk down from both tips in generation order until only common history is queued
+///
+/// Every child has a larger generation than its parents, so a commit's flags
+/// are final when it leaves the queue.
+static int count_sides(struct walk *walk, uint32_t left, uint32_t right, unsigned *ahead,
+                       unsigned *behind)
+{
+    uint32_t active = 0;
+    *ahead = *behind = 0;
+    if (!visit_parent(walk, left, LEFT, &active) || !visit_parent(walk, right, RIGHT, &active))
+        return 0;
+    while (active && walk->heap_nr) {
+        uint32_t idx = heap_pop(walk);
+        uint8_t flags = walk->nodes[idx].flags & BOTH;
+        if (flags != BOTH) {
+            --active;
+            if (flags == LEFT)
+                ++*ahead;
+            else
+                ++*behind;
+        }
+        uint32_t pos = walk->nodes[idx].pos;
+        if (pos == NOT_IN_GRAPH) {
+            for (uint32_t i = 0; i < walk->nodes[idx].nr_parents; ++i) {
+                uint32_t parent = walk->parents[walk->nodes[idx].first_parent + i];
+                if (!visit_parent(walk, parent, flags, &active)) return 0;
+            }
+            continue;
+        }
+        // parents of graph commits are graph positions
+        const struct graph_layer *layer = graph_layer_of(&walk->graph, pos);
+        const uint8_t *cdat = layer->cdat + (size_t)(pos - layer->base) * CDAT_SIZE;
+        uint32_t parents[2] = {get_be32(cdat + SHA1_RAWSZ), get_be32(cdat + SHA1_RAWSZ + 4)};
+        for (int i = 0; i < 2 && parents[i] != PARENT_NONE; ++i) {
+            if (i == 1 && parents[1] & EXTRA_EDGES) {
+                // octopus merge: second and later parents are listed in EDGE
+                for (uint32_t e = parents[1] & ~EXTRA_EDGES; e < layer->edge_nr; ++e) {
+                    uint32_t edge = get_be32(layer->edge + e * 4);
+                    uint32_t p = edge & ~LAST_EDGE;
+                    const struct graph_layer *pl = graph_layer_of(&walk->graph, p);
+                    if (!pl || !visit_parent(walk, add_node(walk, pl->oids + (size_t)(p - pl->base) * SHA1_RAWSZ), flags, &active))
+                        return 0;
+                    if (edge & LAST_EDGE) break;
+                }
+                break;
+            }
+            const struct graph_layer *pl = graph_layer_of(&walk->graph, parents[i]);
+            if (!pl || !visit_parent(walk, add_node(walk, pl->oids + (size_t)(parents[i] - pl->base) * SHA1_RAWSZ), flags, &active))
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/// Check for history rewritten by grafts, shallow clones or replace refs
+static int history_is_plain(const char *commondir)
+{
+    static const char *const files[] = {"shallow", "info/grafts", "refs/replace"};
+    for (size_t i = 0; i < sizeof(files) / sizeof(*files); ++i) {
+        char path[PATH_MAX];
+        struct stat st;
+        if (!path_join(path, sizeof(path), commondir, files[i]) || !stat(path, &st)) return 0;
+    }
+    return 1;
+}
+
+int graph_ahead_behind(const char *commondir, struct odb *odb, const uint8_t *left,
+                       const uint8_t *right, unsigned *ahead, unsigned *behind)
+{
+    pthread_mutex_lock(&memo_lock);
+    for (int i = 0; i < MEMO_SIZE; ++i) {
+        if (memo[i].used && !memcmp(memo[i].left, left, SHA1_RAWSZ) &&
+            !memcmp(memo[i].right, right, SHA1_RAWSZ)) {
+            *ahead = memo[i].ahead;
+            *behind = memo[i].behind;
+            memo[i].used = ++memo_tick;
+            pthread_mutex_unlock(&memo_lock);
+            return 1;
+        }
+    }
+    pthread_mutex_unlock(&memo_lock);
+    if (!memcmp(left, right, SHA1_RAWSZ)) {
+        *ahead = *behind = 0;
+        return 1;
+    }
+    if (!history_is_plain(commondir)) return 0;
+
+    struct walk walk = {.odb = odb, .alloc_nodes = 256, .table_size = 512};
+    int ok = 0;
+    if (!load_graph(&walk.graph, commondir)) {
+        log_debug("graph: no commit-graph");
+        return 0;
+    }
+    walk.nodes = malloc(walk.alloc_nodes * sizeof(struct node));
+    walk.table = calloc(walk.table_size, sizeof(uint32_t));
+    if (!walk.nodes || !walk.table) goto out;
+    int64_t l = add_node(&walk, left), r = add_node(&walk, right);
+    if (l < 0 || r < 0 || !resolve_generation(&walk, l) || !resolve_generation(&walk, r)) goto out;
+    if (!count_sides(&walk, l, r, ahead, behind)) goto out;
+    ok = 1;
+    log_debug("graph: %u ahead, %u behind after visiting %u commits (%u outside the graph)",
+              *ahead, *behind, walk.nr_nodes, walk.nr_new);
+
+    pthread_mutex_lock(&memo_lock);
+    int victim = 0;
+    for (int i = 1; i < MEMO_SIZE; ++i)
+        if (memo[i].used < memo[victim].used) victim = i;
+    memcpy(memo[victim].left, left, SHA1_RAWSZ);
+    memcpy(memo[victim].right, right, SHA1_RAWSZ);
+    memo[victim].ahead = *ahead;
+    memo[victim].behind = *behind;
+    memo[victim].used = ++memo_tick;
+    pthread_mutex_unlock(&memo_lock);
+out:
+    free_graph(&walk.graph);
+    free(walk.nodes);
+    free(walk.table);
+    free(walk.parents);
+    free(walk.heap);
+    return ok;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h> // for uint8_t
+
+struct odb;
+
+/// Count commits reachable from `left` but not `right` (`ahead`) and the reverse (`behind`)
+///
+/// Same counts as `git rev-list --count --left-right left...right`. The walk
+/// is ordered by the generation numbers of the commit-graph
+/// (`objects/info/commit-graph` or a split chain) and stops once only common
+/// history is left. Commits newer than the graph are read from `odb`.
+/// Results are remembered per (left, right) pair. Return 1 on success, 0 if
+/// there is no usable commit-graph or history cannot be walked natively.
+int graph_ahead_behind(const char *commondir, struct odb *odb, const uint8_t *left,
+                       const uint8_t *right, unsigned *ahead, unsigned *behind);
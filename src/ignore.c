@@ -0,0 +1,257 @@
+#include "ignore.h"
+#include <ctype.h>    // for isalnum, isalpha, isblank, iscntrl, isdigit, isgraph, ...
+#include <errno.h>    // for errno, ENOENT, ENOTDIR, ELOOP
+#include <fcntl.h>    // for openat, O_RDONLY, O_CLOEXEC, O_NOFOLLOW
+#include <stdlib.h>   // for malloc, calloc, free
+#include <string.h>   // for memcpy, memset, strchr, strlen, strncmp, strrchr
+#include <sys/stat.h> // for fstat, stat
+#include <unistd.h>   // for close, read
+
+// Pattern flags
+#define PATTERN_NEGATIVE 0x1
+#define PATTERN_MUSTBEDIR 0x2
+#define PATTERN_NODIR 0x4 // no slash: matched against the last path component
+
+// Results of one wildmatch step
+enum wild_result { WILD_MATCH, WILD_NOMATCH, WILD_ABORT_ALL, WILD_ABORT_TO_STARSTAR };
+
+/// Match character `c` against the `[:name:]` class of `len` bytes; -1 if unknown
+static int match_class(const unsigned char *name, size_t len, unsigned char c)
+{
+    static const struct
+    {
+        const char *name;
+        int (*test)(int);
+    } classes[] = {{"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank},
+                   {"cntrl", iscntrl}, {"digit", isdigit}, {"graph", isgraph},
+                   {"lower", islower}, {"print", isprint}, {"punct", ispunct},
+                   {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit}};
+    for (size_t i = 0; i < sizeof(classes) / sizeof(*classes); ++i)
+        if (strlen(classes[i].name) == len && !strncmp(classes[i].name, (const char *)name, len))
+            return classes[i].test(c) != 0;
+    return -1;
+}
+
+/// Match a bracket expression starting after '['; advance `pp` to its ']'
+static enum wild_result match_bracket(const unsigned char **pp, unsigned char t, unsigned flags)
+{
+    const unsigned char *p = *pp;
+    unsigned char c = *p, prev = 0;
+    bool negated = c == '!' || c == '^', matched = false;
+    if (negated) c = *++p;
+    // a ']' right after the opening bracket is literal
+    do {
+        if (!c) return WILD_ABORT_ALL;
+        if (c == '\\') {
+            if (!(c = *++p)) return WILD_ABORT_ALL;
+            if (t == c) matched = true;
+        } else if (c == '-' && prev && p[1] && p[1] != ']') {
+            c = *++p;
+            if (c == '\\' && !(c = *++p)) return WILD_ABORT_ALL;
+            if (t <= c && t >= prev) matched = true;
+            c = 0; // a range cannot start a new range
+        } else if (c == '[' && p[1] == ':') {
+            const unsigned char *name = p + 2, *end = name;
+            while (*end && *end != ']') ++end;
+            if (!*end) return WILD_ABORT_ALL;
+            if (end - name < 1 || end[-1] != ':') {
+                // no ":]", so the '[' is literal
+                if (t == '[') matched = true;
+            } else {
+                int in_class = match_class(name, end - name - 1, t);
+                if (in_class < 0) return WILD_ABORT_ALL;
+                if (in_class) matched = true;
+                p = end;
+                c = 0;
+            }
+        } else if (t == c) {
+            matched = true;
+        }
+        prev = c;
+    } while ((c = *++p) != ']');
+    *pp = p;
+    if (matched == negated || (flags & WM_PATHNAME && t == '/')) return WILD_NOMATCH;
+    return WILD_MATCH;
+}
+
+/// Match `text` against `p`; `start` is the beginning of the whole pattern
+static enum wild_result dowild(const unsigned char *p, const unsigned char *text,
+                               const unsigned char *start, unsigned flags)
+{
+    for (; *p; ++text, ++p) {
+        unsigned char t = *text, c = *p;
+        if (!t && c != '*') return WILD_ABORT_ALL;
+        switch (c) {
+        case '\\':
+            c = *++p;
+            // fall through
+        default:
+            if (t != c) return WILD_NOMATCH;
+            continue;
+        case '?':
+            if (flags & WM_PATHNAME && t == '/') return WILD_NOMATCH;
+            continue;
+        case '[': {
+            ++p;
+            enum wild_result res = match_bracket(&p, t, flags);
+            if (res != WILD_MATCH) return res;
+            continue;
+        }
+        case '*':
+            break;
+        }
+
+        bool match_slash;
+        if (*++p == '*') {
+            const unsigned char *prev = p - 2;
+            while (*++p == '*') {}
+            if ((prev < start || *prev == '/') && (!*p || *p == '/')) {
+                // "**/" may also match no directory at all
+                if (*p == '/' && dowild(p + 1, text, start, flags) == WILD_MATCH) return WILD_MATCH;
+                match_slash = true;
+            } else {
+                // "**" not between slashes acts like "*"
+                match_slash = !(flags & WM_PATHNAME);
+            }
+        } else {
+            match_slash = !(flags & WM_PATHNAME);
+        }
+        if (!*p) {
+            // trailing star matches the rest, but not past a slash
+            if (!match_slash && strchr((const char *)text, '/')) return WILD_NOMATCH;
+            return WILD_MATCH;
+        }
+        if (!match_slash && *p == '/') {
+            const char *slash = strchr((const char *)text, '/');
+            if (!slash) return WILD_NOMATCH;
+            // the loop increment consumes the slash in pattern and text
+            text = (const unsigned char *)slash;
+            continue;
+        }
+        for (; *text; ++text) {
+            enum wild_result res = dowild(p, text, start, flags);
+            if (res != WILD_NOMATCH) {
+                if (!match_slash || res != WILD_ABORT_TO_STARSTAR) return res;
+            } else if (!match_slash && *text == '/') {
+                return WILD_ABORT_TO_STARSTAR;
+            }
+        }
+        return WILD_ABORT_ALL;
+    }
+    return *text ? WILD_NOMATCH : WILD_MATCH;
+}
+
+bool wildmatch(const char *pattern, const char *text, unsigned flags)
+{
+    const unsigned char *p = (const unsigned char *)pattern;
+    return dowild(p, (const unsigned char *)text, p, flags) == WILD_MATCH;
+}
+
+/// Cut unescaped trailing spaces off `line`
+static void trim_trailing_spaces(char *line)
+{
+    char *space = NULL;
+    for (char *p = line; *p; ++p) {
+        if (*p == ' ') {
+            if (!space) space = p;
+            continue;
+        }
+        if (*p == '\\' && !*++p) return;
+        space = NULL;
+    }
+    if (space) *space = '\0';
+}
+
+/// Turn `line` into a pattern; return 0 if it holds none
+static int parse_pattern(char *line, struct ignore_pattern *pattern)
+{
+    if (!*line || *line == '#') return 0;
+    trim_trailing_spaces(line);
+    pattern->flags = 0;
+    if (*line == '!') {
+        pattern->flags |= PATTERN_NEGATIVE;
+        ++line;
+    }
+    size_t len = strlen(line);
+    if (len && line[len - 1] == '/') {
+        line[--len] = '\0';
+        pattern->flags |= PATTERN_MUSTBEDIR;
+    }
+    if (!len) return 0;
+    if (!strchr(line, '/')) pattern->flags |= PATTERN_NODIR;
+    // a leading slash only anchors the pattern, which has one anyway
+    pattern->pattern = *line == '/' ? line + 1 : line;
+    return 1;
+}
+
+int ignore_list_load(struct ignore_list *list, int dirfd, const char *path, const char *base,
+                     size_t base_len, bool follow)
+{
+    memset(list, 0, sizeof(*list));
+    if (!(list->base = malloc(base_len + 1))) return 0;
+    memcpy(list->base, base, base_len);
+    list->base[base_len] = '\0';
+    list->base_len = base_len;
+    int fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC | (follow ? 0 : O_NOFOLLOW));
+    // git skips a .gitignore that is a symlink
+    if (fd < 0) return errno == ENOENT || errno == ENOTDIR || errno == ELOOP;
+    struct stat st;
+    size_t size = 0;
+    if (fstat(fd, &st) < 0 || !(list->buf = malloc(st.st_size + 1))) goto err;
+    while (size < (size_t)st.st_size) {
+        ssize_t n = read(fd, list->buf + size, st.st_size - size);
+        if (n < 0) goto err;
+        if (n == 0) break;
+        size += n;
+    }
+    close(fd);
+    list->buf[size] = '\0';
+
+    size_t lines = 1;
+    for (size_t i = 0; i < size; ++i) lines += list->buf[i] == '\n';
+    if (!(list->patterns = calloc(lines, sizeof(*list->patterns)))) return 0;
+    char *line = list->buf;
+    // skip a UTF-8 byte order mark
+    if (!strncmp(line, "\xef\xbb\xbf", 3)) line += 3;
+    while (line) {
+        char *next = strchr(line, '\n');
+        if (next) {
+            if (next > line && next[-1] == '\r') next[-1] = '\0';
+            *next++ = '\0';
+        }
+        if (parse_pattern(line, &list->patterns[list->nr])) ++list->nr;
+        line = next;
+    }
+    return 1;
+err:
+    close(fd);
+    return 0;
+}
+
+void ignore_list_clear(struct ignore_list *list)
+{
+    free(list->base);
+    free(list->buf);
+    free(list->patterns);
+    memset(list, 0, sizeof(*list));
+}
+
+int ignore_list_match(const struct ignore_list *list, const char *path, bool is_dir)
+{
+    const char *basename = strrchr(path, '/');
+    basename = basename ? basename + 1 : path;
+    for (size_t i = list->nr; i-- > 0;) {
+        const struct ignore_pattern *pattern = &list->patterns[i];
+        if (pattern->flags & PATTERN_MUSTBEDIR && !is_dir) continue;
+        bool match;
+        if (pattern->flags & PATTERN_NODIR) {
+            match = wildmatch(pattern->pattern, basename, 0);
+        } else {
+            // other patterns are relative to the directory of the file
+            match = !strncmp(path, list->base, list->base_len) &&
+                    wildmatch(pattern->pattern, path + list->base_len, WM_PATHNAME);
+        }
+        if (match) return !(pattern->flags & PATTERN_NEGATIVE);
+    }
+    return -1;
+}
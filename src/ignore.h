@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h> // for bool
+#include <stddef.h>  // for size_t
+
+/// `*`, `?` and brackets do not match '/'; `**` between slashes spans directories
+#define WM_PATHNAME 0x1
+
+/// Match `text` against shell glob `pattern` the way git's wildmatch does
+///
+/// Return true on a match.
+bool wildmatch(const char *pattern, const char *text, unsigned flags);
+
+/// One line of an ignore file
+struct ignore_pattern
+{
+    const char *pattern; // NULL-terminated, points into the list's buffer
+    unsigned flags;
+};
+
+/// Patterns of one ignore file (`.gitignore`, `info/exclude`, core.excludesFile)
+struct ignore_list
+{
+    /// Directory of the file relative to the worktree, "" or ending in '/'
+    char *base;
+    size_t base_len;
+    char *buf;
+    struct ignore_pattern *patterns;
+    size_t nr;
+};
+
+/// Read ignore file `path` (relative to `dirfd`) with patterns relative to `base`
+///
+/// `base` is the first `base_len` bytes of its argument. A missing file
+/// gives an empty list. Symlinks are not followed, as git does for in-tree
+/// `.gitignore` files, unless `follow` is set. Return 0 on other errors;
+/// `list` must be cleared either way.
+int ignore_list_load(struct ignore_list *list, int dirfd, const char *path, const char *base,
+                     size_t base_len, bool follow);
+
+/// Free memory held by `list`
+void ignore_list_clear(struct ignore_list *list);
+
+/// Match `path` (relative to the worktree) against the last matching pattern
+///
+/// Return 1 if it is ignored, 0 if re-included by a negated pattern and -1
+/// if no pattern matches.
+int ignore_list_match(const struct ignore_list *list, const char *path, bool is_dir);
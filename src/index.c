@@ -0,0 +1,480 @@
+#include "index.h"
+#include "log.h"      // for log_debug, log_warn
+#include "util.h"     // for get_be32, get_be16, str_dup
+#include <errno.h>    // for errno, ENOENT
+#include <fcntl.h>    // for open, O_RDONLY, O_CLOEXEC
+#include <inttypes.h> // for PRIu64
+#include <stdio.h>    // for snprintf
+#include <stdlib.h>   // for calloc, free, malloc, realloc, strtol
+#include <string.h>   // for memcmp, memcpy, strnlen
+#include <sys/mman.h> // for mmap, munmap
+#include <sys/stat.h> // for fstat
+#include <unistd.h>   // for close
+
+#define INDEX_SIGNATURE 0x44495243 // "DIRC"
+#define INDEX_HEADER_SIZE 12
+#define ENTRY_NAME_OFFSET 62
+
+static void free_index(struct git_index *self)
+{
+    if (!self) return;
+    if (self->map) munmap(self->map, self->map_size);
+    free(self->entries);
+    free(self->paths);
+    free(self->cache_tree);
+    if (self->untracked_cache) free(self->untracked_cache->dirs);
+    free(self->untracked_cache);
+    free(self->fsmonitor_token);
+    free(self->fsmonitor_dirty);
+    free(self);
+}
+
+/// Decode offset varint used by index v4 path compression
+static uint64_t decode_varint(const unsigned char **bufp, const unsigned char *end)
+{
+    const unsigned char *buf = *bufp;
+    if (buf >= end) return UINT64_MAX;
+    unsigned char c = *buf++;
+    uint64_t val = c & 127;
+    while (c & 128) {
+        if (buf >= end) return UINT64_MAX;
+        val += 1;
+        c = *buf++;
+        val = (val << 7) + (c & 127);
+    }
+    *bufp = buf;
+    return val;
+}
+
+/// Parse all entries; return pointer past last entry or NULL on error
+static const unsigned char *parse_entries(struct git_index *index, const unsigned char *p,
+                                          const unsigned char *end)
+{
+    size_t pool_size = 0, pool_cap = 0;
+    size_t prev_off = 0, prev_len = 0;
+
+    for (uint32_t i = 0; i < index->nr; ++i) {
+        struct index_entry *ce = &index->entries[i];
+        if (end - p < ENTRY_NAME_OFFSET) return NULL;
+        ce->ctime_sec = get_be32(p);
+        ce->ctime_nsec = get_be32(p + 4);
+        ce->mtime_sec = get_be32(p + 8);
+        ce->mtime_nsec = get_be32(p + 12);
+        ce->dev = get_be32(p + 16);
+        ce->ino = get_be32(p + 20);
+        ce->mode = get_be32(p + 24);
+        ce->uid = get_be32(p + 28);
+        ce->gid = get_be32(p + 32);
+        ce->size = get_be32(p + 36);
+        memcpy(ce->oid, p + 40, SHA1_RAWSZ);
+        ce->flags = get_be16(p + 60);
+        ce->xflags = 0;
+
+        const unsigned char *name = p + ENTRY_NAME_OFFSET;
+        if (ce->flags & CE_EXTENDED) {
+            if (index->version < 3) return NULL;
+            ce->xflags = get_be16(name);
+            name += 2;
+        }
+        if (index->version < 4) {
+            size_t len = strnlen((const char *)name, end - name);
+            if (name + len >= end) return NULL;
+            ce->path = (const char *)name;
+            ce->path_len = len;
+            // entries are padded with 1-8 NULs to a multiple of 8 bytes
+            p += ((name - p) + len + 8) & ~7;
+            continue;
+        }
+
+        // v4: strip N bytes from previous path, then append NULL-terminated suffix
+        uint64_t strip = decode_varint(&name, end);
+        if (strip > prev_len) return NULL;
+        size_t suffix_len = strnlen((const char *)name, end - name);
+        if (name + suffix_len >= end) return NULL;
+        size_t keep = prev_len - strip;
+        size_t len = keep + suffix_len;
+        if (pool_size + len + 1 > pool_cap) {
+            size_t cap = pool_cap ? pool_cap * 2 : 4096;
+            while (cap < pool_size + len + 1) cap *= 2;
+            char *tmp = realloc(index->paths, cap);
+            if (!tmp) return NULL;
+            index->paths = tmp;
+            pool_cap = cap;
+        }
+        char *dst = index->paths + pool_size;
+        if (keep) memcpy(dst, index->paths + prev_off, keep);
+        memcpy(dst + keep, name, suffix_len);
+        dst[len] = '\0';
+        // store offset for now: pool may still move
+        ce->path = (const char *)(uintptr_t)pool_size;
+        ce->path_len = len;
+        prev_off = pool_size;
+        prev_len = len;
+        pool_size += len + 1;
+        p = name + suffix_len + 1;
+    }
+    if (index->version >= 4) {
+        for (uint32_t i = 0; i < index->nr; ++i)
+            index->entries[i].path = index->paths + (uintptr_t)index->entries[i].path;
+    }
+    return p;
+}
+
+/// Parse one TREE node header; return pointer past node or NULL on error
+static const unsigned char *parse_tree_node(const unsigned char *p, const unsigned char *end,
+                                            struct cache_tree *node)
+{
+    const unsigned char *nul = memchr(p, '\0', end - p);
+    if (!nul) return NULL;
+    const unsigned char *nl = memchr(nul, '\n', end - nul);
+    if (!nl) return NULL;
+    char *num_end;
+    long count = strtol((const char *)nul + 1, &num_end, 10);
+    if (*num_end != ' ') return NULL;
+    long subtrees = strtol(num_end + 1, &num_end, 10);
+    if ((const unsigned char *)num_end != nl || subtrees < 0) return NULL;
+    if (node) {
+        node->name = (const char *)p;
+        node->name_len = nul - p;
+        node->entry_count = (int32_t)count;
+        node->subtree_nr = (uint32_t)subtrees;
+    }
+    p = nl + 1;
+    if (count >= 0) {
+        if (end - p < SHA1_RAWSZ) return NULL;
+        if (node) memcpy(node->oid, p, SHA1_RAWSZ);
+        p += SHA1_RAWSZ;
+    }
+    return p;
+}
+
+/// Fill in subtree sizes; return index of next node after subtree at `pos`
+static uint32_t size_tree(struct cache_tree *nodes, uint32_t nr, uint32_t pos)
+{
+    uint32_t next = pos + 1;
+    for (uint32_t i = 0; i < nodes[pos].subtree_nr && next < nr; ++i)
+        next = size_tree(nodes, nr, next);
+    nodes[pos].size = next - pos;
+    return next;
+}
+
+static int parse_cache_tree(struct git_index *index, const unsigned char *p, uint32_t size)
+{
+    const unsigned char *end = p + size;
+    uint32_t nr = 0;
+    for (const unsigned char *q = p; q < end; ++nr)
+        if (!(q = parse_tree_node(q, end, NULL))) return 0;
+    if (!nr) return 1;
+    index->cache_tree = malloc(nr * sizeof(struct cache_tree));
+    if (!index->cache_tree) return 0;
+    for (uint32_t i = 0; i < nr; ++i) p = parse_tree_node(p, end, &index->cache_tree[i]);
+    index->cache_tree_nr = nr;
+    if (size_tree(index->cache_tree, nr, 0) != nr) {
+        log_debug("index: inconsistent cache tree, ignoring");
+        free(index->cache_tree);
+        index->cache_tree = NULL;
+        index->cache_tree_nr = 0;
+    }
+    return 1;
+}
+
+#define UNTR_STAT_SIZE 36
+
+static void parse_stat(const unsigned char *p, struct index_stat *st)
+{
+    st->ctime_sec = get_be32(p);
+    st->ctime_nsec = get_be32(p + 4);
+    st->mtime_sec = get_be32(p + 8);
+    st->mtime_nsec = get_be32(p + 12);
+    st->dev = get_be32(p + 16);
+    st->ino = get_be32(p + 20);
+    st->uid = get_be32(p + 24);
+    st->gid = get_be32(p + 28);
+    st->size = get_be32(p + 32);
+}
+
+/// Skip `nr` NULL-terminated strings; return pointer past them or NULL
+static const unsigned char *skip_strings(const unsigned char *p, const unsigned char *end,
+                                         uint64_t nr)
+{
+    for (; nr; --nr) {
+        const unsigned char *nul = memchr(p, '\0', end - p);
+        if (!nul) return NULL;
+        p = nul + 1;
+    }
+    return p;
+}
+
+/// Parse directory block `pos` and those of its subdirectories
+///
+/// Return the node after the subtree, or 0 on error.
+static uint32_t parse_untracked_dir(struct untracked_cache *uc, const unsigned char **pp,
+                                    const unsigned char *end, uint32_t pos)
+{
+    if (pos >= uc->nr) return 0;
+    struct untracked_dir *dir = &uc->dirs[pos];
+    uint64_t nr_untracked = decode_varint(pp, end);
+    uint64_t subdir_nr = decode_varint(pp, end);
+    if (nr_untracked > UINT32_MAX || subdir_nr > UINT32_MAX) return 0;
+    dir->name = (const char *)*pp;
+    if (!(*pp = skip_strings(*pp, end, 1))) return 0;
+    dir->untracked = (const char *)*pp;
+    if (!(*pp = skip_strings(*pp, end, nr_untracked))) return 0;
+    dir->nr_untracked = nr_untracked;
+    dir->subdir_nr = subdir_nr;
+    uint32_t next = pos + 1;
+    for (uint64_t i = 0; i < subdir_nr; ++i)
+        if (!(next = parse_untracked_dir(uc, pp, end, next))) return 0;
+    dir->size = next - pos;
+    return next;
+}
+
+/// Expand EWAH compressed bitmap into `bits`; return pointer past it or NULL
+///
+/// The bitmap is a sequence of 64-bit words: each marker word holds a run
+/// length of all-zero or all-one words (bits 1-32, the bit value in bit 0)
+/// and the number of literal words that follow it (bits 33-63).
+static const unsigned char *parse_ewah(const unsigned char *p, const unsigned char *end,
+                                       bool *bits, uint32_t nr)
+{
+    if (end - p < 8) return NULL;
+    uint32_t words = get_be32(p + 4);
+    p += 8;
+    if ((size_t)(end - p) < (size_t)words * 8 + 4) return NULL;
+    uint64_t pos = 0;
+    for (uint32_t w = 0; w < words;) {
+        const unsigned char *q = p + (size_t)w++ * 8;
+        uint64_t marker = (uint64_t)get_be32(q) << 32 | get_be32(q + 4);
+        uint64_t run = (marker >> 1 & 0xffffffff) * 64;
+        if (marker & 1)
+            for (uint64_t i = pos; i < pos + run && i < nr; ++i) bits[i] = true;
+        pos += run;
+        for (uint64_t lit = marker >> 33; lit && w < words; --lit, pos += 64) {
+            q = p + (size_t)w++ * 8;
+            uint64_t word = (uint64_t)get_be32(q) << 32 | get_be32(q + 4);
+            for (unsigned b = 0; b < 64 && pos + b < nr; ++b)
+                if (word >> b & 1) bits[pos + b] = true;
+        }
+    }
+    return p + (size_t)words * 8 + 4;
+}
+
+/// Parse untracked cache extension; return NULL if malformed
+static struct untracked_cache *parse_untracked_cache(const unsigned char *p, uint32_t size)
+{
+    const unsigned char *end = p + size;
+    bool *bits = NULL;
+    struct untracked_cache *uc = calloc(1, sizeof(*uc));
+    if (!uc) return NULL;
+    uint64_t ident_len = decode_varint(&p, end);
+    if (ident_len > (size_t)(end - p) || !ident_len || p[ident_len - 1]) goto err;
+    uc->ident = (const char *)p;
+    p += ident_len;
+    // stat data of info/exclude and core.excludesFile, then the walk flags
+    if (end - p < 2 * UNTR_STAT_SIZE + 4 + 2 * SHA1_RAWSZ) goto err;
+    uc->dir_flags = get_be32(p + 2 * UNTR_STAT_SIZE);
+    p += 2 * UNTR_STAT_SIZE + 4;
+    memcpy(uc->info_exclude_oid, p, SHA1_RAWSZ);
+    memcpy(uc->excludes_file_oid, p + SHA1_RAWSZ, SHA1_RAWSZ);
+    p += 2 * SHA1_RAWSZ;
+    uc->exclude_per_dir = (const char *)p;
+    if (!(p = skip_strings(p, end, 1))) goto err;
+    uint64_t nr = decode_varint(&p, end);
+    if (nr > (size_t)(end - p)) goto err;
+    if (!nr) return uc;
+
+    uc->nr = nr;
+    if (!(uc->dirs = calloc(nr, sizeof(*uc->dirs))) || !(bits = malloc(3 * nr))) goto err;
+    if (parse_untracked_dir(uc, &p, end, 0) != nr) goto err;
+    // bitmaps: valid, check only, has exclude oid
+    memset(bits, 0, 3 * nr);
+    for (int i = 0; i < 3; ++i)
+        if (!(p = parse_ewah(p, end, bits + i * nr, nr))) goto err;
+    for (uint32_t i = 0; i < nr; ++i) {
+        uc->dirs[i].valid = bits[i];
+        uc->dirs[i].check_only = bits[nr + i];
+        if (!bits[i]) continue;
+        if (end - p < UNTR_STAT_SIZE) goto err;
+        parse_stat(p, &uc->dirs[i].stat);
+        p += UNTR_STAT_SIZE;
+    }
+    for (uint32_t i = 0; i < nr; ++i) {
+        if (!bits[2 * nr + i]) continue;
+        if (end - p < SHA1_RAWSZ) goto err;
+        uc->dirs[i].has_exclude_oid = true;
+        memcpy(uc->dirs[i].exclude_oid, p, SHA1_RAWSZ);
+        p += SHA1_RAWSZ;
+    }
+    free(bits);
+    return uc;
+err:
+    free(bits);
+    free(uc->dirs);
+    free(uc);
+    return NULL;
+}
+
+/// Parse fsmonitor extension; return 0 if malformed
+///
+/// Version 1 holds a timestamp in nanoseconds, version 2 an opaque token
+/// string. Both are followed by a bitmap of entries git did not know to be
+/// up to date.
+static int parse_fsmonitor(struct git_index *index, const unsigned char *p, uint32_t size)
+{
+    const unsigned char *end = p + size;
+    if (size < 4) return 0;
+    uint32_t version = get_be32(p);
+    p += 4;
+    if (version == 1) {
+        char buf[24];
+        if (end - p < 8) return 0;
+        snprintf(buf, sizeof(buf), "%" PRIu64, (uint64_t)get_be32(p) << 32 | get_be32(p + 4));
+        index->fsmonitor_token = str_dup(buf);
+        p += 8;
+    } else if (version == 2) {
+        const unsigned char *nul = memchr(p, '\0', end - p);
+        if (!nul) return 0;
+        index->fsmonitor_token = str_dup((const char *)p);
+        p = nul + 1;
+    } else {
+        return 0;
+    }
+    if (!index->fsmonitor_token || end - p < 8) goto err;
+    uint32_t ewah_size = get_be32(p);
+    p += 4;
+    // the bitmap may be shorter than the index, but not longer
+    if (ewah_size > (size_t)(end - p) || get_be32(p) > index->nr) goto err;
+    if (!(index->fsmonitor_dirty = calloc(index->nr ? index->nr : 1, sizeof(bool)))) goto err;
+    if (!parse_ewah(p, p + ewah_size, index->fsmonitor_dirty, index->nr)) goto err;
+    return 1;
+err:
+    free(index->fsmonitor_token);
+    free(index->fsmonitor_dirty);
+    index->fsmonitor_token = NULL;
+    index->fsmonitor_dirty = NULL;
+    return 0;
+}
+
+/// Walk extensions; return 0 if a required one is not understood
+static int parse_extensions(struct git_index *index, const unsigned char *p,
+                            const unsigned char *end)
+{
+    while (end - p >= 8) {
+        const unsigned char *sig = p;
+        uint32_t size = get_be32(p + 4);
+        p += 8;
+        if ((size_t)(end - p) < size) return 0;
+        if (!memcmp(sig, "TREE", 4)) {
+            if (!parse_cache_tree(index, p, size)) return 0;
+        } else if (!memcmp(sig, "UNTR", 4)) {
+            if (!(index->untracked_cache = parse_untracked_cache(p, size)))
+                log_debug("index: unreadable untracked cache, ignoring");
+        } else if (!memcmp(sig, "FSMN", 4)) {
+            if (!parse_fsmonitor(index, p, size))
+                log_debug("index: unreadable fsmonitor extension, ignoring");
+        } else if (sig[0] < 'A' || sig[0] > 'Z') {
+            // lowercase extensions ("link" split index, "sdir" sparse index)
+            // change the meaning of the entries and must be understood
+            log_debug("index: unsupported required extension '%.4s'", sig);
+            return 0;
+        }
+        p += size;
+    }
+    return 1;
+}
+
+struct git_index *read_index(const char *path)
+{
+    struct git_index *index = calloc(1, sizeof(struct git_index));
+    if (!index) return NULL;
+    index->free = free_index;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) return index; // no index yet: nothing staged
+        goto err;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < INDEX_HEADER_SIZE + SHA1_RAWSZ) {
+        close(fd);
+        goto err;
+    }
+    index->mtime = st.st_mtim;
+    index->map_size = st.st_size;
+    index->map = mmap(NULL, index->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (index->map == MAP_FAILED) {
+        index->map = NULL;
+        goto err;
+    }
+
+    const unsigned char *p = index->map;
+    const unsigned char *end = p + index->map_size - SHA1_RAWSZ;
+    if (get_be32(p) != INDEX_SIGNATURE) {
+        log_warn("index: bad signature in %s", path);
+        goto err;
+    }
+    index->version = get_be32(p + 4);
+    index->nr = get_be32(p + 8);
+    if (index->version < 2 || index->version > 4) {
+        log_debug("index: unsupported version %u", index->version);
+        goto err;
+    }
+    if (index->nr) {
+        index->entries = malloc(index->nr * sizeof(struct index_entry));
+        if (!index->entries) goto err;
+    }
+    if (!(p = parse_entries(index, p + INDEX_HEADER_SIZE, end))) {
+        log_warn("index: corrupt entry table in %s", path);
+        goto err;
+    }
+    if (!parse_extensions(index, p, end)) goto err;
+    log_debug("index: version %u, %u entries, %u cache tree nodes", index->version, index->nr,
+              index->cache_tree_nr);
+    return index;
+err:
+    free_index(index);
+    return NULL;
+}
+
+uint32_t index_lower_bound(const struct git_index *index, const char *path, size_t len)
+{
+    uint32_t lo = 0, hi = index->nr;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const struct index_entry *ce = &index->entries[mid];
+        size_t min = ce->path_len < len ? ce->path_len : len;
+        int c = memcmp(ce->path, path, min);
+        if (c < 0 || (!c && ce->path_len < len))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int32_t cache_tree_child(const struct git_index *index, uint32_t parent, const char *name,
+                         size_t name_len)
+{
+    const struct cache_tree *nodes = index->cache_tree;
+    uint32_t child = parent + 1;
+    for (uint32_t i = 0; i < nodes[parent].subtree_nr && child < index->cache_tree_nr; ++i) {
+        if (nodes[child].name_len == name_len && !memcmp(nodes[child].name, name, name_len))
+            return (int32_t)child;
+        child += nodes[child].size;
+    }
+    return -1;
+}
+
+int32_t untracked_dir_child(const struct untracked_cache *uc, uint32_t parent, const char *name,
+                            size_t name_len)
+{
+    const struct untracked_dir *dirs = uc->dirs;
+    uint32_t child = parent + 1;
+    for (uint32_t i = 0; i < dirs[parent].subdir_nr && child < uc->nr; ++i) {
+        if (!strncmp(dirs[child].name, name, name_len) && !dirs[child].name[name_len])
+            return (int32_t)child;
+        child += dirs[child].size;
+    }
+    return -1;
+}
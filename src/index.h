@@ -0,0 +1,145 @@
+#pragma once
+
+#include "sha1.h"    // for SHA1_RAWSZ
+#include <stdbool.h> // for bool
+#include <stddef.h>  // for size_t
+#include <stdint.h>  // for uint32_t, uint16_t, uint8_t
+#include <time.h>    // for timespec
+
+// Entry flags (on-disk `flags` field)
+#define CE_ASSUME_VALID 0x8000
+#define CE_EXTENDED 0x4000
+#define CE_STAGEMASK 0x3000
+#define CE_STAGESHIFT 12
+#define CE_NAMEMASK 0x0fff
+
+// Extended entry flags (index v3+)
+#define CE_SKIP_WORKTREE 0x4000
+#define CE_INTENT_TO_ADD 0x2000
+
+#define ce_stage(ce) (((ce)->flags & CE_STAGEMASK) >> CE_STAGESHIFT)
+
+/// Single entry of the index, with stat data as last recorded by git
+struct index_entry
+{
+    uint32_t ctime_sec;
+    uint32_t ctime_nsec;
+    uint32_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t dev;
+    uint32_t ino;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t size;
+    uint8_t oid[SHA1_RAWSZ];
+    uint16_t flags;
+    uint16_t xflags;
+    uint32_t path_len;
+    /// NULL-terminated path relative to the worktree root
+    const char *path;
+};
+
+/// Node of the cached tree (TREE extension), stored in pre-order
+struct cache_tree
+{
+    const char *name; // path component, not NULL-terminated
+    uint32_t name_len;
+    int32_t entry_count; // -1 if invalidated
+    uint32_t subtree_nr;
+    uint32_t size; // number of nodes in this subtree, including self
+    uint8_t oid[SHA1_RAWSZ];
+};
+
+/// Stat data as git stores it outside of entries, truncated to 32 bits
+struct index_stat
+{
+    uint32_t ctime_sec;
+    uint32_t ctime_nsec;
+    uint32_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t dev;
+    uint32_t ino;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t size;
+};
+
+/// Directory of the untracked cache (UNTR extension), stored in pre-order
+struct untracked_dir
+{
+    const char *name; // path component, "" for the root
+    /// `nr_untracked` NULL-terminated names; directories have a trailing '/'
+    const char *untracked;
+    uint32_t nr_untracked;
+    uint32_t subdir_nr;
+    uint32_t size; // number of nodes in this subtree, including self
+    /// Whether `stat` and `untracked` are as git last listed the directory
+    bool valid;
+    /// Listed only to learn whether it holds anything untracked
+    bool check_only;
+    struct index_stat stat;
+    /// Blob id of the directory's .gitignore as last read, if any
+    bool has_exclude_oid;
+    uint8_t exclude_oid[SHA1_RAWSZ];
+};
+
+/// Untracked cache written by `git status` with core.untrackedCache
+struct untracked_cache
+{
+    /// Worktree and system the cache was written for
+    const char *ident;
+    /// Flags of the directory walk it holds results of
+    uint32_t dir_flags;
+    uint8_t info_exclude_oid[SHA1_RAWSZ];
+    uint8_t excludes_file_oid[SHA1_RAWSZ];
+    /// Name of per-directory ignore files, normally ".gitignore"
+    const char *exclude_per_dir;
+    struct untracked_dir *dirs;
+    uint32_t nr;
+};
+
+/// Parsed `.git/index` file, backed by a read-only mapping
+struct git_index
+{
+    void *map;
+    size_t map_size;
+    uint32_t version;
+    uint32_t nr;
+    struct index_entry *entries;
+    /// Path storage for index v4, where paths are prefix-compressed
+    char *paths;
+    struct cache_tree *cache_tree;
+    uint32_t cache_tree_nr;
+    /// Untracked cache (UNTR extension), NULL if absent or unreadable
+    struct untracked_cache *untracked_cache;
+    /// Token of the last core.fsmonitor query git synced the index with
+    /// (FSMN extension), NULL if absent or unreadable
+    char *fsmonitor_token;
+    /// Per entry: not known to be up to date as of `fsmonitor_token`
+    bool *fsmonitor_dirty;
+    /// Modification time of the index file itself, for racy-git checks
+    struct timespec mtime;
+
+    /// Unmap and free git_index struct
+    void (*free)(struct git_index *self);
+};
+
+/// Read and parse index file at `path`
+///
+/// A missing index file yields an empty index. Return `NULL` if the file is
+/// corrupt or uses a feature this reader does not understand (split index,
+/// sparse index, unknown required extension); the caller should then fall
+/// back to asking git.
+struct git_index *read_index(const char *path);
+
+/// Find first entry at or after the `len` bytes of `path` in index order
+uint32_t index_lower_bound(const struct git_index *index, const char *path, size_t len);
+
+/// Find child of cache tree node `parent` named `name`; return node index or -1
+int32_t cache_tree_child(const struct git_index *index, uint32_t parent, const char *name,
+                         size_t name_len);
+
+/// Find child of untracked cache directory `parent` named `name`; return node index or -1
+int32_t untracked_dir_child(const struct untracked_cache *uc, uint32_t parent, const char *name,
+                            size_t name_len);
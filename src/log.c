@@ -110,6 +110,8 @@ int log_get_level() { return L.level; }
 
 void log_set_quiet(bool enable) { L.quiet = enable; }
 
+bool log_get_quiet() { return L.quiet; }
+
 
 int log_add_callback(log_LogFn fn, void *udata, int level)
 {
@@ -1,27 +1,73 @@
+#include "arena.h"            // for arena, arena_alloc, arena_strndup, arena_free
+#include "async.h"            // for render_async
+#include "batch.h"            // for run_batch
+#include "daemon.h"           // for run_daemon, run_client
+#include "format.h"           // for format_compile, FORMAT_MAX_OUTPUT
 #include "log.h"              // for log_set_quiet, log_set_level, LOG_DEBUG
 #include "options.h"          // for options, new_options
-#include "repo.h"             // for new_git_repo, parse_porcelain, parse_r...
+#include "plan.h"             // for compile_plan, compile_limits
+#include "profile.h"          // for profile_start, profile_open, profile_mark, profile_write
+#include "repo.h"             // for render_prompt
 #include "test.h"             // for test_parse
-#include "util.h"             // for str_ndup, str_squish
-#include <bits/getopt_core.h> // for getopt, optarg, optind
+#include "util.h"             // for write_all
+#include <getopt.h>           // for getopt_long, optarg, optind, option
 #include <libgen.h>           // for basename
+#include <limits.h>           // for PATH_MAX
 #include <stdbool.h>          // for true, false
-#include <stdio.h>            // for fprintf, NULL, fclose, fputs, open_mem...
-#include <stdlib.h>           // for exit, free, getenv, realpath, strtol
-#include <unistd.h>           // for getcwd
+#include <stdio.h>            // for fprintf, NULL
+#include <stdlib.h>           // for exit, getenv, realpath, strtol
+#include <unistd.h>           // for getcwd, STDOUT_FILENO
 
 #ifndef FMT_STRING
 #define FMT_STRING "%b@%c"
 #endif
 
-/// Parse cli arguments into options struct
-struct options *parse_args(int argc, char **argv)
+/// Parse cli arguments into options struct allocated from `arena`
+struct options *parse_args(int argc, char **argv, struct arena *arena)
 {
-    struct options *options = new_options();
+    struct options *options = new_options(arena);
     if (!options) return NULL;
+    static const struct option long_options[] = {
+        {"daemon", no_argument, NULL, 'D'},
+        {"client", no_argument, NULL, 'C'},
+        {"profile", required_argument, NULL, 'P'},
+        {"batch", no_argument, NULL, 'B'},
+        {"ordered", no_argument, NULL, 'O'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"async", no_argument, NULL, 'S'},
+        {"notify", required_argument, NULL, 'N'},
+        {NULL, 0, NULL, 0},
+    };
     int opt;
-    while ((opt = getopt(argc, argv, "hqvTt:f:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "hqvzTt:n:f:j:", long_options, NULL)) != -1) {
         switch (opt) {
+        case 'D':
+            options->mode = MODE_DAEMON;
+            break;
+        case 'C':
+            options->mode = MODE_CLIENT;
+            break;
+        case 'P':
+            options->profile = optarg;
+            break;
+        case 'B':
+            options->mode = MODE_BATCH;
+            break;
+        case 'O':
+            options->ordered = true;
+            break;
+        case 'j':
+            options->jobs = strtoul(optarg, NULL, 10);
+            break;
+        case 'S':
+            options->async = true;
+            break;
+        case 'N':
+            options->notify = optarg;
+            break;
+        case 'z':
+            options->null_terminated = true;
+            break;
         case 'v':
             log_set_quiet(false);
             ++options->debug;
@@ -31,87 +77,127 @@ struct options *parse_args(int argc, char **argv)
             log_set_quiet(true);
             break;
         case 'f':
-            options->format = str_ndup(optarg, 0);
+            options->format = arena_strndup(arena, optarg, 0);
             break;
         case 't':
-            options->timeout = strtol(optarg, NULL, 10);
+            options->timeout = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            options->count_cap = strtoul(optarg, NULL, 10);
             break;
         case 'T':
             run_tests();
             exit(EXIT_SUCCESS);
             break;
         default:
-            fprintf(stderr, "Usage: %s [-h] [-V] [-v] [-t MSECS] [-f FORMAT] [dir]\n%s",
-                    basename(argv[0]),
+            fprintf(stderr,
+                    "Usage: %s [-h] [-V] [-v] [-t MSECS] [-n COUNT] [-f FORMAT] [--daemon | --client]\n"
+                    "       [--profile=FD|FILE] [--async [--notify=PID|FIFO]] [dir]\n"
+                    "       %s --batch [-z] [--ordered] [-j JOBS] [options] [dir...]\n%s",
+                    basename(argv[0]), basename(argv[0]),
                     "\nFlags:\n"
                     "  -h   show this help message and exit\n"
                     "  -V   show program version\n"
                     "  -v   increase console debug verbosity (-v, -vv, -vvv)\n"
+                    "  --daemon  serve prompts over a Unix socket, keeping repository state\n"
+                    "  --client  ask a running daemon for the prompt (computed locally if\n"
+                    "            no daemon answers)\n"
+                    "  --batch   print prompts of many directories (arguments, or lines\n"
+                    "            of stdin), computed in parallel, as \"dir<TAB>prompt\" lines\n"
+                    "  --async   print the last known prompt at once and refresh it in\n"
+                    "            a detached background process\n"
+                    "  --notify  after an async refresh changed the prompt, send SIGUSR1\n"
+                    "            to PID or write the new prompt as a line to FIFO\n"
+                    "  --ordered in batch mode, print in input order rather than as ready\n"
+                    "  -j   batch mode workers (default: number of CPUs)\n"
+                    "  -z   batch mode input and output records end with NUL, not newline\n"
+                    "  --profile  append per-phase timings and resource usage as a JSON\n"
+                    "             line to file descriptor FD or FILE\n"
                     "\nArguments:\n"
-                    "  -t   timeout threshold, in milliseconds\n"
+                    "  -t   timeout threshold, in milliseconds; past it, git is killed and\n"
+                    "       the last known results are shown\n"
+                    "  -n   largest count shown by %M and %U; larger counts show as\n"
+                    "       COUNT+ and counting stops there\n"
                     "  -T   run internal tests\n"
                     "  -f   tokenized string that determines output\n"
                     "       %b  show branch\n"
                     "       %c  show commit hash\n"
+                    "       %r  show operation in progress (REBASE 2/5, MERGING, ...)\n"
                     "       %u  indicate unknown (untracked) files with '?'\n"
                     "       %U  show count of unknown files\n"
                     "       %m  indicate uncommitted changes with '*'\n"
                     "       %M  show count of uncommitted changes\n"
                     "       %a  indicate unpushed changes with '^'\n"
                     "       %A  show count of unpushed changes\n"
+                    "       %D  show count of submodules with new commits, changes or\n"
+                    "           untracked files\n"
+                    "       %s  indicate stashed changes with '$'\n"
+                    "       %S  show count of stash entries\n"
+                    "       %t  indicate results are stale (timed out) with '~'\n"
                     "       %%  show '%'\n"
                     "  dir  location of git repo (default is cwd)\n"
                     "\nEnvironment:\n"
                     "  $GITPROMPT_FORMAT  format string");
             fprintf(stderr, " (default=\"%s\")\n", FMT_STRING);
-            free(options);
+            fputs("  $GITPROMPT_STALE   marker shown by %t instead of '~'\n"
+                  "  $GITPROMPT_PROFILE same as --profile\n",
+                  stderr);
+            arena_free(arena);
             exit(EXIT_FAILURE);
         }
     }
-    if (argv[optind]) {
-        options->directory = realpath(argv[optind], NULL);
-    } else {
-        options->directory = getcwd(NULL, 0);
+    if (options->mode == MODE_BATCH) {
+        options->paths = argv + optind;
+        options->nr_paths = argc - optind;
+    } else if ((options->directory = arena_alloc(arena, PATH_MAX))) {
+        if (argv[optind] ? !realpath(argv[optind], options->directory)
+                         : !getcwd(options->directory, PATH_MAX))
+            options->directory = NULL;
     }
+    if (!options->profile) options->profile = getenv("GITPROMPT_PROFILE");
     if (!options->format) {
         char *format = getenv("GITPROMPT_FORMAT");
         if (!format) format = FMT_STRING;
-        options->format = str_ndup(format, 0);
+        options->format = arena_strndup(arena, format, 0);
     }
     return options;
 }
 
-/// Parse format string to options_t object
+/// Compile format string into ops to render and plan of data sources to read
 void parse_format(struct options *opts)
 {
-    for (char *fmt = opts->format; *fmt; ++fmt) {
-        if (*fmt == '%') {
-            ++fmt;
-            switch (*fmt) {
-            case 'b':
-                opts->show_branch = true;
-                break;
-            case 'c':
-                opts->show_commit = true;
-                break;
-            case 'u':
-                opts->show_untracked = true;
-                break;
-            case 'm':
-                opts->show_modified = true;
-                break;
-            default:
-                break;
-            }
-        }
+    opts->compiled_format = format_compile(opts->arena, opts->format);
+    // a daemon is sent the format with every request
+    if (!opts->compiled_format && opts->mode != MODE_DAEMON) {
+        fprintf(stderr, "error: invalid format string: %s\n", opts->format);
+        exit(EXIT_FAILURE);
     }
+    opts->plan = compile_plan(opts->format);
+    compile_limits(opts->format, opts->count_cap, &opts->limits);
+}
+
+/// Log how much the arena served, then release it
+static void arena_done(struct arena *arena)
+{
+    log_debug("arena: %zu allocations, %zu bytes, %zu heap blocks", arena->allocs, arena->bytes,
+              arena->heap_blocks);
+    arena_free(arena);
 }
 
 int main(int argc, char **argv)
 {
-    struct options *options = parse_args(argc, argv);
+    profile_start();
+    // everything of this invocation is released at once on exit
+    struct arena arena = {0};
+    struct options *options = parse_args(argc, argv, &arena);
+    if (!options) return EXIT_FAILURE;
     parse_format(options);
     options->set(options);
+    // a daemon or batch serves many prompts; profile single ones instead
+    if (options->profile && *options->profile && options->mode != MODE_DAEMON &&
+        options->mode != MODE_BATCH)
+        profile_open(options->profile);
+    profile_mark(PROFILE_ARGS);
 
     int log_level = 0 - options->debug;
     log_set_level(log_level);
@@ -127,19 +213,25 @@ int main(int argc, char **argv)
         options->sprint(options, opts_debug);
         log_debug("Parsed options:\n%s", opts_debug);
     }
-    struct git_repo *repo = new_git_repo();
-    parse_porcelain(repo, options);
-
-    // Write result to buffer and print all at once
-    FILE *stream;
-    char *buf;
-    size_t buflen;
-    stream = open_memstream(&buf, &buflen);
-    parse_result(repo, options->format, stream);
-    fclose(stream);
-    str_squish(buf, true);
-    fputs(buf, stdout);
-    options->free(options);
-    repo->free(repo);
-    free(buf);
+    if (options->mode == MODE_DAEMON) {
+        int status = run_daemon(options);
+        arena_free(&arena);
+        return status;
+    }
+    if (options->mode == MODE_CLIENT && run_client(options)) {
+        arena_free(&arena);
+        return EXIT_SUCCESS;
+    }
+    if (options->mode == MODE_BATCH) {
+        int status = run_batch(options);
+        arena_free(&arena);
+        return status;
+    }
+    char buf[FORMAT_MAX_OUTPUT];
+    size_t len = options->async ? render_async(options, &arena, buf, sizeof(buf))
+                                : render_prompt(options, &arena, buf, sizeof(buf));
+    // the whole prompt in one write(2)
+    write_all(STDOUT_FILENO, buf, len);
+    profile_write(options->directory, options->format);
+    arena_done(&arena);
 }
@@ -0,0 +1,356 @@
+#include "odb.h"
+#include "log.h"      // for log_debug, log_trace
+#include "util.h"     // for get_be32, map_file, path_join, str_ndup
+#include <dirent.h>   // for opendir, readdir, closedir
+#include <limits.h>   // for PATH_MAX
+#include <stdio.h>    // for snprintf
+#include <stdlib.h>   // for calloc, free, malloc, realloc, strtoul
+#include <string.h>   // for memchr, memcmp, memcpy, memset, strcmp, strlen, strncmp
+#include <sys/mman.h> // for munmap
+#include <zlib.h>     // for z_stream, inflate, inflateInit, inflateEnd
+
+#define PACK_IDX_SIGNATURE 0xff744f63 // "\377tOc"
+#define PACK_IDX_HEADER_SIZE 8
+#define PACK_FANOUT_SIZE (256 * 4)
+
+/// Mapped pack index and (lazily) pack data
+struct packfile
+{
+    char *pack_path;
+    const unsigned char *idx;
+    size_t idx_size;
+    const unsigned char *pack;
+    size_t pack_size;
+    uint32_t nr;
+};
+
+static void unload_packs(struct odb *odb)
+{
+    for (size_t i = 0; i < odb->nr_packs; ++i) {
+        struct packfile *p = &odb->packs[i];
+        if (p->idx) munmap((void *)p->idx, p->idx_size);
+        if (p->pack) munmap((void *)p->pack, p->pack_size);
+        free(p->pack_path);
+    }
+    free(odb->packs);
+    odb->packs = NULL;
+    odb->nr_packs = 0;
+    odb->packs_loaded = 0;
+}
+
+static void free_odb(struct odb *self)
+{
+    if (!self) return;
+    unload_packs(self);
+    free(self->objdir);
+    free(self);
+}
+
+struct odb *new_odb(const char *commondir)
+{
+    char path[PATH_MAX];
+    struct odb *odb = calloc(1, sizeof(struct odb));
+    if (!odb) return NULL;
+    odb->free = free_odb;
+    if (!path_join(path, sizeof(path), commondir, "objects") ||
+        !(odb->objdir = str_ndup(path, 0))) {
+        free(odb);
+        return NULL;
+    }
+    return odb;
+}
+
+static void load_packs(struct odb *odb)
+{
+    char path[PATH_MAX];
+    odb->packs_loaded = 1;
+    if (!path_join(path, sizeof(path), odb->objdir, "pack")) return;
+    DIR *dir = opendir(path);
+    if (!dir) return;
+    size_t alloc = 0;
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+        size_t len = strlen(de->d_name);
+        if (len < 5 || strcmp(de->d_name + len - 4, ".idx")) continue;
+        char idx_path[PATH_MAX];
+        if (snprintf(idx_path, sizeof(idx_path), "%s/%s", path, de->d_name) >= PATH_MAX) continue;
+
+        size_t idx_size;
+        const unsigned char *idx = map_file(idx_path, &idx_size);
+        if (!idx) continue;
+        // only version 2 indexes are written by any git from the last decade
+        if (idx_size < PACK_IDX_HEADER_SIZE + PACK_FANOUT_SIZE || get_be32(idx) != PACK_IDX_SIGNATURE ||
+            get_be32(idx + 4) != 2) {
+            log_debug("odb: skipping unsupported pack index %s", idx_path);
+            munmap((void *)idx, idx_size);
+            continue;
+        }
+        if (odb->nr_packs == alloc) {
+            alloc = alloc ? alloc * 2 : 8;
+            struct packfile *tmp = realloc(odb->packs, alloc * sizeof(struct packfile));
+            if (!tmp) {
+                munmap((void *)idx, idx_size);
+                break;
+            }
+            odb->packs = tmp;
+        }
+        struct packfile *p = &odb->packs[odb->nr_packs++];
+        memset(p, 0, sizeof(*p));
+        p->idx = idx;
+        p->idx_size = idx_size;
+        p->nr = get_be32(idx + PACK_IDX_HEADER_SIZE + 255 * 4);
+        memcpy(idx_path + strlen(idx_path) - 4, ".pack", 6);
+        p->pack_path = str_ndup(idx_path, 0);
+    }
+    closedir(dir);
+    log_trace("odb: loaded %zu pack indexes", odb->nr_packs);
+}
+
+/// Binary search pack index for `oid`; return 1 and set `offset` if found
+static int find_pack_offset(const struct packfile *p, const uint8_t *oid, uint64_t *offset)
+{
+    const unsigned char *fanout = p->idx + PACK_IDX_HEADER_SIZE;
+    const unsigned char *oids = fanout + PACK_FANOUT_SIZE;
+    uint32_t lo = oid[0] ? get_be32(fanout + (oid[0] - 1) * 4) : 0;
+    uint32_t hi = get_be32(fanout + oid[0] * 4);
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = memcmp(oids + (size_t)mid * SHA1_RAWSZ, oid, SHA1_RAWSZ);
+        if (cmp == 0) {
+            const unsigned char *offsets = oids + (size_t)p->nr * (SHA1_RAWSZ + 4);
+            uint32_t off = get_be32(offsets + (size_t)mid * 4);
+            if (off & 0x80000000) {
+                const unsigned char *large = offsets + (size_t)p->nr * 4 + (off & 0x7fffffff) * 8;
+                if (large + 8 > p->idx + p->idx_size) return 0;
+                *offset = (uint64_t)get_be32(large) << 32 | get_be32(large + 4);
+            } else {
+                *offset = off;
+            }
+            return 1;
+        }
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return 0;
+}
+
+/// Inflate exactly `size` bytes from `src`; return allocated NULL-terminated buffer
+static unsigned char *inflate_exact(const unsigned char *src, size_t srclen, size_t size)
+{
+    unsigned char *out = malloc(size + 1);
+    if (!out) return NULL;
+    z_stream zs = {0};
+    zs.next_in = (unsigned char *)src;
+    zs.avail_in = srclen > UINT32_MAX ? UINT32_MAX : (uInt)srclen;
+    zs.next_out = out;
+    zs.avail_out = (uInt)size;
+    if (inflateInit(&zs) != Z_OK) {
+        free(out);
+        return NULL;
+    }
+    int ret = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+    if (ret != Z_STREAM_END || zs.total_out != size) {
+        free(out);
+        return NULL;
+    }
+    out[size] = '\0';
+    return out;
+}
+
+/// Decode little-endian base-128 size used in delta headers
+static size_t delta_hdr_size(const unsigned char **pp, const unsigned char *end)
+{
+    const unsigned char *p = *pp;
+    size_t size = 0;
+    int shift = 0;
+    unsigned char c;
+    do {
+        if (p >= end) return SIZE_MAX;
+        c = *p++;
+        size |= (size_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80 && shift < 64);
+    *pp = p;
+    return size;
+}
+
+/// Apply git delta to `base`; return allocated result and set `size`
+static unsigned char *apply_delta(const unsigned char *base, size_t base_size,
+                                  const unsigned char *delta, size_t delta_size, size_t *size)
+{
+    const unsigned char *p = delta, *end = delta + delta_size;
+    if (delta_hdr_size(&p, end) != base_size) return NULL;
+    size_t out_size = delta_hdr_size(&p, end);
+    if (out_size == SIZE_MAX) return NULL;
+    unsigned char *out = malloc(out_size + 1);
+    if (!out) return NULL;
+    unsigned char *dst = out, *dst_end = out + out_size;
+    while (p < end) {
+        unsigned char cmd = *p++;
+        if (cmd & 0x80) {
+            size_t off = 0, len = 0;
+            for (int i = 0; i < 4; ++i)
+                if (cmd & (1 << i)) off |= (size_t)(p < end ? *p++ : 0) << (8 * i);
+            for (int i = 0; i < 3; ++i)
+                if (cmd & (0x10 << i)) len |= (size_t)(p < end ? *p++ : 0) << (8 * i);
+            if (!len) len = 0x10000;
+            if (off + len > base_size || len > (size_t)(dst_end - dst)) goto err;
+            memcpy(dst, base + off, len);
+            dst += len;
+        } else if (cmd) {
+            if (cmd > end - p || cmd > dst_end - dst) goto err;
+            memcpy(dst, p, cmd);
+            dst += cmd;
+            p += cmd;
+        } else {
+            goto err; // reserved opcode
+        }
+    }
+    if (dst != dst_end) goto err;
+    *dst = '\0';
+    *size = out_size;
+    return out;
+err:
+    free(out);
+    return NULL;
+}
+
+/// Unpack object at `offset` in pack, resolving deltas
+static void *unpack_entry(struct odb *odb, struct packfile *p, uint64_t offset,
+                          enum object_type *type, size_t *size)
+{
+    if (!p->pack && !(p->pack = map_file(p->pack_path, &p->pack_size))) return NULL;
+    if (offset >= p->pack_size) return NULL;
+    const unsigned char *ptr = p->pack + offset, *end = p->pack + p->pack_size;
+
+    unsigned char c = *ptr++;
+    enum object_type t = (c >> 4) & 7;
+    size_t obj_size = c & 15;
+    int shift = 4;
+    while (c & 0x80) {
+        if (ptr >= end || shift > 57) return NULL;
+        c = *ptr++;
+        obj_size += (size_t)(c & 0x7f) << shift;
+        shift += 7;
+    }
+
+    void *base = NULL;
+    size_t base_size = 0;
+    if (t == OBJ_OFS_DELTA) {
+        c = *ptr++;
+        uint64_t rel = c & 127;
+        while (c & 128) {
+            if (ptr >= end) return NULL;
+            rel += 1;
+            c = *ptr++;
+            rel = (rel << 7) + (c & 127);
+        }
+        if (rel > offset) return NULL;
+        base = unpack_entry(odb, p, offset - rel, type, &base_size);
+    } else if (t == OBJ_REF_DELTA) {
+        if (end - ptr < SHA1_RAWSZ) return NULL;
+        base = odb_read(odb, ptr, type, &base_size);
+        ptr += SHA1_RAWSZ;
+    } else if (t >= OBJ_COMMIT && t <= OBJ_TAG) {
+        *type = t;
+        *size = obj_size;
+        return inflate_exact(ptr, end - ptr, obj_size);
+    } else {
+        return NULL;
+    }
+    if (!base) return NULL;
+
+    unsigned char *delta = inflate_exact(ptr, end - ptr, obj_size);
+    void *result = delta ? apply_delta(base, base_size, delta, obj_size, size) : NULL;
+    free(delta);
+    free(base);
+    return result;
+}
+
+/// Read loose object file; return allocated contents
+static void *read_loose(struct odb *odb, const uint8_t *oid, enum object_type *type, size_t *size)
+{
+    char hex[SHA1_HEXSZ + 1], path[PATH_MAX];
+    oid_to_hex(oid, hex);
+    if (snprintf(path, sizeof(path), "%s/%.2s/%s", odb->objdir, hex, hex + 2) >= PATH_MAX)
+        return NULL;
+    size_t mapsize;
+    unsigned char *map = map_file(path, &mapsize);
+    if (!map) return NULL;
+
+    // inflate just the "<type> <size>\0" header first to learn the size
+    unsigned char hdr[64];
+    unsigned char *out = NULL;
+    z_stream zs = {0};
+    zs.next_in = map;
+    zs.avail_in = (uInt)mapsize;
+    zs.next_out = hdr;
+    zs.avail_out = sizeof(hdr);
+    if (inflateInit(&zs) != Z_OK) goto done;
+    int ret = inflate(&zs, Z_SYNC_FLUSH);
+    if (ret != Z_OK && ret != Z_STREAM_END) goto end;
+    unsigned char *nul = memchr(hdr, '\0', sizeof(hdr) - zs.avail_out);
+    if (!nul) goto end;
+    if (!strncmp((char *)hdr, "commit ", 7))
+        *type = OBJ_COMMIT;
+    else if (!strncmp((char *)hdr, "tree ", 5))
+        *type = OBJ_TREE;
+    else if (!strncmp((char *)hdr, "blob ", 5))
+        *type = OBJ_BLOB;
+    else if (!strncmp((char *)hdr, "tag ", 4))
+        *type = OBJ_TAG;
+    else
+        goto end;
+    *size = strtoul(strchr((char *)hdr, ' ') + 1, NULL, 10);
+    if (!(out = malloc(*size + 1))) goto end;
+
+    size_t have = (sizeof(hdr) - zs.avail_out) - (nul + 1 - hdr);
+    if (have > *size) have = *size;
+    memcpy(out, nul + 1, have);
+    zs.next_out = out + have;
+    zs.avail_out = (uInt)(*size - have);
+    if (ret != Z_STREAM_END) ret = inflate(&zs, Z_FINISH);
+    if (ret != Z_STREAM_END || zs.avail_out != 0) {
+        free(out);
+        out = NULL;
+        goto end;
+    }
+    out[*size] = '\0';
+end:
+    inflateEnd(&zs);
+done:
+    munmap(map, mapsize);
+    return out;
+}
+
+void *odb_read(struct odb *odb, const uint8_t *oid, enum object_type *type, size_t *size)
+{
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        if (!odb->packs_loaded) load_packs(odb);
+        for (size_t i = 0; i < odb->nr_packs; ++i) {
+            uint64_t offset;
+            if (find_pack_offset(&odb->packs[i], oid, &offset))
+                return unpack_entry(odb, &odb->packs[i], offset, type, size);
+        }
+        void *obj = read_loose(odb, oid, type, size);
+        if (obj) return obj;
+        // object may have been packed concurrently; rescan packs once
+        unload_packs(odb);
+    }
+    return NULL;
+}
+
+int odb_commit_tree(struct odb *odb, const uint8_t *oid, uint8_t *tree)
+{
+    enum object_type type;
+    size_t size;
+    char *buf = odb_read(odb, oid, &type, &size);
+    if (!buf) return 0;
+    int ok = type == OBJ_COMMIT && size > 5 + SHA1_HEXSZ && !strncmp(buf, "tree ", 5) &&
+             hex_to_oid(buf + 5, tree);
+    free(buf);
+    return ok;
+}
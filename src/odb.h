@@ -0,0 +1,41 @@
+#pragma once
+
+#include "sha1.h"   // for SHA1_RAWSZ
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint8_t
+
+enum object_type {
+    OBJ_NONE = 0,
+    OBJ_COMMIT = 1,
+    OBJ_TREE = 2,
+    OBJ_BLOB = 3,
+    OBJ_TAG = 4,
+    OBJ_OFS_DELTA = 6,
+    OBJ_REF_DELTA = 7,
+};
+
+struct packfile;
+
+/// Read-only access to the object database (loose objects and packs)
+struct odb
+{
+    char *objdir;
+    struct packfile *packs;
+    size_t nr_packs;
+    int packs_loaded;
+
+    /// Unmap packs and free odb struct
+    void (*free)(struct odb *self);
+};
+
+/// Allocate new odb for `<commondir>/objects`
+struct odb *new_odb(const char *commondir);
+
+/// Read object `oid`; return allocated, NULL-terminated contents
+///
+/// Set `type` and `size` of the object. Return `NULL` if the object does not
+/// exist or cannot be decoded.
+void *odb_read(struct odb *odb, const uint8_t *oid, enum object_type *type, size_t *size);
+
+/// Read root tree of commit `oid` into `tree`; return 1 on success
+int odb_commit_tree(struct odb *odb, const uint8_t *oid, uint8_t *tree);
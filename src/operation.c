@@ -0,0 +1,75 @@
+#include "operation.h"
+#include "log.h"      // for log_debug
+#include "repo.h"     // for git_repo
+#include <errno.h>    // for errno
+#include <fcntl.h>    // for open, openat, AT_SYMLINK_NOFOLLOW, O_CLOEXEC, O_DIRECTORY, O_RDONLY
+#include <stdbool.h>  // for bool
+#include <stdlib.h>   // for strtoul
+#include <string.h>   // for strerror
+#include <sys/stat.h> // for fstatat, stat
+#include <unistd.h>   // for close, read
+
+/// Operations known by a single marker file, in the order they are checked
+static const struct
+{
+    const char *marker;
+    const char *name;
+} markers[] = {
+    {"MERGE_HEAD", "MERGING"},
+    {"CHERRY_PICK_HEAD", "CHERRY-PICKING"},
+    {"REVERT_HEAD", "REVERTING"},
+    {"BISECT_LOG", "BISECTING"},
+};
+
+static bool exists_at(int dirfd, const char *name)
+{
+    struct stat st;
+    return fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+}
+
+/// Read the number in file `name` below `dirfd`; 0 if there is none
+static unsigned read_number_at(int dirfd, const char *name)
+{
+    char buf[32];
+    int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) return 0;
+    buf[len] = '\0';
+    return strtoul(buf, NULL, 10);
+}
+
+int read_operation(struct git_repo *repo)
+{
+    repo->operation = NULL;
+    repo->step = repo->steps = 0;
+    // kept open since discovery, unless the repository was set up by hand
+    int dirfd = repo->gitdir_fd >= 0 ? repo->gitdir_fd
+                                     : open(repo->gitdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0) {
+        log_debug("operation: cannot open %s: %s", repo->gitdir, strerror(errno));
+        return 0;
+    }
+    if (exists_at(dirfd, "rebase-merge")) {
+        repo->operation = "REBASE";
+        repo->step = read_number_at(dirfd, "rebase-merge/msgnum");
+        repo->steps = read_number_at(dirfd, "rebase-merge/end");
+    } else if (exists_at(dirfd, "rebase-apply")) {
+        if (exists_at(dirfd, "rebase-apply/rebasing"))
+            repo->operation = "REBASE";
+        else if (exists_at(dirfd, "rebase-apply/applying"))
+            repo->operation = "AM";
+        else
+            repo->operation = "AM/REBASE";
+        repo->step = read_number_at(dirfd, "rebase-apply/next");
+        repo->steps = read_number_at(dirfd, "rebase-apply/last");
+    } else {
+        for (size_t i = 0; i < sizeof(markers) / sizeof(*markers) && !repo->operation; ++i)
+            if (exists_at(dirfd, markers[i].marker)) repo->operation = markers[i].name;
+    }
+    if (dirfd != repo->gitdir_fd) close(dirfd);
+    // a step is only meaningful out of a known total
+    if (!repo->step || !repo->steps) repo->step = repo->steps = 0;
+    return 1;
+}
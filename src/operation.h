@@ -0,0 +1,13 @@
+#pragma once
+
+struct git_repo;
+
+/// Set `repo->operation`, `step` and `steps` from the operation in progress
+///
+/// Look for the files git leaves in the git dir while a rebase, `git am`,
+/// merge, cherry-pick, revert or bisect is under way, in the order
+/// git-prompt.sh checks them, all relative to `repo->gitdir_fd`. Rebases
+/// and `git am` also report which step of how many they are at. Nothing is
+/// set if no operation is in progress. Return 0 if the git dir cannot be
+/// opened.
+int read_operation(struct git_repo *repo);
@@ -1,23 +1,24 @@
 #include "options.h"
+#include "arena.h"   // for arena_calloc, arena_drop
+#include "plan.h"    // for plan_sprint
 #include <stdio.h>   // for sprintf, NULL
-#include <stdlib.h>  // for free, calloc
 
 static const struct options *_options = NULL;
 
 void _options_debug(const struct options *options, char *buf)
 {
+    char plan[128];
+    plan_sprint(options->plan, plan, sizeof(plan));
     sprintf(buf,
             "Debug:         %d\n"
+            "Mode:          %d\n"
             "Format:        %s\n"
             "Directory:     %s\n"
-            "Timeout:       %d\n"
-            "Show branch:   %d\n"
-            "Show commit:   %d\n"
-            "Show unknown:  %d\n"
-            "Show modified: %d",
-            options->debug, options->format, options->directory, options->timeout,
-            options->show_branch, options->show_commit, options->show_untracked,
-            options->show_modified);
+            "Timeout:       %u\n"
+            "Plan:          %s\n"
+            "Limits:        changed=%u untracked=%u",
+            options->debug, options->mode, options->format, options->directory, options->timeout, plan,
+            options->limits.changed, options->limits.untracked);
 }
 
 static void _options_set(const struct options *options) { _options = options; }
@@ -25,15 +26,17 @@ static void _options_set(const struct options *options) { _options = options; }
 static void _options_free(struct options *options)
 {
     if (options) {
-        if (options->format) free(options->format);
-        if (options->directory) free(options->directory);
-        free(options);
+        arena_drop(options->arena, options->format);
+        arena_drop(options->arena, options->directory);
+        arena_drop(options->arena, options);
     }
 }
 
-struct options *new_options()
+struct options *new_options(struct arena *arena)
 {
-    struct options *options = (struct options *)calloc(1, sizeof(struct options));
+    struct options *options = arena_calloc(arena, sizeof(struct options));
+    if (!options) return NULL;
+    options->arena = arena;
     options->set = _options_set;
     options->free = _options_free;
     options->sprint = _options_debug;
@@ -1,29 +1,64 @@
 #pragma once
 
+#include "plan.h"     // for plan_limits
 #include <stdbool.h>  // for bool
-#include <stdint.h>   // for uint8_t
+#include <stddef.h>   // for size_t
+
+struct arena;
+struct format;
+
+/// What the process does after parsing options
+enum run_mode {
+    /// Compute and print prompt for one directory
+    MODE_PROMPT = 0,
+    /// Serve prompts over a Unix socket
+    MODE_DAEMON,
+    /// Ask a running daemon for the prompt, computing it locally as fallback
+    MODE_CLIENT,
+    /// Compute prompts for many directories in parallel
+    MODE_BATCH,
+};
 
 /// Store options set from command line
 struct options
 {
     /// Debug verbosity
     int debug;
+    /// Run mode selected on command line
+    enum run_mode mode;
     /// Output format (print-f style) string e.g. "[%b%u%m]"
     char *format;
-    /// Show current branch
-    bool show_branch;
-    /// Show current commit sha
-    bool show_commit;
+    /// `format` compiled for rendering
+    const struct format *compiled_format;
     /// Show patch name
     bool show_patch;
-    /// Show untracked (unknown) files
-    bool show_untracked;
-    /// Show local changes
-    bool show_modified;
-    /// Timeout in milliseconds for command to complete
-    uint8_t timeout;
+    /// Data sources needed by format (`plan_source` bits)
+    unsigned plan;
+    /// Largest count shown by count tokens, as "<cap>+" beyond it (0: no cap)
+    unsigned count_cap;
+    /// Where counting may stop for this format and cap
+    struct plan_limits limits;
+    /// Milliseconds to wait for git before rendering what is known (0: no limit)
+    unsigned timeout;
+    /// Where to write profiling data (fd number or file name); NULL if not profiling
+    const char *profile;
+    /// Show the last known prompt at once and refresh it in the background
+    bool async;
+    /// Who to tell about a refreshed prompt (process id or named pipe); may be NULL
+    const char *notify;
     /// Directory to use for git commands
     char *directory;
+    /// Batch mode directories from the command line (not owned); none: read stdin
+    char **paths;
+    size_t nr_paths;
+    /// Batch mode worker threads (0: one per CPU)
+    unsigned jobs;
+    /// Batch mode output in input order rather than completion order
+    bool ordered;
+    /// Batch mode records end with NUL instead of newline
+    bool null_terminated;
+    /// Where this struct, format and directory come from (NULL: heap)
+    struct arena *arena;
     /// Set static options object
     void (*set)(const struct options *);
     /// Free options object
@@ -32,5 +67,5 @@ struct options
     void (*sprint)(const struct options *, char *);
 };
 
-/// Allocate new options struct
-struct options *new_options();
+/// Allocate new options struct from `arena` (NULL: heap)
+struct options *new_options(struct arena *arena);
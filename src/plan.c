@@ -0,0 +1,101 @@
+#include "plan.h"
+#include <stdio.h>  // for snprintf
+
+/// Return the next token after `*fmt` and move past it; '\0' at the end
+///
+/// Escapes are skipped as format_compile reads them: `\x` and `%\x` are
+/// literal text whatever `x` is.
+static char next_token(const char **fmt)
+{
+    const char *p = *fmt;
+    for (; *p; ++p) {
+        if (*p == '%' && *++p != '\\') {
+            if (!*p) break;
+            *fmt = p + 1;
+            return *p;
+        }
+        if (*p == '\\' && p[1]) ++p;
+    }
+    *fmt = p;
+    return '\0';
+}
+
+unsigned compile_plan(const char *format)
+{
+    unsigned plan = 0;
+    for (char token; (token = next_token(&format));) {
+        switch (token) {
+        case 'b':
+        case 'c':
+            plan |= PLAN_REFS;
+            break;
+        case 'm':
+        case 'M':
+            plan |= PLAN_INDEX | PLAN_WORKTREE;
+            break;
+        case 'u':
+        case 'U':
+            plan |= PLAN_UNTRACKED;
+            break;
+        case 'a':
+        case 'A':
+        case 'z':
+        case 'Z':
+            plan |= PLAN_UPSTREAM;
+            break;
+        case 'D':
+            plan |= PLAN_SUBMODULES;
+            break;
+        case 's':
+        case 'S':
+            plan |= PLAN_STASH;
+            break;
+        case 'r':
+            plan |= PLAN_OPERATION;
+            break;
+        default:
+            break;
+        }
+    }
+    return plan;
+}
+
+void compile_limits(const char *format, unsigned cap, struct plan_limits *limits)
+{
+    bool flag_changed = false, count_changed = false;
+    bool flag_untracked = false, count_untracked = false;
+    for (char token; (token = next_token(&format));) {
+        switch (token) {
+        case 'm':
+            flag_changed = true;
+            break;
+        case 'M':
+            count_changed = true;
+            break;
+        case 'u':
+            flag_untracked = true;
+            break;
+        case 'U':
+            count_untracked = true;
+            break;
+        default:
+            break;
+        }
+    }
+    // one past the cap tells "cap" from "more than cap"
+    limits->changed = count_changed ? (cap ? cap + 1 : 0) : flag_changed;
+    limits->untracked = count_untracked ? (cap ? cap + 1 : 0) : flag_untracked;
+}
+
+void plan_sprint(unsigned plan, char *buf, size_t bufsize)
+{
+    static const char *names[] = {"refs", "index", "worktree", "untracked", "upstream",
+                                  "submodules", "stash", "operation"};
+    size_t len = 0;
+    *buf = '\0';
+    for (size_t i = 0; i < sizeof(names) / sizeof(*names) && len < bufsize; ++i) {
+        if (plan & (1u << i))
+            len += snprintf(buf + len, bufsize - len, "%s%s", len ? "," : "", names[i]);
+    }
+    if (!plan) snprintf(buf, bufsize, "none");
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h> // for bool
+#include <stddef.h>  // for size_t
+
+/// Data sources a format string needs, roughly in increasing order of cost
+enum plan_source {
+    PLAN_REFS = 1 << 0,       // branch and commit: HEAD and refs
+    PLAN_INDEX = 1 << 1,      // staged changes: HEAD tree vs index
+    PLAN_WORKTREE = 1 << 2,   // unstaged changes: index vs worktree
+    PLAN_UNTRACKED = 1 << 3,  // untracked files: worktree directory scan
+    PLAN_UPSTREAM = 1 << 4,   // ahead/behind: graph walk between HEAD and upstream
+    PLAN_SUBMODULES = 1 << 5, // dirty submodules: status of every populated submodule
+    PLAN_STASH = 1 << 6,      // stash entries: lines of the stash reflog
+    PLAN_OPERATION = 1 << 7,  // operation in progress: marker files in the git dir
+};
+
+/// How far counts have to go for a format string; 0 means exactly
+///
+/// Counting may stop once a count reaches its limit: an indicator token
+/// (`%m`, `%u`) only needs to know whether there is anything at all, and
+/// a count token shows the cap as "<cap>+" past it.
+struct plan_limits
+{
+    unsigned changed;
+    unsigned untracked;
+};
+
+/// Compile format string into the set of `plan_source` bits needed to render it
+unsigned compile_plan(const char *format);
+
+/// Compile format string into count limits, given the cap for count tokens (0: none)
+void compile_limits(const char *format, unsigned cap, struct plan_limits *limits);
+
+/// Write comma-separated names of sources in `plan` to `buf`
+void plan_sprint(unsigned plan, char *buf, size_t bufsize);
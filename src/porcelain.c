@@ -0,0 +1,164 @@
+#include "porcelain.h"
+#include "log.h"  // for log_debug, log_warn
+#include "plan.h" // for plan_limits, PLAN_INDEX, PLAN_UNTRACKED, PLAN_WORKTREE, PLAN_SUBMODULES
+#include "repo.h" // for git_repo, GIT_HASH_LEN
+#include <stdlib.h> // for strtoul
+#include <string.h> // for memchr, memcpy, strncmp, strlen
+
+void porcelain_init(struct porcelain *p, struct git_repo *repo, unsigned plan,
+                    const struct plan_limits *limits)
+{
+    p->repo = repo;
+    p->plan = plan;
+    p->limits = limits ? *limits : (struct plan_limits){0};
+    p->done = false;
+    p->kind = 0;
+    p->len = 0;
+    p->truncated = false;
+    p->records = 0;
+}
+
+/// Value of header `name` in `line` ("# <name> <value>"), or NULL
+static char *header_value(char *line, const char *name)
+{
+    size_t len = strlen(name);
+    if (strncmp(line, "# ", 2) != 0 || strncmp(line + 2, name, len) != 0 || line[2 + len] != ' ')
+        return NULL;
+    return line + 3 + len;
+}
+
+/// Store a complete header line
+static int parse_header(struct porcelain *p)
+{
+    struct git_repo *repo = p->repo;
+    char *line = p->line, *value;
+    line[p->len] = '\0';
+    log_debug("porcelain header: %s", line);
+    if (p->truncated) {
+        log_warn("porcelain: header longer than %zu bytes ignored", sizeof(p->line) - 1);
+        return 1;
+    }
+    if ((value = header_value(line, "branch.oid"))) {
+        if (!repo->set_commit(repo, value, GIT_HASH_LEN)) {
+            log_error("Error setting repo commit");
+            return 0;
+        }
+    } else if ((value = header_value(line, "branch.head"))) {
+        if (!repo->set_branch(repo, value, 0)) {
+            log_error("Error setting repo branch");
+            return 0;
+        }
+    } else if ((value = header_value(line, "branch.ab"))) {
+        if (!repo->set_ahead_behind(repo, value)) {
+            log_error("Error setting repo ahead/behind");
+            return 0;
+        }
+    } else if ((value = header_value(line, "stash"))) {
+        // only shown if there is anything stashed
+        repo->stashes = strtoul(value, NULL, 10);
+    }
+    return 1;
+}
+
+/// Whether every count in the plan has reached its limit
+static bool enough(const struct porcelain *p)
+{
+    const struct git_repo *repo = p->repo;
+    // every change record has to be looked at for its submodule state
+    if (p->plan & PLAN_SUBMODULES) return false;
+    if (p->plan & (PLAN_INDEX | PLAN_WORKTREE) &&
+        (!p->limits.changed || repo->changed < p->limits.changed))
+        return false;
+    if (p->plan & PLAN_UNTRACKED && (!p->limits.untracked || repo->untracked < p->limits.untracked))
+        return false;
+    return true;
+}
+
+/// Count a record from its type byte
+static void count_record(struct porcelain *p, char kind)
+{
+    struct git_repo *repo = p->repo;
+    ++p->records;
+    switch (kind) {
+    case '1': // ordinary change
+    case '2': // rename or copy
+        if (p->plan & (PLAN_INDEX | PLAN_WORKTREE)) ++repo->changed;
+        break;
+    case 'u':
+        if (p->plan & (PLAN_INDEX | PLAN_WORKTREE)) ++repo->unmerged;
+        break;
+    case '?':
+        if (p->plan & PLAN_UNTRACKED) ++repo->untracked;
+        break;
+    default: // '!' ignored files are never asked for
+        break;
+    }
+    // headers come first, so nothing else is needed past this point
+    p->done = enough(p);
+}
+
+/// Count a change record ("1 XY <sub> ...") whose submodule state field shows
+/// other commits, changes or untracked files
+static void parse_submodule(struct porcelain *p)
+{
+    const char *sub = p->line + 5;
+    if (p->len >= 9 && p->line[1] == ' ' && p->line[4] == ' ' && sub[0] == 'S' &&
+        (sub[1] == 'C' || sub[2] == 'M' || sub[3] == 'U'))
+        ++p->repo->dirty_submodules;
+}
+
+/// Whether the rest of the current record's line has to be collected
+static bool collects(const struct porcelain *p)
+{
+    return p->kind == '#' || (p->plan & PLAN_SUBMODULES && (p->kind == '1' || p->kind == '2'));
+}
+
+int porcelain_feed(struct porcelain *p, const char *buf, size_t len)
+{
+    const char *end = buf + len;
+    while (buf < end) {
+        if (!p->kind) {
+            p->kind = *buf;
+            if (p->kind == '\n') {
+                // empty line
+                p->kind = 0;
+                ++buf;
+                continue;
+            }
+            if (p->kind != '#') {
+                count_record(p, p->kind);
+                if (p->done) return 1;
+            }
+        }
+        const char *eol = memchr(buf, '\n', end - buf);
+        const char *stop = eol ? eol : end;
+        if (collects(p)) {
+            size_t n = stop - buf;
+            if (n > sizeof(p->line) - 1 - p->len) {
+                n = sizeof(p->line) - 1 - p->len;
+                p->truncated = true;
+            }
+            memcpy(p->line + p->len, buf, n);
+            p->len += n;
+            if (eol && p->kind != '#') parse_submodule(p);
+            if (eol && p->kind == '#' && !parse_header(p)) return 0;
+        }
+        if (!eol) break;
+        // line done; other records need nothing past their first byte
+        p->kind = 0;
+        p->len = 0;
+        p->truncated = false;
+        buf = eol + 1;
+    }
+    return 1;
+}
+
+int porcelain_finish(struct porcelain *p)
+{
+    int ok = p->kind == '#' ? parse_header(p) : 1;
+    if (p->kind && p->kind != '#' && collects(p)) parse_submodule(p);
+    p->kind = 0;
+    p->len = 0;
+    log_debug("porcelain: %zu records%s", p->records, p->done ? " (stopped early)" : "");
+    return ok;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "plan.h"    // for plan_limits
+#include <stdbool.h> // for bool
+#include <stddef.h>  // for size_t
+
+struct git_repo;
+
+/// Incremental parser of `git status --porcelain=2` output
+///
+/// Records are counted from their first byte as soon as it arrives; only
+/// `#` header lines (and change records, for their submodule state) are
+/// collected, in a fixed buffer, so memory use does not depend on the
+/// number of files git reports.
+struct porcelain
+{
+    struct git_repo *repo;
+    /// `plan_source` bits whose counts are taken from the output
+    unsigned plan;
+    /// Counts after which the rest of the output is not needed
+    struct plan_limits limits;
+    /// Every count in `plan` has reached its limit
+    bool done;
+    /// Type byte of the current record; 0 at the start of a line
+    char kind;
+    /// Current header line or change record, without '\n'
+    char line[1024];
+    size_t len;
+    /// Current header line did not fit in `line`
+    bool truncated;
+    /// Number of records seen, for debug output
+    size_t records;
+};
+
+/// Start parsing output into `repo` for the sources in `plan`
+///
+/// With `limits` (may be NULL), set `done` once the counts reach them.
+void porcelain_init(struct porcelain *p, struct git_repo *repo, unsigned plan,
+                    const struct plan_limits *limits);
+
+/// Consume the next `len` bytes of output; lines may be split anywhere
+///
+/// Input after `done` is set is ignored. Return 0 if a header could not be
+/// stored in `repo`.
+int porcelain_feed(struct porcelain *p, const char *buf, size_t len);
+
+/// Handle a last line not ended by '\n'; return 0 on error as porcelain_feed()
+int porcelain_finish(struct porcelain *p);
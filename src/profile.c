@@ -0,0 +1,126 @@
+#include "profile.h"
+#include "log.h"          // for log_error
+#include <errno.h>        // for errno
+#include <fcntl.h>        // for open, O_APPEND, O_CLOEXEC, O_CREAT, O_WRONLY
+#include <stdio.h>        // for fprintf, fputs, open_memstream
+#include <stdlib.h>       // for free, strtol
+#include <string.h>       // for strerror
+#include <sys/resource.h> // for getrusage, rusage, RUSAGE_SELF, RUSAGE_CHILDREN
+#include <time.h>         // for clock_gettime, timespec, CLOCK_MONOTONIC
+#include <unistd.h>       // for close, getpid, write
+
+bool profile_enabled = false;
+size_t profile_bytes = 0;
+
+static const char *PHASE_NAMES[PROFILE_PHASES] = {
+    "args", "discover", "spawn", "first_byte", "eof", "parse", "render", "exit",
+};
+
+static struct
+{
+    int fd;
+    bool close_fd;
+    struct timespec start;
+    struct timespec marks[PROFILE_PHASES];
+    /// Set by the thread that records the mark
+    bool marked[PROFILE_PHASES];
+} P = {.fd = -1};
+
+void profile_start(void) { clock_gettime(CLOCK_MONOTONIC, &P.start); }
+
+int profile_open(const char *target)
+{
+    char *end;
+    long fd = strtol(target, &end, 10);
+    if (*target && !*end && fd >= 0) {
+        P.fd = fd;
+        P.close_fd = false;
+    } else {
+        P.fd = open(target, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (P.fd < 0) {
+            log_error("profile: cannot open %s: %s", target, strerror(errno));
+            return 0;
+        }
+        P.close_fd = true;
+    }
+    profile_enabled = true;
+    return 1;
+}
+
+void profile_mark_at(enum profile_phase phase)
+{
+    if (!__atomic_test_and_set(&P.marked[phase], __ATOMIC_RELAXED))
+        clock_gettime(CLOCK_MONOTONIC, &P.marks[phase]);
+}
+
+/// Microseconds from `a` to `b`
+static long long usec_between(const struct timespec *a, const struct timespec *b)
+{
+    return (b->tv_sec - a->tv_sec) * 1000000LL + (b->tv_nsec - a->tv_nsec) / 1000;
+}
+
+/// Print `str` as a JSON string
+static void print_string(FILE *stream, const char *str)
+{
+    fputc('"', stream);
+    for (const unsigned char *s = (const unsigned char *)(str ? str : ""); *s; ++s) {
+        if (*s == '"' || *s == '\\')
+            fprintf(stream, "\\%c", *s);
+        else if (*s < 0x20)
+            fprintf(stream, "\\u%04x", *s);
+        else
+            fputc(*s, stream);
+    }
+    fputc('"', stream);
+}
+
+/// Print resource usage of `who` as a JSON object
+static void print_rusage(FILE *stream, int who)
+{
+    struct rusage ru;
+    if (getrusage(who, &ru) < 0) {
+        fputs("null", stream);
+        return;
+    }
+    fprintf(stream,
+            "{\"utime_us\":%lld,\"stime_us\":%lld,\"maxrss_kb\":%ld,\"minflt\":%ld,"
+            "\"majflt\":%ld,\"inblock\":%ld,\"oublock\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld}",
+            ru.ru_utime.tv_sec * 1000000LL + ru.ru_utime.tv_usec,
+            ru.ru_stime.tv_sec * 1000000LL + ru.ru_stime.tv_usec, ru.ru_maxrss, ru.ru_minflt,
+            ru.ru_majflt, ru.ru_inblock, ru.ru_oublock, ru.ru_nvcsw, ru.ru_nivcsw);
+}
+
+void profile_write(const char *dir, const char *format)
+{
+    if (!profile_enabled) return;
+    profile_mark_at(PROFILE_EXIT);
+    char *buf;
+    size_t len;
+    FILE *stream = open_memstream(&buf, &len);
+    if (!stream) return;
+    fprintf(stream, "{\"pid\":%d,\"dir\":", (int)getpid());
+    print_string(stream, dir);
+    fputs(",\"format\":", stream);
+    print_string(stream, format);
+    // microseconds since start; null for phases that did not happen
+    fputs(",\"us\":{", stream);
+    for (int i = 0; i < PROFILE_PHASES; ++i) {
+        fprintf(stream, "%s\"%s\":", i ? "," : "", PHASE_NAMES[i]);
+        if (P.marked[i])
+            fprintf(stream, "%lld", usec_between(&P.start, &P.marks[i]));
+        else
+            fputs("null", stream);
+    }
+    fprintf(stream, "},\"child_bytes\":%zu,\"rusage\":", profile_bytes);
+    print_rusage(stream, RUSAGE_SELF);
+    fputs(",\"rusage_children\":", stream);
+    print_rusage(stream, RUSAGE_CHILDREN);
+    fputs("}\n", stream);
+    fclose(stream);
+    // one write, so that lines from concurrent prompts do not interleave
+    if (write(P.fd, buf, len) != (ssize_t)len)
+        log_error("profile: write failed: %s", strerror(errno));
+    free(buf);
+    if (P.close_fd) close(P.fd);
+    profile_enabled = false;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h> // for bool
+#include <stddef.h>  // for size_t
+
+/// Points in the life of one prompt, in the order they normally happen
+enum profile_phase {
+    PROFILE_ARGS,       // command line parsed
+    PROFILE_DISCOVER,   // repository located
+    PROFILE_SPAWN,      // first child (git) started
+    PROFILE_FIRST_BYTE, // first output read from it
+    PROFILE_EOF,        // its stdout closed
+    PROFILE_PARSE,      // results complete
+    PROFILE_RENDER,     // prompt rendered
+    PROFILE_EXIT,       // about to exit
+    PROFILE_PHASES
+};
+
+/// Whether profiling is on; everything else here is skipped while it is not
+extern bool profile_enabled;
+/// Bytes read from children so far, by any thread
+extern size_t profile_bytes;
+
+/// Take the start time; call first thing in main()
+void profile_start(void);
+
+/// Turn profiling on, reporting to `target`
+///
+/// `target` is a file descriptor number or a file name (appended to).
+/// Return 0 if it cannot be opened.
+int profile_open(const char *target);
+
+/// Record the time of `phase` (the first time only, whichever thread gets there)
+void profile_mark_at(enum profile_phase phase);
+
+/// Write everything recorded, plus resource usage, as one JSON line
+void profile_write(const char *dir, const char *format);
+
+/// Record `phase` if profiling
+static inline void profile_mark(enum profile_phase phase)
+{
+    if (profile_enabled) profile_mark_at(phase);
+}
+
+/// Count `len` bytes read from a child if profiling
+static inline void profile_read(size_t len)
+{
+    // submodule and scan workers read from children too
+    if (profile_enabled) __atomic_fetch_add(&profile_bytes, len, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,268 @@
+#include "refs.h"
+#include "config.h"   // for config_get_all
+#include "log.h"      // for log_debug
+#include "repo.h"     // for git_repo
+#include "util.h"     // for map_file, path_join, read_file, read_file_at
+#include <limits.h>   // for PATH_MAX
+#include <stdbool.h>  // for bool
+#include <stdio.h>    // for snprintf
+#include <stdlib.h>   // for free
+#include <string.h>   // for memchr, memcmp, strchr, strcmp, strlen, strncmp, strstr
+#include <sys/mman.h> // for munmap
+
+#define MAX_SYMREF_DEPTH 5
+
+/// Check whether ref lives in the per-worktree git dir rather than the common dir
+static int is_per_worktree_ref(const char *refname)
+{
+    return strncmp(refname, "refs/", 5) != 0 || !strncmp(refname, "refs/bisect/", 12) ||
+           !strncmp(refname, "refs/worktree/", 14) || !strncmp(refname, "refs/rewritten/", 15);
+}
+
+/// Reject names that could escape the git dir
+static int is_safe_refname(const char *refname)
+{
+    return *refname && *refname != '/' && !strstr(refname, "..") && !strchr(refname, '\\');
+}
+
+/// Order of refnames in packed-refs: bytewise, a prefix first
+static int cmp_refname(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+    int cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (cmp) return cmp;
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+/// End of the line starting at `p`, or `end` if it is not terminated
+static const char *line_end(const char *p, const char *end)
+{
+    const char *eol = memchr(p, '\n', end - p);
+    return eol ? eol : end;
+}
+
+/// Start of the line after the one starting at `p`, or `end`
+static const char *next_line(const char *p, const char *end)
+{
+    const char *eol = line_end(p, end);
+    return eol < end ? eol + 1 : end;
+}
+
+/// Check the "# pack-refs with:" header line `[p, eol)` for `trait`
+static int has_trait(const char *p, const char *eol, const char *trait)
+{
+    // traits are separated and followed by spaces
+    size_t len = strlen(trait);
+    for (p = memchr(p, ':', eol - p); p && eol - p > (ptrdiff_t)len + 1; ++p) {
+        if (*p == ' ' && !memcmp(p + 1, trait, len) && p[len + 1] == ' ') return 1;
+    }
+    return 0;
+}
+
+/// Compare record `[rec, eol)` ("<hex> <refname>") with `refname`; set `*valid` to 0 if
+/// it is not a record
+static int cmp_record(const char *rec, const char *eol, const char *refname, size_t name_len,
+                      int *valid)
+{
+    *valid = eol - rec > SHA1_HEXSZ + 1 && rec[SHA1_HEXSZ] == ' ';
+    if (!*valid) return 0;
+    return cmp_refname(rec + SHA1_HEXSZ + 1, eol - rec - SHA1_HEXSZ - 1, refname, name_len);
+}
+
+/// Binary search `[lo, end)`, which starts at a record, for `refname`
+///
+/// Probes land in the middle of a line; back up to its start, and past a
+/// "^<peeled>" line to the record it belongs to, as git does.
+static const char *search_sorted(const char *lo, const char *end, const char *refname,
+                                 size_t name_len, int *valid)
+{
+    const char *start = lo, *hi = end;
+    *valid = 1;
+    while (lo < hi) {
+        const char *rec = lo + (hi - lo) / 2;
+        while (rec > lo && rec[-1] != '\n') --rec;
+        if (*rec == '^' && rec > start) {
+            for (--rec; rec > lo && rec[-1] != '\n'; --rec)
+                ;
+        }
+        const char *eol = line_end(rec, end);
+        int cmp = cmp_record(rec, eol, refname, name_len, valid);
+        if (!*valid) return NULL;
+        if (!cmp) return rec;
+        if (cmp > 0) {
+            hi = rec;
+            continue;
+        }
+        lo = next_line(rec, end);
+        if (lo < end && *lo == '^') lo = next_line(lo, end);
+    }
+    return NULL;
+}
+
+/// Look up `refname` in packed-refs, mapped rather than read
+///
+/// Files with the "sorted" trait, which git has written for years, are
+/// binary searched; others are scanned line by line.
+static enum ref_status read_packed_ref(const struct git_repo *repo, const char *refname,
+                                       uint8_t *oid)
+{
+    char path[PATH_MAX];
+    size_t size;
+    if (!path_join(path, sizeof(path), repo->commondir, "packed-refs")) return REF_ERROR;
+    const char *map = map_file(path, &size);
+    if (!map) return REF_MISSING;
+
+    const char *p = map, *end = map + size, *rec = NULL;
+    const char *header = "# pack-refs with:";
+    int sorted = 0, valid = 1;
+    size_t name_len = strlen(refname);
+    if (size >= strlen(header) && !memcmp(map, header, strlen(header))) {
+        const char *eol = line_end(map, end);
+        sorted = has_trait(map, eol, "sorted");
+        p = next_line(map, end);
+    }
+    if (sorted) {
+        rec = search_sorted(p, end, refname, name_len, &valid);
+    } else {
+        while (p < end && !rec) {
+            const char *eol = line_end(p, end);
+            // skip "^<peeled>" lines and anything else that is not a record
+            if (!cmp_record(p, eol, refname, name_len, &valid) && valid) rec = p;
+            p = next_line(p, end);
+        }
+        valid = 1;
+    }
+    enum ref_status ret = REF_MISSING;
+    if (!valid) {
+        log_debug("refs: unrecognized line in %s", path);
+        ret = REF_ERROR;
+    } else if (rec) {
+        ret = hex_to_oid(rec, oid) ? REF_FOUND : REF_ERROR;
+    }
+    munmap((void *)map, size);
+    return ret;
+}
+
+enum ref_status refs_resolve(const struct git_repo *repo, const char *refname, uint8_t *oid,
+                             char *target, size_t target_size)
+{
+    char name[PATH_MAX], path[PATH_MAX], buf[PATH_MAX];
+    if (strlen(refname) >= sizeof(name)) return REF_ERROR;
+    strcpy(name, refname);
+
+    for (int depth = 0; depth < MAX_SYMREF_DEPTH; ++depth) {
+        if (!is_safe_refname(name)) return REF_ERROR;
+        if (target) {
+            if (strlen(name) >= target_size) return REF_ERROR;
+            strcpy(target, name);
+        }
+        bool per_worktree = is_per_worktree_ref(name);
+        const char *dir = per_worktree ? repo->gitdir : repo->commondir;
+        if (!path_join(path, sizeof(path), dir, name)) return REF_ERROR;
+        // HEAD, the most read of all, without a path lookup from the root
+        ssize_t len = per_worktree && repo->gitdir_fd >= 0
+                          ? read_file_at(repo->gitdir_fd, name, buf, sizeof(buf))
+                          : read_file(path, buf, sizeof(buf));
+        if (len < 0) {
+            // only refs under refs/ are ever packed
+            if (strncmp(name, "refs/", 5) != 0) return REF_MISSING;
+            return read_packed_ref(repo, name, oid);
+        }
+        if (!strncmp(buf, "ref: ", 5)) {
+            memmove(name, buf + 5, len - 4);
+            continue;
+        }
+        if (len >= SHA1_HEXSZ && hex_to_oid(buf, oid)) return REF_FOUND;
+        log_debug("refs: unrecognized content in %s", path);
+        return REF_ERROR;
+    }
+    log_debug("refs: symbolic ref chain too deep at %s", refname);
+    return REF_ERROR;
+}
+
+int refs_read_head(struct git_repo *repo, uint8_t *oid, int *unborn)
+{
+    char target[PATH_MAX];
+    enum ref_status status = refs_resolve(repo, "HEAD", oid, target, sizeof(target));
+    *unborn = 0;
+    if (status == REF_ERROR) return 0;
+
+    const char *heads = "refs/heads/";
+    size_t heads_len = strlen(heads);
+    if (!strcmp(target, "HEAD")) {
+        if (status != REF_FOUND || !repo->set_branch(repo, "(detached)", 0)) return 0;
+    } else {
+        const char *branch = strncmp(target, heads, heads_len) ? target : target + heads_len;
+        // reftable repositories point HEAD at this placeholder
+        if (!strcmp(branch, ".invalid")) return 0;
+        if (!repo->set_branch(repo, branch, 0)) return 0;
+    }
+    if (status == REF_MISSING) {
+        *unborn = 1;
+        return repo->set_commit(repo, "(initial)", GIT_HASH_LEN);
+    }
+    char hex[SHA1_HEXSZ + 1];
+    oid_to_hex(oid, hex);
+    return repo->set_commit(repo, hex, GIT_HASH_LEN);
+}
+
+/// Map `ref` through fetch refspec `spec` ("[+]src:dst", optionally with one '*')
+static int apply_refspec(const char *spec, const char *ref, char *buf, size_t bufsize)
+{
+    if (*spec == '+') ++spec;
+    const char *colon = strchr(spec, ':');
+    if (!colon) return 0;
+    size_t src_len = colon - spec;
+    const char *dst = colon + 1;
+    const char *src_star = memchr(spec, '*', src_len);
+    const char *dst_star = strchr(dst, '*');
+    int len;
+    if (!src_star && !dst_star) {
+        if (strlen(ref) != src_len || strncmp(ref, spec, src_len)) return 0;
+        len = snprintf(buf, bufsize, "%s", dst);
+    } else if (src_star && dst_star) {
+        size_t prefix = src_star - spec, suffix = src_len - prefix - 1;
+        size_t ref_len = strlen(ref);
+        if (ref_len < prefix + suffix || strncmp(ref, spec, prefix) ||
+            strncmp(ref + ref_len - suffix, src_star + 1, suffix))
+            return 0;
+        len = snprintf(buf, bufsize, "%.*s%.*s%s", (int)(dst_star - dst), dst,
+                       (int)(ref_len - prefix - suffix), ref + prefix, dst_star + 1);
+    } else {
+        return 0;
+    }
+    return len > 0 && (size_t)len < bufsize;
+}
+
+int refs_upstream(const struct git_repo *repo, const char *refname, char *buf, size_t bufsize)
+{
+    const char *heads = "refs/heads/";
+    size_t heads_len = strlen(heads);
+    if (strncmp(refname, heads, heads_len)) return 0;
+    char key[PATH_MAX];
+    int ret = 0;
+    snprintf(key, sizeof(key), "branch.%s.remote", refname + heads_len);
+    char *remote = config_get_all(repo->commondir, key);
+    snprintf(key, sizeof(key), "branch.%s.merge", refname + heads_len);
+    char *merge = config_get_all(repo->commondir, key);
+    char *fetch = NULL;
+    if (!remote || !merge) goto out;
+    ret = -1;
+    if (!is_safe_refname(remote)) goto out;
+    if (!strcmp(remote, ".")) {
+        // tracking a local branch
+        int len = snprintf(buf, bufsize, "%s", merge);
+        if (len > 0 && (size_t)len < bufsize) ret = 1;
+    } else {
+        snprintf(key, sizeof(key), "remote.%s.fetch", remote);
+        // only the last refspec is seen; if it does not map, git may know better
+        if ((fetch = config_get_all(repo->commondir, key)) &&
+            apply_refspec(fetch, merge, buf, bufsize))
+            ret = 1;
+    }
+    if (ret == 1 && !is_safe_refname(buf)) ret = -1;
+out:
+    free(remote);
+    free(merge);
+    free(fetch);
+    return ret;
+}
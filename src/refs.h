@@ -0,0 +1,35 @@
+#pragma once
+
+#include "sha1.h"   // for SHA1_RAWSZ
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint8_t
+
+struct git_repo;
+
+/// Outcome of resolving a ref
+enum ref_status {
+    REF_ERROR = -1,  // layout not understood; ask git instead
+    REF_MISSING = 0, // ref (or the end of its symref chain) does not exist
+    REF_FOUND = 1,
+};
+
+/// Resolve `refname`, following symbolic refs, through loose refs and packed-refs
+///
+/// Set `oid` if found. If `target` is not `NULL`, it receives the name of the
+/// last ref in the chain (e.g. "refs/heads/main" for "HEAD").
+enum ref_status refs_resolve(const struct git_repo *repo, const char *refname, uint8_t *oid,
+                             char *target, size_t target_size);
+
+/// Set branch and commit of `repo` from HEAD, as `git status --branch` reports them
+///
+/// Detached HEAD gives branch "(detached)"; an unborn branch gives commit
+/// "(initial)" and sets `unborn`. Set `oid` to the HEAD commit otherwise.
+/// Return 1 on success, 0 if the caller should ask git.
+int refs_read_head(struct git_repo *repo, uint8_t *oid, int *unborn);
+
+/// Write the ref tracked by branch `refname` (`branch.<name>.remote/merge`) to `buf`
+///
+/// The merge ref is mapped through `remote.<remote>.fetch`. Return 1 on
+/// success, 0 if the branch has no upstream configured, -1 if the mapping
+/// could not be worked out (the caller should ask git).
+int refs_upstream(const struct git_repo *repo, const char *refname, char *buf, size_t bufsize);
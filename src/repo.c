@@ -1,25 +1,34 @@
 #include "repo.h"
+#include "arena.h"
 #include "log.h"
 #include "util.h"
 #include "options.h"
 #include "capture.h"
+#include "plan.h"
+#include "status.h"
+#include "porcelain.h"
+#include "cache.h"
+#include "discover.h"
+#include "format.h"
+#include "profile.h"
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
-
-// Constants
-static const char *AHEAD_GLYPH = "↑";
-static const char *BEHIND_GLYPH = "↓";
-static const char *DIRTY_GLYPH = "*";
-static const char *UNTRACKED_GLYPH = "…";
+#include <unistd.h>
 
 /// Completely free git_repo struct
 static void git_repo_free(struct git_repo *self)
 {
     if (!self) return;
-    if (self->branch) free(self->branch);
-    if (self->commit) free(self->commit);
-    free(self);
+    arena_drop(self->arena, self->branch);
+    arena_drop(self->arena, self->commit);
+    arena_drop(self->arena, self->workdir);
+    arena_drop(self->arena, self->gitdir);
+    arena_drop(self->arena, self->commondir);
+    if (self->gitdir_fd >= 0) close(self->gitdir_fd);
+    free_status_ctx(self->status);
+    arena_drop(self->arena, self);
 }
 
 /// Set buf to debug repr of git_repo
@@ -28,26 +37,31 @@ static void git_repo_debug(const struct git_repo *self, char *buf)
     sprintf(buf,
             "Commit:    %s\n"
             "Branch:    %s\n"
-            "Changed:   %d\n"
-            "Untracked: %d\n"
-            "Ahead:     %d\n"
-            "Behind:    %d",
-            self->commit, self->branch, self->changed, self->untracked, self->ahead, self->behind);
+            "Changed:   %u\n"
+            "Untracked: %u\n"
+            "Ahead:     %u\n"
+            "Behind:    %u\n"
+            "Submods:   %u\n"
+            "Stashes:   %u\n"
+            "Operation: %s %u/%u",
+            self->commit, self->branch, self->changed, self->untracked, self->ahead, self->behind,
+            self->dirty_submodules, self->stashes, self->operation ? self->operation : "none",
+            self->step, self->steps);
 }
 
 /// Set branch name in git_repo struct
 static int git_repo_set_branch(struct git_repo *self, const char *branch, size_t len)
 {
-    if (self->branch) free(self->branch);
-    self->branch = str_ndup(branch, len);
+    arena_drop(self->arena, self->branch);
+    self->branch = arena_strndup(self->arena, branch, len);
     return !!self->branch;
 }
 
 /// Set branch name in git_repo struct
 static int git_repo_set_commit(struct git_repo *self, const char *commit, size_t len)
 {
-    if (self->commit) free(self->commit);
-    self->commit = str_ndup(commit, len);
+    arena_drop(self->arena, self->commit);
+    self->commit = arena_strndup(self->arena, commit, len);
     return !!self->commit;
 }
 
@@ -58,7 +72,7 @@ static int git_repo_set_ahead_behind(struct git_repo *self, char *buf)
     int found = 0;
     while (*buf) {
         if (isdigit(*buf)) {
-            int val = (int)strtol(buf, &buf, 10);
+            unsigned val = strtoul(buf, &buf, 10);
             if (found == 0) {
                 self->ahead = val;
             } else {
@@ -72,127 +86,148 @@ static int git_repo_set_ahead_behind(struct git_repo *self, char *buf)
     return !!found;
 }
 
+/// Reset fields computed from the sources in `plan`
+static void git_repo_clear(struct git_repo *self, unsigned plan)
+{
+    if (plan & PLAN_REFS) {
+        arena_drop(self->arena, self->branch);
+        arena_drop(self->arena, self->commit);
+        self->branch = self->commit = NULL;
+    }
+    if (plan & (PLAN_INDEX | PLAN_WORKTREE)) self->changed = self->unmerged = 0;
+    if (plan & PLAN_UNTRACKED) self->untracked = 0;
+    if (plan & PLAN_UPSTREAM) self->ahead = self->behind = 0;
+    if (plan & PLAN_SUBMODULES) self->dirty_submodules = 0;
+    if (plan & PLAN_STASH) self->stashes = 0;
+    if (plan & PLAN_OPERATION) {
+        self->operation = NULL;
+        self->step = self->steps = 0;
+    }
+}
+
 /// Allocate new git_repo struct
-struct git_repo *new_git_repo()
+struct git_repo *new_git_repo(struct arena *arena)
 {
-    struct git_repo *repo = calloc(1, sizeof(struct git_repo));
+    struct git_repo *repo = arena_calloc(arena, sizeof(struct git_repo));
+    if (!repo) return NULL;
+    repo->arena = arena;
+    repo->gitdir_fd = -1;
     repo->sprint = git_repo_debug;
     repo->free = git_repo_free;
     repo->set_branch = git_repo_set_branch;
     repo->set_commit = git_repo_set_commit;
     repo->set_ahead_behind = git_repo_set_ahead_behind;
+    repo->clear = git_repo_clear;
     return repo;
 }
 
-void parse_porcelain(struct git_repo *repo, struct options *opts)
+/// Pass output of git status to the porcelain parser until it has seen enough
+static int feed_porcelain(void *data, const char *buf, size_t len)
+{
+    struct porcelain *parser = data;
+    return porcelain_feed(parser, buf, len) && !parser->done;
+}
+
+/// Run git status for the sources in `plan` and parse its porcelain v2 output
+///
+/// Kill git once the counts reach `limits`. Return 0 if git did not finish before `deadline`.
+static int run_status(struct git_repo *repo, const char *dir, unsigned plan,
+                      const struct plan_limits *limits, const struct timespec *deadline)
 {
-    char *args[] = {
-        "git",      "-C", opts->directory, "status", "--porcelain=2", "--untracked-files=normal",
-        "--branch", NULL};
-    if (!opts->show_untracked) args[5] = "--untracked-files=no";
+    char *args[] = {"git",           "-C", (char *)dir, "status", "--porcelain=2",
+                    "--untracked-files=normal", NULL, NULL, NULL};
+    size_t nr_args = 6;
+    if (!(plan & PLAN_UNTRACKED)) args[5] = "--untracked-files=no";
+    if (plan & (PLAN_REFS | PLAN_UPSTREAM)) args[nr_args++] = "--branch";
+    if (plan & PLAN_STASH) args[nr_args++] = "--show-stash";
+    struct porcelain parser;
+    porcelain_init(&parser, repo, plan, limits);
     struct capture *output;
-    if ((output = capture_child(args))) {
-        const char *cstdout = output->childout.buf;
-        char **split;
-        int line = 1;
-        size_t line_ct;
-        if ((split = str_split(cstdout, "\n", &line_ct))) {
-            log_debug("Stdout contains %zu lines", line_ct);
-            for (char **p = split; *p; ++p) {
-                log_debug("L%d: %s", line, *p);
-                char *tmp;
-                const char *commit = "branch.oid";
-                const char *branch = "branch.head";
-                const char *ab = "branch.ab";
-                if ((tmp = strstr(*p, commit))) {
-                    if ((!repo->set_commit(repo, tmp + strlen(commit) + 1, GIT_HASH_LEN))) {
-                        fputs("Error setting repo commit", stderr);
-                        break;
-                    }
-                } else if ((tmp = strstr(*p, branch))) {
-                    if ((!repo->set_branch(repo, tmp + strlen(branch) + 1, 0))) {
-                        fputs("Error setting repo branch", stderr);
-                        break;
-                    }
-                } else if ((tmp = strstr(*p, ab))) {
-                    if ((!repo->set_ahead_behind(repo, tmp + strlen(ab) + 1))) {
-                        fputs("Error setting repo ahead/behind", stderr);
-                        break;
-                    }
-                } else if (*p[0] == '?') {
-                    ++repo->untracked;
-                } else if (*p[0] == '1') {
-                    ++repo->changed;
-                }
-                free(*p);
-                ++line;
-            }
-            free(split);
-        }
-        char repo_debug[1024];
-        repo->sprint(repo, repo_debug);
-        log_debug("Repo results:\n%s", repo_debug);
+    if ((output = capture_stream(args, deadline, repo->arena, feed_porcelain, &parser))) {
+        int timed_out = output->timed_out;
+        output->free(output);
+        if (timed_out) return 0;
+        porcelain_finish(&parser);
     } else {
         log_error("Error getting command output: %s", args[0]);
     }
-    output->free(output);
+    return 1;
 }
 
-void parse_result(struct git_repo *repo, const char *format, FILE *stream)
+/// Count commits ahead/behind upstream with git rev-list, without a worktree scan
+///
+/// Return 0 if git did not finish before `deadline`.
+static int run_ahead_behind(struct git_repo *repo, const char *dir, const struct timespec *deadline)
 {
-    for (const char *fmt = format; *fmt; ++fmt) {
-        if (*fmt == '%') {
-            ++fmt;
-            switch (*fmt) {
-            case 'b':
-                fprintf(stream, "%s", repo->branch);
-                break;
-            case 'c':
-                fprintf(stream, "%s", repo->commit);
-                break;
-            case 'u':
-                if (repo->untracked) fputs(UNTRACKED_GLYPH, stream);
-                break;
-            case 'U':
-                if (repo->untracked) fprintf(stream, "%d", repo->untracked);
-                break;
-            case 'm':
-                if (repo->changed) fputs(DIRTY_GLYPH, stream);
-                break;
-            case 'M':
-                if (repo->changed) fprintf(stream, "%d", repo->changed);
-                break;
-            case 'a':
-                if (repo->ahead) fputs(AHEAD_GLYPH, stream);
-                break;
-            case 'A':
-                if (repo->ahead) fprintf(stream, "%d", repo->ahead);
-                break;
-            case 'z':
-                if (repo->behind) fputs(BEHIND_GLYPH, stream);
-                break;
-            case 'Z':
-                if (repo->behind) fprintf(stream, "%d", repo->behind);
-                break;
-            case '\\':
-                // escape sequence
-                if (*++fmt == 'n') putc('\n', stream);
-                break;
-            default:
-                log_error("error: invalid format string token: %%%c\n", *fmt);
-                fprintf(stderr, "error: invalid format string token: %%%c\n", *fmt);
-                exit(1);
-            }
-        } else if (*fmt == '\\') {
-            if (*++fmt == 'n') {
-                putc('\n', stream);
-            } else {
-                log_warn("invalid escape sequence in format string: \\%s", fmt);
-            }
-        } else {
-            fputc(*fmt, stream);
-        }
+    char *args[] = {"git",         "-C",           (char *)dir, "rev-list", "--count",
+                    "--left-right", "HEAD...@{upstream}", NULL};
+    struct capture *output;
+    int ok = 1;
+    if ((output = capture_child(args, deadline, repo->arena))) {
+        ok = !output->timed_out;
+        // "<ahead>\t<behind>"; no output if there is no upstream
+        if (ok && output->status == 0) repo->set_ahead_behind(repo, output->childout.buf);
+        output->free(output);
+    } else {
+        log_error("Error getting command output: %s", args[0]);
     }
-    fflush(stream);
+    return ok;
 }
 
+unsigned parse_porcelain(struct git_repo *repo, struct options *opts)
+{
+    struct timespec deadline;
+    if (opts->timeout) deadline_set(&deadline, opts->timeout);
+    const struct timespec *limit = opts->timeout ? &deadline : NULL;
+    unsigned late = 0;
+    // set natively if some submodule could not be checked in time
+    repo->stale = false;
+
+    unsigned todo = native_status(repo, opts->directory, opts->plan, &opts->limits);
+    if (log_get_level() <= LOG_DEBUG) {
+        char plan[128];
+        plan_sprint(todo, plan, sizeof(plan));
+        log_debug("Sources left for git: %s", plan);
+    }
+    if (todo & ~PLAN_UPSTREAM) {
+        if (!run_status(repo, opts->directory, todo, &opts->limits, limit)) late = todo;
+    } else if (todo & PLAN_UPSTREAM) {
+        if (!run_ahead_behind(repo, opts->directory, limit)) late = todo;
+    }
+    if (late) repo->stale = true;
+
+    char repo_debug[1024];
+    repo->sprint(repo, repo_debug);
+    log_debug("Repo results:\n%s", repo_debug);
+    return late;
+}
+
+size_t render_prompt(const struct options *opts, struct arena *arena, char *buf, size_t size)
+{
+    struct git_repo *repo = new_git_repo(arena);
+    if (!repo) {
+        if (size) *buf = '\0';
+        return 0;
+    }
+    repo->count_cap = opts->count_cap;
+    // outside a repository there is nothing to show, and no point in asking git
+    if (discover_repo(repo, opts->directory) == DISCOVER_NONE) {
+        repo->free(repo);
+        if (size) *buf = '\0';
+        return 0;
+    }
+    struct options local = *opts;
+    struct status_cache cache;
+    local.plan = cache_load(&cache, repo, opts->directory, opts->plan);
+    if (local.plan) {
+        unsigned late = parse_porcelain(repo, &local);
+        // show the last known results, marked stale, rather than nothing
+        if (late) cache_load_stale(&cache, repo, late);
+        cache_store(&cache, repo, local.plan & ~late);
+    }
+    profile_mark(PROFILE_PARSE);
+    size_t len = format_render(opts->compiled_format, repo, buf, size);
+    profile_mark(PROFILE_RENDER);
+    repo->free(repo);
+    return len;
+}
@@ -1,9 +1,11 @@
 #pragma once
 
-#include <stdint.h>  // for uint8_t
-#include <stdio.h>   // for size_t, FILE
+#include <stdbool.h> // for bool
+#include <stddef.h>  // for size_t
 
+struct arena;
 struct options;
+struct status_ctx;
 
 #ifndef GIT_HASH_LEN
 #define GIT_HASH_LEN 7
@@ -12,13 +14,38 @@ struct options;
 /// Hold data parsed from git status
 struct git_repo
 {
+    /// Top level of the worktree
+    char *workdir;
+    /// Per-worktree git directory (HEAD, index)
+    char *gitdir;
+    /// Shared git directory (refs, objects, config)
+    char *commondir;
+    /// `gitdir` held open from discovery on, for reads relative to it (-1: none)
+    int gitdir_fd;
+    /// Where strings and the struct itself come from (NULL: heap)
+    struct arena *arena;
+    /// Native status state kept for incremental updates (long-lived callers only)
+    struct status_ctx *status;
     char *branch;
     char *commit;
-    uint8_t changed;
-    uint8_t untracked;
-    uint8_t unmerged;
-    uint8_t ahead;
-    uint8_t behind;
+    unsigned changed;
+    unsigned untracked;
+    unsigned unmerged;
+    unsigned ahead;
+    unsigned behind;
+    /// Populated submodules with other commits checked out, changes or untracked files
+    unsigned dirty_submodules;
+    /// Entries in the stash
+    unsigned stashes;
+    /// Operation in progress ("REBASE", "MERGING", ...; static) or NULL
+    const char *operation;
+    /// Step of the rebase or `git am` in progress, out of `steps` (0: unknown)
+    unsigned step;
+    unsigned steps;
+    /// Largest count rendered exactly; larger ones show as "<cap>+" (0: no cap)
+    unsigned count_cap;
+    /// Some results are missing or out of date because git ran out of time
+    bool stale;
 
     /// Set buf to debug representation of git_repo struct
     void (*sprint)(const struct git_repo *self, char *buf);
@@ -30,13 +57,23 @@ struct git_repo
     int (*set_commit)(struct git_repo *self, const char *commit, size_t len);
     /// Set git_repo ahead/behind from string
     int (*set_ahead_behind)(struct git_repo *self, char *buf);
+    /// Reset fields computed from the `plan_source` bits in `plan`
+    void (*clear)(struct git_repo *self, unsigned plan);
 };
 
-/// Parse git_repo according to format string
-void parse_result(struct git_repo *repo, const char *format, FILE *stream);
+/// Compute and render the prompt for `opts->directory` in `opts->compiled_format`
+///
+/// Use results cached on disk where still valid and store new ones. Write
+/// the prompt into `buf` of `size` bytes (see format_render()) and return
+/// its length. Repository data comes from `arena`.
+size_t render_prompt(const struct options *opts, struct arena *arena, char *buf, size_t size);
 
-/// Allocate new git_repo struct
-struct git_repo *new_git_repo();
+/// Allocate new git_repo struct from `arena` (NULL: heap)
+struct git_repo *new_git_repo(struct arena *arena);
 
-/// Parse output of git status to repo
-void parse_porcelain(struct git_repo *repo, struct options *opts);
+/// Parse status of repo, natively if possible, else from output of git status
+///
+/// Give up on git once `opts->timeout` milliseconds (if not 0) have passed.
+/// Return the `plan_source` bits that were not computed in time and set
+/// `repo->stale` if there are any.
+unsigned parse_porcelain(struct git_repo *repo, struct options *opts);
@@ -0,0 +1,117 @@
+#include "sha1.h"
+#include <string.h> // for memcpy
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1_block(struct sha1_ctx *ctx, const uint8_t *p)
+{
+    uint32_t w[80];
+    for (int i = 0; i < 16; ++i)
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 |
+               (uint32_t)p[4 * i + 2] << 8 | (uint32_t)p[4 * i + 3];
+    for (int i = 16; i < 80; ++i) w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    uint32_t a = ctx->h[0], b = ctx->h[1], c = ctx->h[2], d = ctx->h[3], e = ctx->h[4];
+    for (int i = 0; i < 80; ++i) {
+        uint32_t f, k;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+        uint32_t t = ROL(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = ROL(b, 30);
+        b = a;
+        a = t;
+    }
+    ctx->h[0] += a;
+    ctx->h[1] += b;
+    ctx->h[2] += c;
+    ctx->h[3] += d;
+    ctx->h[4] += e;
+}
+
+void sha1_init(struct sha1_ctx *ctx)
+{
+    ctx->h[0] = 0x67452301;
+    ctx->h[1] = 0xefcdab89;
+    ctx->h[2] = 0x98badcfe;
+    ctx->h[3] = 0x10325476;
+    ctx->h[4] = 0xc3d2e1f0;
+    ctx->len = 0;
+}
+
+void sha1_update(struct sha1_ctx *ctx, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    size_t used = ctx->len % 64;
+    ctx->len += len;
+    if (used) {
+        size_t fill = 64 - used;
+        if (len < fill) {
+            memcpy(ctx->block + used, p, len);
+            return;
+        }
+        memcpy(ctx->block + used, p, fill);
+        sha1_block(ctx, ctx->block);
+        p += fill;
+        len -= fill;
+    }
+    for (; len >= 64; p += 64, len -= 64) sha1_block(ctx, p);
+    memcpy(ctx->block, p, len);
+}
+
+void sha1_final(struct sha1_ctx *ctx, uint8_t out[SHA1_RAWSZ])
+{
+    uint64_t bits = ctx->len * 8;
+    uint8_t pad[72] = {0x80};
+    size_t used = ctx->len % 64;
+    size_t padlen = (used < 56 ? 56 : 120) - used;
+    for (int i = 0; i < 8; ++i) pad[padlen + i] = (uint8_t)(bits >> (56 - 8 * i));
+    sha1_update(ctx, pad, padlen + 8);
+    for (int i = 0; i < 5; ++i) {
+        out[4 * i] = (uint8_t)(ctx->h[i] >> 24);
+        out[4 * i + 1] = (uint8_t)(ctx->h[i] >> 16);
+        out[4 * i + 2] = (uint8_t)(ctx->h[i] >> 8);
+        out[4 * i + 3] = (uint8_t)ctx->h[i];
+    }
+}
+
+void oid_to_hex(const uint8_t *oid, char *hex)
+{
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < SHA1_RAWSZ; ++i) {
+        *hex++ = digits[oid[i] >> 4];
+        *hex++ = digits[oid[i] & 0xf];
+    }
+    *hex = '\0';
+}
+
+static int hexval(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+int hex_to_oid(const char *hex, uint8_t *oid)
+{
+    for (int i = 0; i < SHA1_RAWSZ; ++i) {
+        int hi = hexval(hex[2 * i]);
+        int lo = hi < 0 ? -1 : hexval(hex[2 * i + 1]);
+        if (lo < 0) return 0;
+        oid[i] = (uint8_t)(hi << 4 | lo);
+    }
+    return 1;
+}
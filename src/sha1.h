@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t, uint8_t
+
+#define SHA1_RAWSZ 20
+#define SHA1_HEXSZ 40
+
+/// Incremental SHA-1 state
+struct sha1_ctx
+{
+    uint32_t h[5];
+    uint64_t len;
+    uint8_t block[64];
+};
+
+void sha1_init(struct sha1_ctx *ctx);
+void sha1_update(struct sha1_ctx *ctx, const void *data, size_t len);
+void sha1_final(struct sha1_ctx *ctx, uint8_t out[SHA1_RAWSZ]);
+
+/// Write 40 char lowercase hex (plus terminating NULL) of `oid` to `hex`
+void oid_to_hex(const uint8_t *oid, char *hex);
+
+/// Parse 40 char hex string into raw oid; return 1 on success
+int hex_to_oid(const char *hex, uint8_t *oid);
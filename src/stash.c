@@ -0,0 +1,47 @@
+#include "stash.h"
+#include "log.h"      // for log_debug
+#include "repo.h"     // for git_repo
+#include "util.h"     // for map_file, path_join
+#include <errno.h>    // for errno, ENOENT, ENOTDIR
+#include <limits.h>   // for PATH_MAX
+#include <string.h>   // for strerror
+#include <sys/mman.h> // for munmap
+#ifdef __SSE2__
+#include <emmintrin.h> // for _mm_cmpeq_epi8, _mm_loadu_si128, _mm_movemask_epi8, _mm_set1_epi8
+#endif
+
+size_t count_lines(const char *buf, size_t len)
+{
+    size_t nr = 0, i = 0;
+#ifdef __SSE2__
+    // 16 bytes per compare; the mask has one bit per newline
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(buf + i));
+        nr += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, nl)));
+    }
+#endif
+    for (; i < len; ++i) nr += buf[i] == '\n';
+    return nr + (len && buf[len - 1] != '\n');
+}
+
+int stash_count(struct git_repo *repo)
+{
+    char path[PATH_MAX];
+    size_t size;
+    // refs/stash is shared by all worktrees
+    if (!path_join(path, sizeof(path), repo->commondir, "logs/refs/stash")) return 0;
+    const char *map = map_file(path, &size);
+    if (!map) {
+        // missing or empty: nothing stashed
+        if (errno && errno != ENOENT && errno != ENOTDIR) {
+            log_debug("stash: cannot read %s: %s", path, strerror(errno));
+            return 0;
+        }
+        repo->stashes = 0;
+        return 1;
+    }
+    repo->stashes = count_lines(map, size);
+    munmap((void *)map, size);
+    return 1;
+}
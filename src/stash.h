@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stddef.h> // for size_t
+
+struct git_repo;
+
+/// Count lines in `len` bytes of `buf`, a last one without '\n' included
+size_t count_lines(const char *buf, size_t len);
+
+/// Set `repo->stashes` to the number of entries in the stash reflog
+///
+/// Each entry is one line of `logs/refs/stash`, as `git stash list` shows
+/// them. Return 0 if the reflog exists but cannot be read (ask git).
+int stash_count(struct git_repo *repo);
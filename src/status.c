@@ -0,0 +1,794 @@
+#define _GNU_SOURCE // for memrchr
+#include "status.h"
+#include "config.h"    // for config_get_all, config_bool
+#include "discover.h"  // for discover_repo, DISCOVER_FOUND
+#include "fsmonitor.h" // for fsmonitor, fsmonitor_query, fsmonitor_changed, fsmonitor_clear
+#include "graph.h"     // for graph_ahead_behind
+#include "index.h"     // for git_index, index_entry, read_index
+#include "log.h"       // for log_debug
+#include "odb.h"       // for odb, new_odb, odb_read, odb_commit_tree
+#include "operation.h" // for read_operation
+#include "plan.h"      // for plan_limits, PLAN_INDEX, PLAN_REFS, PLAN_WORKTREE, PLAN_UNTRACKED, PLAN_UPSTREAM
+#include "refs.h"      // for refs_read_head, refs_resolve, refs_upstream
+#include "repo.h"      // for git_repo
+#include "stash.h"     // for stash_count
+#include "submodule.h" // for submodule, submodules_check
+#include "untracked.h" // for count_untracked, untracked_dirs, untracked_dirs_clear
+#include "util.h"      // for path_join
+#include <errno.h>     // for errno, ENOENT, ENOTDIR
+#include <fcntl.h>     // for openat, open, O_RDONLY, O_DIRECTORY, O_CLOEXEC
+#include <limits.h>    // for PATH_MAX
+#include <pthread.h>   // for pthread_create, pthread_join, pthread_mutex_lock
+#include <stdbool.h>   // for bool, true, false
+#include <stdio.h>     // for snprintf
+#include <stddef.h>    // for offsetof
+#include <stdlib.h>    // for calloc, free, qsort, bsearch, strtoul
+#include <string.h>    // for memcmp, memcpy, memrchr, memset, strlen, strncmp
+#include <sys/stat.h>  // for fstatat, stat, S_ISREG, S_ISLNK, S_ISDIR
+#include <unistd.h>    // for close, read, readlinkat, sysconf
+
+#define S_IFGITLINK 0160000
+
+// Worktree scan threading
+#define MAX_SCAN_THREADS 16
+#define SCAN_MIN_PER_THREAD 2048
+#define SCAN_CHUNK 256
+
+// Per-entry marks
+#define MARK_STAGED 0x1
+#define MARK_ADDED 0x2
+#define MARK_UNSTAGED 0x4
+#define MARK_CHANGED (MARK_STAGED | MARK_UNSTAGED)
+#define MARK_SUBMODULE 0x8        // populated submodule, checked
+#define MARK_SUBMODULE_DIRTY 0x10 // and found to differ from its gitlink
+
+/// State shared while comparing HEAD, index and worktree
+///
+/// Long-lived callers keep one per repository so that later worktree
+/// changes can be applied to the per-entry marks without a full scan.
+struct status_ctx
+{
+    struct git_repo *repo;
+    struct git_index *index;
+    struct odb *odb;
+    uint8_t *marks;
+    uint32_t pos;
+    int workdir_fd;
+    bool filemode;
+    bool trustctime;
+    int may_convert; // -1 until checked
+    /// Whether index and marks reflect a complete index + worktree scan
+    bool valid;
+    /// Populated submodules checked, and whether some could not be checked in time
+    size_t submodules;
+    bool submodules_late;
+    /// Paths deleted from HEAD, less exact renames, counted as changes
+    size_t extra;
+    size_t unmerged;
+    /// Blobs in HEAD whose paths are gone from the index, for rename pairing
+    uint8_t (*deleted)[SHA1_RAWSZ];
+    size_t nr_deleted;
+    size_t alloc_deleted;
+    char path[PATH_MAX];
+    /// Untracked directories looked into by the last untracked count, if it
+    /// was native (`untracked_ok`); kept across reset_ctx()
+    struct untracked_dirs untracked_dirs;
+    bool untracked_ok;
+};
+
+/// Compare index path with `len` bytes of `path`, in index order
+static int cmp_path(const struct index_entry *ce, const char *path, size_t len)
+{
+    size_t min = ce->path_len < len ? ce->path_len : len;
+    int c = memcmp(ce->path, path, min);
+    if (c) return c;
+    return (ce->path_len > len) - (ce->path_len < len);
+}
+
+static void mark_added(struct status_ctx *ctx, uint32_t pos)
+{
+    // conflicted entries are counted as unmerged instead
+    if (!ce_stage(&ctx->index->entries[pos])) ctx->marks[pos] |= MARK_STAGED | MARK_ADDED;
+}
+
+static int add_deleted(struct status_ctx *ctx, const uint8_t *oid)
+{
+    if (ctx->nr_deleted == ctx->alloc_deleted) {
+        size_t alloc = ctx->alloc_deleted ? ctx->alloc_deleted * 2 : 16;
+        void *tmp = realloc(ctx->deleted, alloc * SHA1_RAWSZ);
+        if (!tmp) return 0;
+        ctx->deleted = tmp;
+        ctx->alloc_deleted = alloc;
+    }
+    memcpy(ctx->deleted[ctx->nr_deleted++], oid, SHA1_RAWSZ);
+    return 1;
+}
+
+/// Walk tree `oid` at `prefix_len` bytes of ctx->path alongside the index
+///
+/// Subtrees whose cached tree node (`ct`) is still valid and matches are
+/// skipped without reading any objects. Return 0 on read error.
+static int diff_tree(struct status_ctx *ctx, const uint8_t *oid, size_t prefix_len, int32_t ct)
+{
+    struct git_index *index = ctx->index;
+    if (ct >= 0) {
+        const struct cache_tree *node = &index->cache_tree[ct];
+        if (node->entry_count >= 0 && !memcmp(node->oid, oid, SHA1_RAWSZ)) {
+            ctx->pos += node->entry_count;
+            return 1;
+        }
+    }
+    enum object_type type;
+    size_t size;
+    char *buf = odb_read(ctx->odb, oid, &type, &size);
+    if (!buf || type != OBJ_TREE) goto corrupt;
+
+    for (const char *p = buf, *end = buf + size; p < end;) {
+        char *sp;
+        unsigned long mode = strtoul(p, &sp, 8);
+        if (*sp != ' ') goto corrupt;
+        const char *name = sp + 1;
+        const char *nul = memchr(name, '\0', end - name);
+        if (!nul || end - nul <= SHA1_RAWSZ) goto corrupt;
+        const uint8_t *entry_oid = (const uint8_t *)nul + 1;
+        p = nul + 1 + SHA1_RAWSZ;
+
+        size_t name_len = nul - name;
+        size_t len = prefix_len + name_len;
+        bool is_dir = S_ISDIR(mode);
+        if (len + 2 > sizeof(ctx->path)) goto corrupt;
+        memcpy(ctx->path + prefix_len, name, name_len);
+        if (is_dir) ctx->path[len++] = '/';
+
+        // index entries sorting before this one are not in HEAD
+        while (ctx->pos < index->nr && cmp_path(&index->entries[ctx->pos], ctx->path, len) < 0)
+            mark_added(ctx, ctx->pos++);
+
+        if (is_dir) {
+            int32_t child = ct >= 0 ? cache_tree_child(index, ct, name, name_len) : -1;
+            if (!diff_tree(ctx, entry_oid, len, child)) goto corrupt;
+            while (ctx->pos < index->nr && index->entries[ctx->pos].path_len > len &&
+                   !memcmp(index->entries[ctx->pos].path, ctx->path, len))
+                mark_added(ctx, ctx->pos++);
+        } else if (ctx->pos < index->nr &&
+                   !cmp_path(&index->entries[ctx->pos], ctx->path, len)) {
+            struct index_entry *ce = &index->entries[ctx->pos];
+            if (ce_stage(ce)) {
+                while (ctx->pos < index->nr &&
+                       !cmp_path(&index->entries[ctx->pos], ctx->path, len))
+                    ++ctx->pos;
+            } else {
+                if (ce->mode != mode || memcmp(ce->oid, entry_oid, SHA1_RAWSZ))
+                    ctx->marks[ctx->pos] |= MARK_STAGED;
+                ++ctx->pos;
+            }
+        } else if (!add_deleted(ctx, entry_oid)) {
+            goto corrupt;
+        }
+    }
+    free(buf);
+    return 1;
+corrupt:
+    log_debug("status: unable to read tree for '%.*s'", (int)prefix_len, ctx->path);
+    free(buf);
+    return 0;
+}
+
+/// Check whether content filters or line ending conversion could apply
+static bool may_convert(struct status_ctx *ctx)
+{
+    if (ctx->may_convert >= 0) return ctx->may_convert;
+    char *autocrlf = config_get_all(ctx->repo->commondir, "core.autocrlf");
+    bool convert = config_bool(autocrlf, false);
+    free(autocrlf);
+
+    char path[PATH_MAX];
+    if (!convert && path_join(path, sizeof(path), ctx->repo->commondir, "info/attributes"))
+        convert = access(path, F_OK) == 0;
+    for (uint32_t i = 0; !convert && i < ctx->index->nr; ++i) {
+        const struct index_entry *ce = &ctx->index->entries[i];
+        const char *base = strrchr(ce->path, '/');
+        convert = !strcmp(base ? base + 1 : ce->path, ".gitattributes");
+    }
+    ctx->may_convert = convert;
+    return convert;
+}
+
+/// Hash worktree file as a blob and compare with the index
+///
+/// Return 1 if content differs, 0 if same, -1 if undecidable.
+static int compare_content(struct status_ctx *ctx, const struct index_entry *ce,
+                           const struct stat *st)
+{
+    struct sha1_ctx sha;
+    uint8_t oid[SHA1_RAWSZ];
+    char buf[65536];
+    int hdrlen = snprintf(buf, sizeof(buf), "blob %zu", (size_t)st->st_size) + 1;
+    sha1_init(&sha);
+    sha1_update(&sha, buf, hdrlen);
+
+    if (S_ISLNK(st->st_mode)) {
+        ssize_t len = readlinkat(ctx->workdir_fd, ce->path, buf, sizeof(buf));
+        if (len < 0 || len != st->st_size) return -1;
+        sha1_update(&sha, buf, len);
+    } else {
+        int fd = openat(ctx->workdir_fd, ce->path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+        if (fd < 0) return -1;
+        size_t total = 0;
+        ssize_t nread;
+        while ((nread = read(fd, buf, sizeof(buf))) > 0) {
+            sha1_update(&sha, buf, nread);
+            total += nread;
+        }
+        close(fd);
+        if (nread < 0) return -1;
+        // file changed size while hashing: report as modified
+        if (total != (size_t)st->st_size) return 1;
+    }
+    sha1_final(&sha, oid);
+    if (!memcmp(oid, ce->oid, SHA1_RAWSZ)) return 0;
+    return may_convert(ctx) ? -1 : 1;
+}
+
+/// Entry stat data is not trustworthy if written in the same tick as the index
+static bool is_racy(const struct status_ctx *ctx, const struct index_entry *ce)
+{
+    const struct timespec *t = &ctx->index->mtime;
+    return (int64_t)ce->mtime_sec > (int64_t)t->tv_sec ||
+           ((int64_t)ce->mtime_sec == (int64_t)t->tv_sec && (long)ce->mtime_nsec >= t->tv_nsec);
+}
+
+/// Compare index entry against worktree
+///
+/// Return 1 if modified, 0 if clean, -1 if undecidable without git.
+static int check_worktree(struct status_ctx *ctx, const struct index_entry *ce)
+{
+    if (ce->flags & CE_ASSUME_VALID || ce->xflags & CE_SKIP_WORKTREE) return 0;
+    if (ce->xflags & CE_INTENT_TO_ADD) return 1;
+    struct stat st;
+    if (fstatat(ctx->workdir_fd, ce->path, &st, AT_SYMLINK_NOFOLLOW) < 0)
+        return errno == ENOENT || errno == ENOTDIR ? 1 : -1;
+
+    switch (ce->mode & S_IFMT) {
+    case S_IFREG:
+        if (!S_ISREG(st.st_mode)) return 1;
+        if (ctx->filemode && ((ce->mode ^ st.st_mode) & 0100)) return 1;
+        break;
+    case S_IFLNK:
+        if (!S_ISLNK(st.st_mode)) return 1;
+        break;
+    case S_IFGITLINK: {
+        if (!S_ISDIR(st.st_mode)) return 1;
+        uint8_t mark = ctx->marks[ce - ctx->index->entries];
+        if (mark & MARK_SUBMODULE) return !!(mark & MARK_SUBMODULE_DIRTY);
+        // populated submodules need their own status; empty ones are clean
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/.git", ce->path) >= PATH_MAX) return -1;
+        return faccessat(ctx->workdir_fd, path, F_OK, 0) == 0 ? -1 : 0;
+    }
+    default:
+        return -1;
+    }
+
+    bool changed = ce->mtime_sec != (uint32_t)st.st_mtim.tv_sec ||
+                   ce->mtime_nsec != (uint32_t)st.st_mtim.tv_nsec ||
+                   (ctx->trustctime && (ce->ctime_sec != (uint32_t)st.st_ctim.tv_sec ||
+                                        ce->ctime_nsec != (uint32_t)st.st_ctim.tv_nsec)) ||
+                   ce->ino != (uint32_t)st.st_ino || ce->uid != (uint32_t)st.st_uid ||
+                   ce->gid != (uint32_t)st.st_gid || ce->size != (uint32_t)st.st_size;
+    if (changed) {
+        // a size change is conclusive unless the entry was smudged to 0 by git
+        if (ce->size != (uint32_t)st.st_size && ce->size != 0) return 1;
+    } else if (!is_racy(ctx, ce)) {
+        return 0;
+    }
+    return compare_content(ctx, ce, &st);
+}
+
+static int cmp_oid(const void *a, const void *b) { return memcmp(a, b, SHA1_RAWSZ); }
+
+/// Count exact renames: added paths whose blob matches a deleted path
+static size_t count_renames(struct status_ctx *ctx)
+{
+    if (!ctx->nr_deleted) return 0;
+    qsort(ctx->deleted, ctx->nr_deleted, SHA1_RAWSZ, cmp_oid);
+    uint8_t *used = calloc(ctx->nr_deleted, 1);
+    if (!used) return 0;
+    size_t renames = 0;
+    for (uint32_t i = 0; i < ctx->index->nr; ++i) {
+        if (!(ctx->marks[i] & MARK_ADDED)) continue;
+        uint8_t(*hit)[SHA1_RAWSZ] = bsearch(ctx->index->entries[i].oid, ctx->deleted,
+                                            ctx->nr_deleted, SHA1_RAWSZ, cmp_oid);
+        if (!hit) continue;
+        // step back to first duplicate, then take first unused one
+        while (hit > ctx->deleted && !cmp_oid(hit - 1, hit)) --hit;
+        for (; hit < ctx->deleted + ctx->nr_deleted &&
+               !cmp_oid(hit, ctx->index->entries[i].oid);
+             ++hit) {
+            if (!used[hit - ctx->deleted]) {
+                used[hit - ctx->deleted] = 1;
+                ++renames;
+                break;
+            }
+        }
+    }
+    free(used);
+    return renames;
+}
+
+/// Release everything held from a previous scan
+static void reset_ctx(struct status_ctx *ctx)
+{
+    if (ctx->workdir_fd >= 0) close(ctx->workdir_fd);
+    if (ctx->index) ctx->index->free(ctx->index);
+    if (ctx->odb) ctx->odb->free(ctx->odb);
+    free(ctx->marks);
+    free(ctx->deleted);
+    struct git_repo *repo = ctx->repo;
+    memset(ctx, 0, offsetof(struct status_ctx, path));
+    ctx->repo = repo;
+    ctx->workdir_fd = -1;
+    ctx->may_convert = -1;
+}
+
+struct status_ctx *new_status_ctx(struct git_repo *repo)
+{
+    struct status_ctx *ctx = calloc(1, sizeof(struct status_ctx));
+    if (!ctx) return NULL;
+    ctx->repo = repo;
+    ctx->workdir_fd = -1;
+    ctx->may_convert = -1;
+    return ctx;
+}
+
+void free_status_ctx(struct status_ctx *ctx)
+{
+    if (!ctx) return;
+    reset_ctx(ctx);
+    untracked_dirs_clear(&ctx->untracked_dirs);
+    free(ctx);
+}
+
+/// Sum per-entry marks into repo->changed
+static size_t count_changed(struct status_ctx *ctx)
+{
+    size_t changed = ctx->extra;
+    for (uint32_t i = 0; i < ctx->index->nr; ++i)
+        if (ctx->marks[i] & MARK_CHANGED) ++changed;
+    ctx->repo->changed = changed;
+    ctx->repo->unmerged = ctx->unmerged;
+    return changed;
+}
+
+/// Index entries [bounds[i], bounds[i + 1]) of chunk i, queued per thread
+struct scan_queue
+{
+    pthread_mutex_t lock;
+    /// Own chunks are taken from the front, stolen ones from the back
+    size_t head, tail;
+};
+
+/// Worktree scan shared by all threads
+struct scan
+{
+    struct status_ctx *ctx;
+    /// Paths reported by core.fsmonitor, or NULL to check every entry
+    const struct fsmonitor *fsm;
+    uint32_t *bounds;
+    struct scan_queue *queues;
+    unsigned nr_threads;
+    /// Stop once this many changes are found (0: never)
+    unsigned limit;
+    /// Updated atomically
+    size_t found;
+    int failed;
+};
+
+/// Per-thread argument of scan_thread()
+struct scan_arg
+{
+    struct scan *scan;
+    unsigned id;
+};
+
+/// Take the next chunk of thread `id`, else steal one; return 0 if none is left
+static int next_chunk(struct scan *scan, unsigned id, size_t *chunk)
+{
+    for (unsigned k = 0; k < scan->nr_threads; ++k) {
+        struct scan_queue *q = &scan->queues[(id + k) % scan->nr_threads];
+        int ok = 0;
+        pthread_mutex_lock(&q->lock);
+        if (q->head < q->tail) {
+            *chunk = k ? --q->tail : q->head++;
+            ok = 1;
+        }
+        pthread_mutex_unlock(&q->lock);
+        if (ok) return 1;
+    }
+    return 0;
+}
+
+/// Whether entry `pos` is up to date by the fsmonitor: git knew it was when it
+/// last synced with the fsmonitor, and nothing at or above it was reported since
+static bool fsmonitor_clean(const struct status_ctx *ctx, const struct fsmonitor *fsm,
+                            uint32_t pos)
+{
+    const struct index_entry *ce = &ctx->index->entries[pos];
+    // git never takes the fsmonitor's word for submodules
+    if (ctx->index->fsmonitor_dirty[pos] || (ce->mode & S_IFMT) == S_IFGITLINK ||
+        ce->xflags & CE_INTENT_TO_ADD)
+        return false;
+    return !fsmonitor_changed(fsm, ce->path, ce->path_len);
+}
+
+static void *scan_thread(void *arg)
+{
+    struct scan *scan = ((struct scan_arg *)arg)->scan;
+    unsigned id = ((struct scan_arg *)arg)->id;
+    struct status_ctx *ctx = scan->ctx;
+    size_t chunk;
+    while (next_chunk(scan, id, &chunk)) {
+        for (uint32_t i = scan->bounds[chunk]; i < scan->bounds[chunk + 1]; ++i) {
+            if (__atomic_load_n(&scan->failed, __ATOMIC_RELAXED) ||
+                (scan->limit && __atomic_load_n(&scan->found, __ATOMIC_RELAXED) >= scan->limit))
+                return NULL;
+            const struct index_entry *ce = &ctx->index->entries[i];
+            if (ce_stage(ce) || ctx->marks[i] & MARK_STAGED) continue;
+            if (scan->fsm && fsmonitor_clean(ctx, scan->fsm, i)) continue;
+            int ret = check_worktree(ctx, ce);
+            if (ret < 0) {
+                log_debug("status: cannot decide state of '%s' natively", ce->path);
+                __atomic_store_n(&scan->failed, 1, __ATOMIC_RELAXED);
+                return NULL;
+            }
+            if (ret) {
+                // each entry belongs to one thread, so its mark needs no lock
+                ctx->marks[i] |= MARK_UNSTAGED;
+                __atomic_add_fetch(&scan->found, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    return NULL;
+}
+
+/// Length of the directory part of `ce`'s path, including the slash
+static size_t dir_len(const struct index_entry *ce)
+{
+    const char *slash = memrchr(ce->path, '/', ce->path_len);
+    return slash ? (size_t)(slash - ce->path) + 1 : 0;
+}
+
+/// Split the index into chunks of roughly SCAN_CHUNK entries, cut between directories
+///
+/// Entries of one directory are contiguous in the index; keeping them
+/// together keeps each directory's dentries hot on one thread. A single
+/// directory of more than 4 * SCAN_CHUNK entries is cut anyway. Return
+/// the number of chunks.
+static size_t split_chunks(const struct git_index *index, uint32_t *bounds)
+{
+    size_t nr = 0;
+    uint32_t start = 0;
+    bounds[0] = 0;
+    for (uint32_t i = 1; i < index->nr; ++i) {
+        uint32_t size = i - start;
+        if (size < SCAN_CHUNK) continue;
+        const struct index_entry *prev = &index->entries[i - 1], *ce = &index->entries[i];
+        size_t len = dir_len(prev);
+        bool same_dir = len == dir_len(ce) && !memcmp(prev->path, ce->path, len);
+        if (same_dir && size < 4 * SCAN_CHUNK) continue;
+        bounds[++nr] = start = i;
+    }
+    bounds[++nr] = index->nr;
+    return nr;
+}
+
+/// Mark index entries whose worktree file differs as unstaged, on several threads
+///
+/// Chunks of the index are dealt out to the threads in order; a thread that
+/// runs out steals from the back of another's queue, so one huge directory
+/// does not leave the other threads idle. Set `early` if the scan stopped
+/// at `limit` changes. Entries `fsm` (if not NULL) vouches for are not
+/// looked at. Return 0 if some entry cannot be decided natively.
+static int scan_worktree(struct status_ctx *ctx, const struct fsmonitor *fsm, unsigned limit,
+                         bool *early)
+{
+    struct git_index *index = ctx->index;
+    if (!index->nr) return 1;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned nr_threads = cpus > 1 ? cpus : 1;
+    if (nr_threads > MAX_SCAN_THREADS) nr_threads = MAX_SCAN_THREADS;
+    if (nr_threads > index->nr / SCAN_MIN_PER_THREAD) nr_threads = index->nr / SCAN_MIN_PER_THREAD;
+    if (!nr_threads) nr_threads = 1;
+
+    struct scan scan = {.ctx = ctx, .fsm = fsm, .nr_threads = nr_threads, .limit = limit};
+    scan.found = limit ? count_changed(ctx) : 0;
+    scan.bounds = malloc((index->nr / SCAN_CHUNK + 2) * sizeof(*scan.bounds));
+    scan.queues = calloc(nr_threads, sizeof(*scan.queues));
+    struct scan_arg args[MAX_SCAN_THREADS];
+    pthread_t threads[MAX_SCAN_THREADS];
+    unsigned started = 1;
+    if (!scan.bounds || !scan.queues) {
+        scan.failed = 1;
+        goto out;
+    }
+    size_t nr_chunks = split_chunks(index, scan.bounds);
+    for (unsigned t = 0; t < nr_threads; ++t) {
+        pthread_mutex_init(&scan.queues[t].lock, NULL);
+        scan.queues[t].head = nr_chunks * t / nr_threads;
+        scan.queues[t].tail = nr_chunks * (t + 1) / nr_threads;
+        args[t] = (struct scan_arg){.scan = &scan, .id = t};
+    }
+    // decided once up front rather than racing from several threads
+    if (nr_threads > 1) may_convert(ctx);
+    for (; started < nr_threads; ++started)
+        if (pthread_create(&threads[started], NULL, scan_thread, &args[started])) break;
+    // this thread takes queue 0; queues of threads that failed to start get stolen
+    scan_thread(&args[0]);
+    for (unsigned t = 1; t < started; ++t) pthread_join(threads[t], NULL);
+    for (unsigned t = 0; t < nr_threads; ++t) pthread_mutex_destroy(&scan.queues[t].lock);
+    log_debug("status: scanned %zu chunks on %u threads", nr_chunks, started);
+out:
+    free(scan.bounds);
+    free(scan.queues);
+    *early = limit && scan.found >= limit;
+    return !scan.failed;
+}
+
+/// Check every populated submodule in the index against its gitlink, concurrently
+///
+/// Mark the gitlinks for check_worktree() and set `repo->dirty_submodules`.
+/// Return 0 if out of memory.
+static int check_submodules(struct status_ctx *ctx)
+{
+    struct git_index *index = ctx->index;
+    struct submodule *subs = NULL;
+    uint32_t *pos = NULL;
+    size_t nr = 0, alloc = 0;
+    int ok = 0;
+    for (uint32_t i = 0; i < index->nr; ++i) {
+        const struct index_entry *ce = &index->entries[i];
+        char path[PATH_MAX];
+        if ((ce->mode & S_IFMT) != S_IFGITLINK || ce_stage(ce) ||
+            ce->flags & CE_ASSUME_VALID || ce->xflags & CE_SKIP_WORKTREE ||
+            snprintf(path, sizeof(path), "%s/.git", ce->path) >= PATH_MAX ||
+            faccessat(ctx->workdir_fd, path, F_OK, 0) < 0)
+            continue;
+        if (nr == alloc) {
+            alloc = alloc ? alloc * 2 : 16;
+            void *tmp = realloc(subs, alloc * sizeof(*subs));
+            if (!tmp) goto out;
+            subs = tmp;
+            if (!(tmp = realloc(pos, alloc * sizeof(*pos)))) goto out;
+            pos = tmp;
+        }
+        subs[nr].path = ce->path;
+        memcpy(subs[nr].oid, ce->oid, SHA1_RAWSZ);
+        pos[nr++] = i;
+    }
+    submodules_check(ctx->repo, subs, nr);
+    unsigned dirty = 0;
+    for (size_t k = 0; k < nr; ++k) {
+        ctx->marks[pos[k]] |= MARK_SUBMODULE;
+        if (subs[k].dirty > 0) {
+            ctx->marks[pos[k]] |= MARK_SUBMODULE_DIRTY;
+            ++dirty;
+        }
+        // shown as clean, but the prompt is marked stale
+        if (subs[k].dirty < 0) ctx->submodules_late = true;
+    }
+    ctx->submodules = nr;
+    ctx->repo->dirty_submodules = dirty;
+    ok = 1;
+out:
+    free(subs);
+    free(pos);
+    return ok;
+}
+
+/// Count changed paths between HEAD, index and worktree as `plan` requests
+///
+/// Stop checking the worktree once `limit` (if not 0) changes are found.
+/// Only check entries `fsm` does not vouch for, asking it first if need be.
+/// Unless the index is kept in `repo->status`, hand it to `keep` (if not
+/// NULL) for the untracked scan instead of freeing it.
+static int scan_changes(struct git_repo *repo, const uint8_t *head, int unborn, unsigned plan,
+                        unsigned limit, struct fsmonitor *fsm, struct git_index **keep)
+{
+    char path[PATH_MAX];
+    uint8_t tree[SHA1_RAWSZ];
+    int ok = 0;
+    struct status_ctx local = {.repo = repo, .workdir_fd = -1, .may_convert = -1};
+    struct status_ctx *ctx = repo->status ? repo->status : &local;
+    reset_ctx(ctx);
+    if (!path_join(path, sizeof(path), repo->gitdir, "index") || !(ctx->index = read_index(path)))
+        goto out;
+    if (ctx->index->nr && !(ctx->marks = calloc(ctx->index->nr, 1))) goto out;
+
+    // staged changes: HEAD tree vs index; everything is staged on an unborn branch
+    if (plan & PLAN_INDEX) {
+        if (!(ctx->odb = new_odb(repo->commondir))) goto out;
+        if (!unborn && !odb_commit_tree(ctx->odb, head, tree)) goto out;
+        if (!unborn && !diff_tree(ctx, tree, 0, ctx->index->cache_tree_nr ? 0 : -1)) goto out;
+        while (ctx->pos < ctx->index->nr) mark_added(ctx, ctx->pos++);
+        ctx->extra = ctx->nr_deleted - count_renames(ctx);
+    }
+
+    if (plan & (PLAN_WORKTREE | PLAN_SUBMODULES)) {
+        ctx->workdir_fd = open(repo->workdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (ctx->workdir_fd < 0) goto out;
+        char *val = config_get_all(repo->commondir, "core.filemode");
+        ctx->filemode = config_bool(val, true);
+        free(val);
+        val = config_get_all(repo->commondir, "core.trustctime");
+        ctx->trustctime = config_bool(val, true);
+        free(val);
+    }
+
+    const char *last_unmerged = NULL;
+    for (uint32_t i = 0; i < ctx->index->nr; ++i) {
+        const struct index_entry *ce = &ctx->index->entries[i];
+        if (ce_stage(ce)) {
+            if (!last_unmerged || strcmp(last_unmerged, ce->path)) ++ctx->unmerged;
+            last_unmerged = ce->path;
+        }
+    }
+
+    // submodules first: their gitlinks are decided by their own status
+    if (plan & (PLAN_WORKTREE | PLAN_SUBMODULES) && !check_submodules(ctx)) goto out;
+    if (ctx->submodules_late) repo->stale = true;
+
+    // unstaged changes: index vs worktree
+    bool early = false;
+    if (plan & PLAN_WORKTREE &&
+        !scan_worktree(ctx, fsmonitor_query(fsm, repo, ctx->index) ? fsm : NULL, limit, &early))
+        goto out;
+
+    size_t changed = plan & (PLAN_INDEX | PLAN_WORKTREE) ? count_changed(ctx) : 0;
+    // changes inside submodules are not tracked by native_update_paths()
+    ctx->valid = !early && (plan & (PLAN_INDEX | PLAN_WORKTREE)) == (PLAN_INDEX | PLAN_WORKTREE) &&
+                 !ctx->submodules;
+    ok = 1;
+    log_debug("status: native scan of %u entries: %zu changed, %zu unmerged%s", ctx->index->nr,
+              changed, ctx->unmerged, early ? " (stopped early)" : "");
+out:
+    // the object database is only needed for the tree diff
+    if (ctx->odb) ctx->odb->free(ctx->odb);
+    ctx->odb = NULL;
+    if (ok && ctx == &local && keep) {
+        *keep = ctx->index;
+        ctx->index = NULL;
+    }
+    if (ctx == &local || !ok) reset_ctx(ctx);
+    return ok;
+}
+
+const struct untracked_dirs *native_untracked_dirs(const struct git_repo *repo)
+{
+    const struct status_ctx *ctx = repo->status;
+    return ctx && ctx->untracked_ok && !ctx->untracked_dirs.lost ? &ctx->untracked_dirs : NULL;
+}
+
+int native_update_paths(struct git_repo *repo, const char *const *paths, size_t nr)
+{
+    struct status_ctx *ctx = repo->status;
+    if (!ctx || !ctx->valid) return 0;
+    size_t checked = 0;
+    for (size_t p = 0; p < nr; ++p) {
+        size_t len = strlen(paths[p]);
+        // the path itself, or everything below it if it was a directory
+        for (uint32_t i = index_lower_bound(ctx->index, paths[p], len); i < ctx->index->nr; ++i) {
+            const struct index_entry *ce = &ctx->index->entries[i];
+            if (ce->path_len < len || memcmp(ce->path, paths[p], len) ||
+                (ce->path_len > len && ce->path[len] != '/'))
+                break;
+            if (ce_stage(ce) || ctx->marks[i] & MARK_STAGED) continue;
+            int ret = check_worktree(ctx, ce);
+            if (ret < 0) {
+                ctx->valid = false;
+                return 0;
+            }
+            ctx->marks[i] = ret ? ctx->marks[i] | MARK_UNSTAGED : ctx->marks[i] & ~MARK_UNSTAGED;
+            ++checked;
+        }
+    }
+    size_t changed = count_changed(ctx);
+    log_debug("status: rechecked %zu entries for %zu paths: %zu changed", checked, nr, changed);
+    return 1;
+}
+
+/// Count commits ahead/behind the upstream of the current branch
+///
+/// Return 0 if git has to be asked.
+static int native_upstream(struct git_repo *repo)
+{
+    uint8_t head[SHA1_RAWSZ], upstream[SHA1_RAWSZ];
+    char branch[PATH_MAX], ref[PATH_MAX];
+    enum ref_status status = refs_resolve(repo, "HEAD", head, branch, sizeof(branch));
+    if (status == REF_ERROR) return 0;
+    repo->ahead = repo->behind = 0;
+    // git reports nothing without both ends: detached, unborn, no upstream
+    // or upstream gone
+    if (status == REF_MISSING || !strcmp(branch, "HEAD")) return 1;
+    int tracking = refs_upstream(repo, branch, ref, sizeof(ref));
+    if (tracking <= 0) return tracking == 0;
+    status = refs_resolve(repo, ref, upstream, NULL, 0);
+    if (status != REF_FOUND) return status == REF_MISSING;
+    struct odb *odb = new_odb(repo->commondir);
+    if (!odb) return 0;
+    int ok = graph_ahead_behind(repo->commondir, odb, head, upstream, &repo->ahead, &repo->behind);
+    odb->free(odb);
+    return ok;
+}
+
+/// Count untracked files against `index`, the kept one or a fresh read if NULL
+///
+/// Only directories `fsm` does not vouch for are looked at. Return 0 if git
+/// has to be asked.
+static int native_untracked(struct git_repo *repo, const struct git_index *index,
+                            struct fsmonitor *fsm, unsigned limit)
+{
+    char path[PATH_MAX];
+    struct git_index *own = NULL;
+    if (!index && repo->status && repo->status->index) index = repo->status->index;
+    if (!index) {
+        if (!path_join(path, sizeof(path), repo->gitdir, "index") ||
+            !(index = own = read_index(path)))
+            return 0;
+    }
+    struct untracked_dirs *dirs = repo->status ? &repo->status->untracked_dirs : NULL;
+    int ok = count_untracked(repo, index, fsmonitor_query(fsm, repo, index) ? fsm : NULL, limit,
+                             &repo->untracked, dirs);
+    if (repo->status) repo->status->untracked_ok = ok;
+    if (own) own->free(own);
+    return ok;
+}
+
+unsigned native_status(struct git_repo *repo, const char *dir, unsigned plan,
+                       const struct plan_limits *limits)
+{
+    // a long-lived caller may hand back a repo located on an earlier call
+    if (!plan || (!repo->gitdir && discover_repo(repo, dir) != DISCOVER_FOUND)) return plan;
+    // kept per-entry results go stale if git ends up computing changes instead
+    if (repo->status && plan & (PLAN_INDEX | PLAN_WORKTREE | PLAN_SUBMODULES))
+        reset_ctx(repo->status);
+    if (repo->status && plan & PLAN_UNTRACKED) {
+        untracked_dirs_clear(&repo->status->untracked_dirs);
+        repo->status->untracked_ok = false;
+    }
+    // reflog lines look the same whatever the object format
+    if (plan & PLAN_STASH && stash_count(repo)) plan &= ~PLAN_STASH;
+    // git status does not tell either
+    if (plan & PLAN_OPERATION) {
+        read_operation(repo);
+        plan &= ~PLAN_OPERATION;
+    }
+
+    char *format = config_get_all(repo->commondir, "extensions.objectformat");
+    bool sha1 = !format || !strcmp(format, "sha1");
+    free(format);
+    if (!sha1) return plan;
+
+    uint8_t head[SHA1_RAWSZ];
+    int unborn;
+    if (plan & (PLAN_REFS | PLAN_INDEX | PLAN_WORKTREE | PLAN_SUBMODULES)) {
+        if (!refs_read_head(repo, head, &unborn)) return plan;
+        plan &= ~PLAN_REFS;
+    }
+    if (plan & PLAN_UPSTREAM && native_upstream(repo)) plan &= ~PLAN_UPSTREAM;
+    struct git_index *index = NULL;
+    // asked once for both scans, about the index they share
+    struct fsmonitor fsm = {0};
+    if (plan & (PLAN_INDEX | PLAN_WORKTREE | PLAN_SUBMODULES)) {
+        if (!scan_changes(repo, head, unborn, plan, limits ? limits->changed : 0, &fsm,
+                          plan & PLAN_UNTRACKED ? &index : NULL))
+            goto out;
+        plan &= ~(PLAN_INDEX | PLAN_WORKTREE | PLAN_SUBMODULES);
+    }
+    if (plan & PLAN_UNTRACKED &&
+        native_untracked(repo, index, &fsm, limits ? limits->untracked : 0))
+        plan &= ~PLAN_UNTRACKED;
+out:
+    if (index) index->free(index);
+    fsmonitor_clear(&fsm);
+    return plan;
+}
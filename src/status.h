@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h> // for size_t
+
+struct git_repo;
+struct plan_limits;
+struct status_ctx;
+struct untracked_dirs;
+
+/// Fill `repo` from refs, index, object database and worktree without running git
+///
+/// Only the `plan_source` bits set in `plan` are computed. Return the bits
+/// that could not be satisfied natively (because the repository at `dir`
+/// uses something the native reader does not handle); the caller should get
+/// those from git. Counting stops early at `limits` (may be NULL: count
+/// everything).
+unsigned native_status(struct git_repo *repo, const char *dir, unsigned plan,
+                       const struct plan_limits *limits);
+
+/// Allocate state that keeps the index and per-entry results between calls
+///
+/// Attach it as `repo->status` to make native_update_paths() possible.
+struct status_ctx *new_status_ctx(struct git_repo *repo);
+
+/// Free state allocated by new_status_ctx()
+void free_status_ctx(struct status_ctx *ctx);
+
+/// Recheck worktree `paths` (relative to the worktree root) against the index
+///
+/// A path naming a directory rechecks every entry below it. Update
+/// `repo->changed` from the kept per-entry results. Return 0 if there is no
+/// complete earlier scan to update, in which case the caller must rescan.
+int native_update_paths(struct git_repo *repo, const char *const *paths, size_t nr);
+
+/// Untracked directories looked into when `repo->untracked` was last counted
+///
+/// Return NULL unless `repo->status` is attached and that count was done
+/// natively over every untracked directory, not stopped early or left to git.
+const struct untracked_dirs *native_untracked_dirs(const struct git_repo *repo);
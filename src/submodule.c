@@ -0,0 +1,80 @@
+#include "submodule.h"
+#include "discover.h" // for discover_repo, DISCOVER_FOUND
+#include "log.h"      // for log_debug
+#include "options.h"  // for options
+#include "plan.h"     // for PLAN_INDEX, PLAN_WORKTREE, PLAN_UNTRACKED
+#include "refs.h"     // for refs_read_head
+#include "repo.h"     // for git_repo, new_git_repo, parse_porcelain
+#include "util.h"     // for path_join
+#include <limits.h>   // for PATH_MAX
+#include <pthread.h>  // for pthread_create, pthread_join
+#include <string.h>   // for memcmp, strcmp
+
+// Submodules checked at the same time; mostly waiting for git or the disk
+#define MAX_SUBMODULE_THREADS 8
+
+/// Submodules shared by the checking threads
+struct check_queue
+{
+    const struct git_repo *repo;
+    struct submodule *subs;
+    size_t nr;
+    /// Next submodule to take, updated atomically
+    size_t next;
+};
+
+static int check_one(const struct git_repo *super, const struct submodule *sub)
+{
+    char dir[PATH_MAX];
+    if (!path_join(dir, sizeof(dir), super->workdir, sub->path)) return -1;
+    struct git_repo *repo = new_git_repo(NULL);
+    if (!repo) return -1;
+    int dirty = -1;
+    uint8_t head[SHA1_RAWSZ];
+    int unborn;
+    // a submodule whose git dir is gone would be taken for the superproject
+    if (discover_repo(repo, dir) != DISCOVER_FOUND || strcmp(repo->workdir, dir)) {
+        dirty = 0;
+        goto out;
+    }
+    if (!refs_read_head(repo, head, &unborn)) goto out;
+    if (unborn || memcmp(head, sub->oid, SHA1_RAWSZ)) {
+        dirty = 1;
+        goto out;
+    }
+    // any change or untracked file will do
+    struct options opts = {.directory = dir,
+                           .plan = PLAN_INDEX | PLAN_WORKTREE | PLAN_UNTRACKED,
+                           .limits = {.changed = 1, .untracked = 1},
+                           .timeout = SUBMODULE_BUDGET_MS};
+    if (!parse_porcelain(repo, &opts))
+        dirty = repo->changed || repo->unmerged || repo->untracked;
+out:
+    log_debug("submodule: %s: %s", sub->path, dirty < 0 ? "unknown" : dirty ? "dirty" : "clean");
+    repo->free(repo);
+    return dirty;
+}
+
+static void *check_thread(void *arg)
+{
+    struct check_queue *q = arg;
+    size_t i;
+    while ((i = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED)) < q->nr)
+        q->subs[i].dirty = check_one(q->repo, &q->subs[i]);
+    return NULL;
+}
+
+void submodules_check(const struct git_repo *repo, struct submodule *subs, size_t nr)
+{
+    if (!nr) return;
+    struct check_queue q = {.repo = repo, .subs = subs, .nr = nr};
+    unsigned nr_threads = nr < MAX_SUBMODULE_THREADS ? nr : MAX_SUBMODULE_THREADS;
+    pthread_t threads[MAX_SUBMODULE_THREADS];
+    unsigned started = 1;
+    for (; started < nr_threads; ++started)
+        if (pthread_create(&threads[started], NULL, check_thread, &q)) break;
+    // this thread checks too; submodules of threads that failed to start are left to it
+    check_thread(&q);
+    for (unsigned t = 1; t < started; ++t) pthread_join(threads[t], NULL);
+    log_debug("submodule: checked %zu submodules on %u threads", nr, started);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "sha1.h"   // for SHA1_RAWSZ
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint8_t
+
+struct git_repo;
+
+/// Milliseconds git may take for one submodule before it counts as unknown
+#ifndef SUBMODULE_BUDGET_MS
+#define SUBMODULE_BUDGET_MS 500
+#endif
+
+/// Populated submodule and the commit its gitlink records
+struct submodule
+{
+    /// Path relative to the superproject's worktree root
+    const char *path;
+    uint8_t oid[SHA1_RAWSZ];
+    /// 1 if it has other commits checked out, changes or untracked files;
+    /// 0 if clean; -1 if that could not be found out in time
+    int dirty;
+};
+
+/// Find out which of the `nr` submodules of `repo` are dirty, several at a time
+///
+/// Each submodule is checked like a repository of its own: natively where
+/// possible, else by git, which is killed once SUBMODULE_BUDGET_MS have
+/// passed, so that one slow submodule does not hold up the others.
+void submodules_check(const struct git_repo *repo, struct submodule *subs, size_t nr);
@@ -1,28 +1,37 @@
 #include "test.h"
+#include "arena.h"
+#include "discover.h"
+#include "format.h"
+#include "ignore.h"
+#include "index.h"
+#include "plan.h"
+#include "porcelain.h"
+#include "refs.h"
 #include "repo.h"
+#include "stash.h"
 #include "util.h"
 #include <assert.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 void run_test(const char *name, struct git_repo *repo, const char *format, const char *expected)
 {
-    FILE *stream;
-    char *buf;
-    size_t buflen;
-    stream = open_memstream(&buf, &buflen);
-    parse_result(repo, format, stream);
-    fclose(stream);
-    buflen = str_squish(buf, true);
+    struct format *fmt = format_compile(NULL, format);
+    assert(fmt);
+    char buf[FORMAT_MAX_OUTPUT];
+    size_t buflen = format_render(fmt, repo, buf, sizeof(buf));
     printf("Test: %s\n------------------\n", name);
     printf("Result:    {buf=%s, len=%zu}\n"
            "Expected:  {buf=%s, len=%zu}\n"
            "Match:     %d\n\n",
            buf, buflen, expected, strlen(expected), (strcmp(buf, expected) == 0));
     assert((strcmp(buf, expected) == 0));
-    free(buf);
+    free(fmt);
 }
 
 void test_1()
@@ -51,7 +60,276 @@ void test_2()
     run_test("Test 2", &repo, format, expected);
 }
 
+/// Escapes, capped counts, cut-off output and the compiled format cache
+void test_format()
+{
+    struct git_repo repo = {.branch = "dev", .changed = 5, .untracked = 12, .count_cap = 9};
+    run_test("Format", &repo, "%b\\n  100%% %M/%U %a%A \\n", "dev\n100% 5/9+");
+    struct git_repo rebase = {.branch = "(detached)", .operation = "REBASE", .step = 2, .steps = 5};
+    run_test("Operation", &rebase, "%b|%r", "(detached)|REBASE 2/5");
+    printf("Test: Format ops\n------------------\n");
+    assert(!format_compile(NULL, "%b %q") && !format_compile(NULL, "%"));
+    struct format *fmt = format_compile(NULL, "[%b]  x");
+    assert(fmt && fmt->nr == 3 && fmt->ops[2].len == 4);
+    char buf[4];
+    assert(format_render(fmt, &repo, buf, sizeof(buf)) == 3 && !strcmp(buf, "[de"));
+    free(fmt);
+    const struct format *cached = format_cached("%b@%c");
+    assert(cached && format_cached("%b@%c") == cached && cached->plan == PLAN_REFS);
+    format_cache_clear();
+    printf("Match:     1\n\n");
+}
+
+/// Write minimal index v4 with prefix-compressed paths and read it back
+void test_index_v4()
+{
+    unsigned char buf[256] = "DIRC\0\0\0\4\0\0\0\2";
+    size_t len = 12;
+    const char *names[] = {"dir/file_a", "dir/file_b"};
+    const unsigned char suffix[][16] = {{0, 'd', 'i', 'r', '/', 'f', 'i', 'l', 'e', '_', 'a', 0},
+                                        {1, 'b', 0}};
+    const size_t suffix_len[] = {12, 3};
+    for (int i = 0; i < 2; ++i) {
+        memset(buf + len, 0, 62);
+        buf[len + 26] = 0x81; // mode 0100644
+        buf[len + 27] = 0xa4;
+        buf[len + 61] = strlen(names[i]);
+        len += 62;
+        memcpy(buf + len, suffix[i], suffix_len[i]);
+        len += suffix_len[i];
+    }
+    memset(buf + len, 0, 20); // checksum is not verified
+    len += 20;
+
+    char path[] = "/tmp/git-prompt-test-XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    assert(write(fd, buf, len) == (ssize_t)len);
+    close(fd);
+    struct git_index *index = read_index(path);
+    unlink(path);
+    printf("Test: Index v4\n------------------\n");
+    assert(index && index->version == 4 && index->nr == 2);
+    for (int i = 0; i < 2; ++i) {
+        printf("Entry %d:   {path=%s, mode=%o}\n", i, index->entries[i].path,
+               index->entries[i].mode);
+        assert(strcmp(index->entries[i].path, names[i]) == 0);
+        assert(index->entries[i].mode == 0100644);
+    }
+    printf("\n");
+    index->free(index);
+}
+
+void test_plan()
+{
+    printf("Test: Plan\n------------------\n");
+    assert(compile_plan("%b@%c") == PLAN_REFS);
+    assert(compile_plan("%m") == (PLAN_INDEX | PLAN_WORKTREE));
+    assert(compile_plan("%U %Z") == (PLAN_UNTRACKED | PLAN_UPSTREAM));
+    assert(compile_plan("100%% %") == 0);
+    // escaped, so rendered as literal text
+    assert(compile_plan("\\%m %\\%u") == 0);
+    assert(compile_plan("\\n%b") == PLAN_REFS);
+    struct plan_limits limits;
+    compile_limits("%m %U", 0, &limits);
+    assert(limits.changed == 1 && limits.untracked == 0);
+    compile_limits("%m%M %u", 99, &limits);
+    assert(limits.changed == 100 && limits.untracked == 1);
+    printf("Match:     1\n\n");
+}
+
+/// Parse porcelain v2 output split at every possible position
+void test_porcelain()
+{
+    const char out[] = "# branch.oid 0123456789abcdef0123456789abcdef01234567\n"
+                       "# branch.head feature/x\n"
+                       "# branch.upstream origin/feature/x\n"
+                       "# branch.ab +3 -12\n"
+                       "# stash 2\n"
+                       "1 .M N... 100644 100644 100644 0123 4567 src/a.c\n"
+                       "2 R. N... 100644 100644 100644 0123 4567 R100 b.c\ta.c\n"
+                       "u UU N... 100644 100644 100644 100644 01 23 45 c.c\n"
+                       "? build/d.o\n"
+                       "? e\n"
+                       "! ignored";
+    printf("Test: Porcelain\n------------------\n");
+    for (size_t split = 0; split < sizeof(out) - 1; ++split) {
+        struct git_repo *repo = new_git_repo(NULL);
+        struct porcelain p;
+        porcelain_init(&p, repo,
+                       PLAN_REFS | PLAN_INDEX | PLAN_WORKTREE | PLAN_UNTRACKED | PLAN_STASH, NULL);
+        assert(porcelain_feed(&p, out, split));
+        assert(porcelain_feed(&p, out + split, sizeof(out) - 1 - split));
+        assert(porcelain_finish(&p));
+        assert(strcmp(repo->branch, "feature/x") == 0);
+        assert(strcmp(repo->commit, "0123456") == 0);
+        assert(repo->ahead == 3 && repo->behind == 12 && repo->stashes == 2);
+        assert(repo->changed == 2 && repo->unmerged == 1 && repo->untracked == 2);
+        repo->free(repo);
+    }
+    // indicator tokens only: stop at the first untracked file
+    struct git_repo *repo = new_git_repo(NULL);
+    struct porcelain p;
+    porcelain_init(&p, repo, PLAN_INDEX | PLAN_WORKTREE | PLAN_UNTRACKED,
+                   &(struct plan_limits){.changed = 1, .untracked = 1});
+    assert(porcelain_feed(&p, out, sizeof(out) - 1) && p.done);
+    assert(repo->changed == 2 && repo->untracked == 1);
+    repo->free(repo);
+    // submodules: only those with new commits, changes or untracked files count
+    const char subs[] = "1 .M SC.. 160000 160000 160000 01 01 s1\n"
+                        "1 .M S..U 160000 160000 160000 23 23 s2\n"
+                        "1 M. S... 160000 160000 160000 45 67 s3\n"
+                        "1 .M N... 100644 100644 100644 89 89 f\n";
+    repo = new_git_repo(NULL);
+    porcelain_init(&p, repo, PLAN_INDEX | PLAN_WORKTREE | PLAN_SUBMODULES,
+                   &(struct plan_limits){.changed = 1});
+    assert(porcelain_feed(&p, subs, sizeof(subs) - 1) && porcelain_finish(&p));
+    assert(repo->changed == 4 && repo->dirty_submodules == 2);
+    repo->free(repo);
+    printf("Match:     1\n\n");
+}
+
+/// Look up refs in sorted and unsorted packed-refs, with peeled lines in between
+void test_packed_refs()
+{
+    const char *names[] = {"refs/heads/a", "refs/heads/main", "refs/tags/v1", "refs/tags/v1.0",
+                           "refs/tags/v2"};
+    const size_t nr = sizeof(names) / sizeof(names[0]);
+    char dir[] = "/tmp/git-prompt-test-XXXXXX";
+    assert(mkdtemp(dir));
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/packed-refs", dir);
+    struct git_repo *repo = new_git_repo(NULL);
+    repo->gitdir = strdup(dir);
+    repo->commondir = strdup(dir);
+    printf("Test: Packed refs\n------------------\n");
+    for (int sorted = 0; sorted < 2; ++sorted) {
+        FILE *f = fopen(path, "w");
+        assert(f);
+        fprintf(f, "# pack-refs with: peeled fully-peeled %s\n", sorted ? "sorted " : "");
+        for (size_t i = 0; i < nr; ++i) {
+            // unsorted files come in any order
+            size_t k = sorted ? i : nr - 1 - i;
+            fprintf(f, "%040zx %s\n", k + 1, names[k]);
+            if (!strncmp(names[k], "refs/tags/", 10)) fprintf(f, "^%040zx\n", k + 100);
+        }
+        fclose(f);
+        uint8_t oid[SHA1_RAWSZ];
+        for (size_t i = 0; i < nr; ++i) {
+            assert(refs_resolve(repo, names[i], oid, NULL, 0) == REF_FOUND);
+            assert(oid[SHA1_RAWSZ - 1] == i + 1);
+        }
+        assert(refs_resolve(repo, "refs/heads/b", oid, NULL, 0) == REF_MISSING);
+        assert(refs_resolve(repo, "refs/tags/v1.", oid, NULL, 0) == REF_MISSING);
+        assert(refs_resolve(repo, "refs/tags/v3", oid, NULL, 0) == REF_MISSING);
+        assert(refs_resolve(repo, "refs/", oid, NULL, 0) == REF_MISSING);
+    }
+    unlink(path);
+    rmdir(dir);
+    repo->free(repo);
+    printf("Match:     1\n\n");
+}
+
+/// Discover a repository that appears above a directory, and stop at a ceiling
+void test_discover()
+{
+    char dir[] = "/tmp/git-prompt-test-XXXXXX";
+    assert(mkdtemp(dir));
+    char sub[32], dotgit[48], path[64];
+    snprintf(sub, sizeof(sub), "%s/a", dir);
+    snprintf(dotgit, sizeof(dotgit), "%s/.git", dir);
+    assert(mkdir(sub, 0700) == 0);
+    struct git_repo *repo = new_git_repo(NULL);
+    printf("Test: Discover\n------------------\n");
+    // assumes the temporary directory is not inside a repository itself
+    assert(discover_repo(repo, sub) == DISCOVER_NONE);
+    assert(discover_repo(repo, NULL) == DISCOVER_NONE);
+    snprintf(path, sizeof(path), "%s/missing", dir);
+    assert(discover_repo(repo, path) == DISCOVER_NONE);
+    assert(mkdir(dotgit, 0700) == 0);
+    snprintf(path, sizeof(path), "%s/objects", dotgit);
+    assert(mkdir(path, 0700) == 0);
+    snprintf(path, sizeof(path), "%s/HEAD", dotgit);
+    FILE *f = fopen(path, "w");
+    assert(f && fputs("ref: refs/heads/main\n", f) >= 0 && fclose(f) == 0);
+    assert(discover_repo(repo, sub) == DISCOVER_FOUND);
+    assert(!strcmp(repo->workdir, dir) && !strcmp(repo->gitdir, dotgit) && repo->gitdir_fd >= 0);
+    setenv("GIT_CEILING_DIRECTORIES", dir, 1);
+    assert(discover_repo(repo, sub) == DISCOVER_NONE);
+    unsetenv("GIT_CEILING_DIRECTORIES");
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/objects", dotgit);
+    rmdir(path);
+    rmdir(dotgit);
+    rmdir(sub);
+    rmdir(dir);
+    repo->free(repo);
+    printf("Match:     1\n\n");
+}
+
+/// Count reflog lines across the vectorized part and the tail
+void test_count_lines()
+{
+    char buf[100];
+    printf("Test: Count lines\n------------------\n");
+    for (size_t len = 0; len <= sizeof(buf); ++len) {
+        size_t expected = 0;
+        for (size_t i = 0; i < len; ++i) {
+            buf[i] = i % 7 == 6 ? '\n' : 'x';
+            expected += buf[i] == '\n';
+        }
+        if (len && buf[len - 1] != '\n') ++expected;
+        assert(count_lines(buf, len) == expected);
+    }
+    printf("Match:     1\n\n");
+}
+
+/// Glob patterns as git's wildmatch treats them
+void test_wildmatch()
+{
+    printf("Test: Wildmatch\n------------------\n");
+    assert(wildmatch("*.o", "a.o", 0) && !wildmatch("*.o", "a.c", 0));
+    assert(wildmatch("*.o", "dir/a.o", 0) && !wildmatch("*.o", "dir/a.o", WM_PATHNAME));
+    assert(wildmatch("**/x", "x", WM_PATHNAME) && wildmatch("**/x", "a/b/x", WM_PATHNAME));
+    assert(wildmatch("a/**/b", "a/b", WM_PATHNAME) && wildmatch("a/**/b", "a/x/y/b", WM_PATHNAME));
+    assert(wildmatch("a/**", "a/x/y", WM_PATHNAME) && !wildmatch("a/**", "a", WM_PATHNAME));
+    assert(wildmatch("[a-c]?[!x]", "bqy", 0) && !wildmatch("[a-c]?[!x]", "dqy", 0));
+    assert(wildmatch("[[:digit:]]*", "1st", 0) && !wildmatch("[[:digit:]]*", "first", 0));
+    assert(wildmatch("\\*", "*", 0) && !wildmatch("\\*", "x", 0));
+    printf("Match:     1\n\n");
+}
+
+/// Arena growth in place, reuse after reset and str_split on top of it
+void test_arena()
+{
+    printf("Test: Arena\n------------------\n");
+    struct arena arena = {0};
+    for (int round = 0; round < 2; ++round) {
+        char *p = arena_alloc(&arena, 10);
+        assert(p && arena_grow(&arena, p, 10, 100) == p);
+        char *big = arena_alloc(&arena, 100000);
+        assert(big && arena_grow(&arena, p, 100, 200) != p);
+        size_t n;
+        char **parts = str_split(&arena, "a,bc,,d", ",", &n);
+        assert(parts && n == 3 && !strcmp(parts[1], "bc") && !strcmp(parts[2], "d"));
+        // the blocks of the first round are merged and reused by the second
+        if (round) assert(arena.heap_blocks == 0);
+        arena_reset(&arena);
+    }
+    arena_free(&arena);
+    printf("Match:     1\n\n");
+}
+
 void run_tests() {
     test_1();
     test_2();
+    test_format();
+    test_index_v4();
+    test_plan();
+    test_porcelain();
+    test_packed_refs();
+    test_discover();
+    test_count_lines();
+    test_wildmatch();
+    test_arena();
 }
@@ -0,0 +1,926 @@
+#define _GNU_SOURCE // for mkostemp
+#include "untracked.h"
+#include "cache.h"       // for cache_file_path
+#include "config.h"      // for config_get_all, config_bool
+#include "fsmonitor.h"   // for fsmonitor, fsmonitor_changed, fsmonitor_dir_changed
+#include "ignore.h"      // for ignore_list, ignore_list_load, ignore_list_match, ignore_list_clear
+#include "index.h"       // for git_index, index_entry, index_lower_bound, untracked_cache, untracked_dir_child
+#include "log.h"         // for log_debug, log_warn
+#include "repo.h"        // for git_repo
+#include "sha1.h"        // for sha1_ctx, sha1_init, sha1_update, sha1_final, SHA1_RAWSZ
+#include "util.h"        // for path_join, str_dup, str_ndup
+#include <dirent.h>      // for DIR, dirent, fdopendir, readdir, closedir, DT_DIR, DT_UNKNOWN
+#include <errno.h>       // for errno, ENOENT, ENOTDIR
+#include <fcntl.h>       // for openat, open, AT_FDCWD, AT_SYMLINK_NOFOLLOW, O_RDONLY, ...
+#include <limits.h>      // for PATH_MAX
+#include <stdbool.h>     // for bool, true, false
+#include <stdint.h>      // for uint64_t, uint8_t, int32_t
+#include <stdio.h>       // for FILE, fdopen, fprintf, fwrite, fclose, snprintf, sscanf, rename
+#include <stdlib.h>      // for malloc, realloc, free, qsort, bsearch, getenv, strtoull
+#include <string.h>      // for memcmp, memcpy, memchr, strcmp, strlen, strerror
+#include <sys/stat.h>    // for fstat, fstatat, stat, S_ISDIR
+#include <sys/utsname.h> // for uname, utsname
+#include <time.h>        // for clock_gettime, timespec, CLOCK_REALTIME
+#include <unistd.h>      // for close, read, unlink
+
+#define DIRS_CACHE_VERSION 1
+#define S_IFGITLINK 0160000
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+
+// Walk flags git records in the untracked cache for --untracked-files=normal:
+// show untracked directories (collapsed), hide empty ones
+#define UNTR_FLAGS_NORMAL 0x6
+
+// Entry types of a directory listing
+#define ENTRY_FILE 'f'    // untracked file or symlink
+#define ENTRY_DIR 'd'     // untracked directory, counted if it holds anything
+#define ENTRY_REPO 'r'    // ".git" in an untracked directory: a nested repository
+#define ENTRY_IGNORED 'i' // tracked directory matched by an ignore pattern
+
+static const uint8_t EMPTY_BLOB[SHA1_RAWSZ] = {0xe6, 0x9d, 0xe2, 0x9b, 0xb2, 0xd1, 0xd6,
+                                                0x43, 0x4b, 0x8b, 0x29, 0xae, 0x77, 0x5a,
+                                                0xd8, 0xc2, 0xe4, 0x8c, 0x53, 0x91};
+static const uint8_t NULL_OID[SHA1_RAWSZ];
+
+/// Child of a directory as recorded in the index
+struct tracked_child
+{
+    const char *name; // not NULL-terminated
+    size_t len;
+    char type; // 'f' file, 'g' gitlink, 'd' directory
+    bool ignored;
+};
+
+/// Children of one directory in the index, sorted by name
+struct tracked
+{
+    struct tracked_child *children;
+    size_t nr;
+    size_t alloc;
+    /// Changes whenever a child is added to or removed from the index
+    uint64_t hash;
+};
+
+/// Untracked entries of one directory: type byte and name, NULL-terminated
+struct listing
+{
+    char *buf;
+    size_t len;
+    size_t alloc;
+};
+
+/// Everything a listing depends on; it stays good while all of it is unchanged
+struct dir_key
+{
+    uint64_t ino;
+    int64_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+    /// Ignore files of the directory and its parents
+    uint64_t rules;
+    uint64_t tracked;
+    /// Listing stops at the first untracked file
+    bool check_only;
+};
+
+/// Listing of one directory kept on disk between runs
+struct dir_record
+{
+    const char *path; // relative to the worktree, "" or ending in '/'
+    struct dir_key key;
+    /// Second the directory was read in; a later change may share its mtime
+    int64_t listed;
+    const char *entries;
+    size_t len;
+    /// `path` and `entries` are allocated rather than part of the loaded file
+    bool owned;
+    bool used;
+};
+
+/// Ignore file of one directory on the current path, read on first use
+struct level
+{
+    size_t len;
+    bool loaded;
+    struct ignore_list list;
+    /// .gitignore here and in all parents is as the untracked cache saw it
+    bool untr_ok;
+};
+
+/// State of one untracked scan
+struct walk
+{
+    const struct git_repo *repo;
+    const struct git_index *index;
+    /// git's untracked cache if it was written for the same walk, or NULL
+    const struct untracked_cache *uc;
+    /// Paths changed since git last synced with core.fsmonitor, or NULL
+    const struct fsmonitor *fsm;
+    int workdir_fd;
+    bool trustctime;
+    unsigned limit;
+    unsigned count;
+    bool early;
+    struct timespec start;
+    /// core.excludesFile and info/exclude, in increasing priority
+    struct ignore_list global[2];
+    struct level *levels;
+    size_t alloc_levels;
+    /// Listings read by earlier runs, sorted by path
+    char *old_buf;
+    struct dir_record *old;
+    size_t nr_old;
+    /// Listings to keep for the next run
+    struct dir_record *fresh;
+    size_t nr_fresh;
+    size_t alloc_fresh;
+    size_t reads, cache_hits, untr_hits;
+    /// Where to list the untracked directories looked into, or NULL
+    struct untracked_dirs *dirs;
+    char cache_path[PATH_MAX];
+    /// Path of the directory being looked at, relative to the worktree
+    char path[PATH_MAX];
+    char scratch[PATH_MAX];
+};
+
+/// FNV-1a over `len` bytes of `data`, continuing from `hash`
+static uint64_t fnv(uint64_t hash, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; ++i) hash = (hash ^ p[i]) * 0x100000001b3ULL;
+    return hash;
+}
+
+/// Mix stat data of `path` (relative to `dirfd`) into `hash`; set `exists`
+static uint64_t mix_stat(uint64_t hash, int dirfd, const char *path, int flags, bool *exists)
+{
+    struct stat st;
+    *exists = fstatat(dirfd, path, &st, flags) == 0;
+    if (!*exists) return fnv(hash, "", 1);
+    int64_t data[6] = {st.st_ino,          st.st_size,          st.st_mtim.tv_sec,
+                       st.st_mtim.tv_nsec, st.st_ctim.tv_sec,   st.st_ctim.tv_nsec};
+    return fnv(hash, data, sizeof(data));
+}
+
+/// Whether file `path` still has blob id `oid` (all zero: no file was read)
+///
+/// git records a missing ignore file as either no id or the empty blob. It
+/// takes the id of an up-to-date tracked file from the index, and otherwise
+/// hashes the file with a newline appended, so either hash is accepted.
+static bool same_blob(int dirfd, const char *path, int flags, const uint8_t *oid)
+{
+    bool none = !memcmp(oid, NULL_OID, SHA1_RAWSZ);
+    int fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC | flags);
+    if (fd < 0) return errno == ENOENT && (none || !memcmp(oid, EMPTY_BLOB, SHA1_RAWSZ));
+    struct stat st;
+    bool same = false;
+    if (none || fstat(fd, &st) < 0) goto out;
+    if (!st.st_size) {
+        same = !memcmp(oid, EMPTY_BLOB, SHA1_RAWSZ);
+        goto out;
+    }
+    char buf[8192];
+    struct sha1_ctx plain, newline;
+    sha1_init(&plain);
+    sha1_init(&newline);
+    int n = snprintf(buf, sizeof(buf), "blob %lld", (long long)st.st_size);
+    sha1_update(&plain, buf, n + 1);
+    n = snprintf(buf, sizeof(buf), "blob %lld", (long long)st.st_size + 1);
+    sha1_update(&newline, buf, n + 1);
+    ssize_t got;
+    long long left = st.st_size;
+    while (left > 0 && (got = read(fd, buf, sizeof(buf))) > 0) {
+        sha1_update(&plain, buf, got);
+        sha1_update(&newline, buf, got);
+        left -= got;
+    }
+    sha1_update(&newline, "\n", 1);
+    uint8_t actual[SHA1_RAWSZ], appended[SHA1_RAWSZ];
+    sha1_final(&plain, actual);
+    sha1_final(&newline, appended);
+    same = !left && (!memcmp(actual, oid, SHA1_RAWSZ) || !memcmp(appended, oid, SHA1_RAWSZ));
+out:
+    close(fd);
+    return same;
+}
+
+static int cmp_child(const void *a, const void *b)
+{
+    const struct tracked_child *x = a, *y = b;
+    int c = memcmp(x->name, y->name, x->len < y->len ? x->len : y->len);
+    return c ? c : (x->len > y->len) - (x->len < y->len);
+}
+
+static struct tracked_child *find_child(const struct tracked *tracked, const char *name,
+                                        size_t len)
+{
+    struct tracked_child key = {.name = name, .len = len};
+    if (!tracked->nr) return NULL;
+    return bsearch(&key, tracked->children, tracked->nr, sizeof(key), cmp_child);
+}
+
+/// Collect the index entries directly in the directory of `len` bytes of w->path
+static int collect_tracked(struct walk *w, size_t len, struct tracked *tracked)
+{
+    const struct git_index *index = w->index;
+    tracked->hash = FNV_OFFSET;
+    uint32_t i = len ? index_lower_bound(index, w->path, len) : 0;
+    while (i < index->nr) {
+        const struct index_entry *ce = &index->entries[i];
+        if (ce->path_len <= len || memcmp(ce->path, w->path, len)) break;
+        const char *name = ce->path + len;
+        const char *slash = memchr(name, '/', ce->path_len - len);
+        size_t name_len = slash ? (size_t)(slash - name) : ce->path_len - len;
+        char type = slash ? 'd' : (ce->mode & S_IFMT) == S_IFGITLINK ? 'g' : 'f';
+        struct tracked_child *last = tracked->nr ? &tracked->children[tracked->nr - 1] : NULL;
+        // conflicted paths have an entry per stage
+        if (!last || last->len != name_len || memcmp(last->name, name, name_len)) {
+            if (tracked->nr == tracked->alloc) {
+                size_t alloc = tracked->alloc ? tracked->alloc * 2 : 16;
+                void *tmp = realloc(tracked->children, alloc * sizeof(*tracked->children));
+                if (!tmp) return 0;
+                tracked->children = tmp;
+                tracked->alloc = alloc;
+            }
+            tracked->children[tracked->nr++] =
+                (struct tracked_child){.name = name, .len = name_len, .type = type};
+            tracked->hash = fnv(fnv(tracked->hash, name, name_len), &type, 1);
+        }
+        if (!slash) {
+            ++i;
+            continue;
+        }
+        // skip the subdirectory: '0' sorts right after '/'
+        size_t key_len = len + name_len + 1;
+        memcpy(w->scratch, ce->path, key_len - 1);
+        w->scratch[key_len - 1] = '0';
+        i = index_lower_bound(index, w->scratch, key_len);
+    }
+    if (tracked->nr) qsort(tracked->children, tracked->nr, sizeof(*tracked->children), cmp_child);
+    return 1;
+}
+
+/// Read the .gitignore of directory level `depth` unless done already
+static int load_level(struct walk *w, size_t depth)
+{
+    struct level *level = &w->levels[depth];
+    if (level->loaded) return 1;
+    // enter_dir() made sure the file name fits
+    char *file = w->scratch;
+    memcpy(file, w->path, level->len);
+    memcpy(file + level->len, ".gitignore", sizeof(".gitignore"));
+    int ok = ignore_list_load(&level->list, w->workdir_fd, file, file, level->len, false);
+    level->loaded = true;
+    if (!ok) log_debug("untracked: cannot read %s", file);
+    return ok;
+}
+
+/// Whether w->path, an entry of directory level `depth`, is ignored; -1 on error
+static int is_excluded(struct walk *w, size_t depth, bool is_dir)
+{
+    for (size_t i = 0; i <= depth; ++i)
+        if (!load_level(w, i)) return -1;
+    // deeper ignore files take precedence, then info/exclude, then core.excludesFile
+    for (size_t i = depth + 1; i-- > 0;) {
+        int match = ignore_list_match(&w->levels[i].list, w->path, is_dir);
+        if (match >= 0) return match;
+    }
+    for (int i = 1; i >= 0; --i) {
+        int match = ignore_list_match(&w->global[i], w->path, is_dir);
+        if (match >= 0) return match;
+    }
+    return 0;
+}
+
+/// Start directory level `depth` at `len` bytes of w->path
+///
+/// Mix its .gitignore into `rules` and check it against the untracked cache
+/// node `ucpos` (-1 if none).
+static int enter_dir(struct walk *w, size_t len, size_t depth, uint64_t *rules, int32_t ucpos)
+{
+    if (depth == w->alloc_levels) {
+        size_t alloc = w->alloc_levels ? w->alloc_levels * 2 : 16;
+        struct level *tmp = realloc(w->levels, alloc * sizeof(*tmp));
+        if (!tmp) return 0;
+        memset(tmp + w->alloc_levels, 0, (alloc - w->alloc_levels) * sizeof(*tmp));
+        w->levels = tmp;
+        w->alloc_levels = alloc;
+    }
+    if (len + sizeof(".gitignore") > sizeof(w->path)) return 0;
+    struct level *level = &w->levels[depth];
+    // a sibling visited before left its patterns here
+    if (level->loaded) ignore_list_clear(&level->list);
+    level->loaded = false;
+    level->len = len;
+    memcpy(w->path + len, ".gitignore", sizeof(".gitignore"));
+    bool exists;
+    *rules = mix_stat(*rules, w->workdir_fd, w->path, AT_SYMLINK_NOFOLLOW, &exists);
+    level->untr_ok = false;
+    if (ucpos >= 0 && (depth ? w->levels[depth - 1].untr_ok : w->uc != NULL)) {
+        const struct untracked_dir *ud = &w->uc->dirs[ucpos];
+        const uint8_t *oid = ud->has_exclude_oid ? ud->exclude_oid : NULL_OID;
+        // not reported by the fsmonitor: as git saw it, no need to hash it
+        if (w->fsm && !fsmonitor_changed(w->fsm, w->path, len + strlen(".gitignore")))
+            level->untr_ok = true;
+        else
+            level->untr_ok = exists ? same_blob(w->workdir_fd, w->path, O_NOFOLLOW, oid)
+                                    : !memcmp(oid, NULL_OID, SHA1_RAWSZ) ||
+                                          !memcmp(oid, EMPTY_BLOB, SHA1_RAWSZ);
+    }
+    w->path[len] = '\0';
+    return 1;
+}
+
+/// Stat the directory at `len` bytes of w->path; return 0 if it is not a directory
+static int stat_dir(struct walk *w, size_t len, struct stat *st)
+{
+    if (len) w->path[len - 1] = '\0';
+    int ret = fstatat(w->workdir_fd, len ? w->path : ".", st, AT_SYMLINK_NOFOLLOW);
+    if (len) w->path[len - 1] = '/';
+    if (ret < 0) return errno == ENOENT || errno == ENOTDIR ? 0 : -1;
+    return S_ISDIR(st->st_mode);
+}
+
+static int listing_add(struct listing *list, char type, const char *name, size_t len)
+{
+    if (list->len + len + 2 > list->alloc) {
+        size_t alloc = list->alloc ? list->alloc * 2 : 256;
+        while (alloc < list->len + len + 2) alloc *= 2;
+        char *tmp = realloc(list->buf, alloc);
+        if (!tmp) return 0;
+        list->buf = tmp;
+        list->alloc = alloc;
+    }
+    list->buf[list->len++] = type;
+    memcpy(list->buf + list->len, name, len);
+    list->len += len;
+    list->buf[list->len++] = '\0';
+    return 1;
+}
+
+/// Read directory at `len` bytes of w->path into `list`
+///
+/// With `check_only`, stop at the first untracked file.
+static int read_listing(struct walk *w, size_t len, size_t depth, bool check_only,
+                        const struct tracked *tracked, struct listing *list)
+{
+    if (len) w->path[len - 1] = '\0';
+    int fd = openat(w->workdir_fd, len ? w->path : ".",
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (len) w->path[len - 1] = '/';
+    if (fd < 0) return errno == ENOENT || errno == ENOTDIR ? 1 : 0;
+    DIR *dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return 0;
+    }
+    int ok = 0;
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+        const char *name = de->d_name;
+        if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) continue;
+        if (!strcmp(name, ".git")) {
+            if (!check_only) continue;
+            // an untracked directory with its own repository shows up as such
+            if (!listing_add(list, ENTRY_REPO, name, 4)) goto out;
+            break;
+        }
+        size_t name_len = strlen(name);
+        if (len + name_len + 2 > sizeof(w->path)) goto out;
+        bool is_dir = de->d_type == DT_DIR;
+        if (de->d_type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) continue;
+            is_dir = S_ISDIR(st.st_mode);
+        }
+        const struct tracked_child *child = find_child(tracked, name, name_len);
+        if (child && (child->type == 'g' || (child->type == 'f' && !is_dir))) continue;
+        memcpy(w->path + len, name, name_len + 1);
+        int excluded = is_excluded(w, depth, is_dir);
+        w->path[len] = '\0';
+        if (excluded < 0) goto out;
+        if (child && child->type == 'd' && is_dir) {
+            // everything below a tracked but ignored directory is ignored
+            if (excluded && !listing_add(list, ENTRY_IGNORED, name, name_len)) goto out;
+            continue;
+        }
+        if (excluded) continue;
+        if (!listing_add(list, is_dir ? ENTRY_DIR : ENTRY_FILE, name, name_len)) goto out;
+        if (check_only && !is_dir) break;
+    }
+    ok = 1;
+out:
+    closedir(dir);
+    return ok;
+}
+
+/// Whether `list` has an entry `type` named `name` of `len` bytes
+static bool listing_has(const struct listing *list, char type, const char *name, size_t len)
+{
+    for (size_t i = 0; i < list->len; i += strlen(list->buf + i) + 1)
+        if (list->buf[i] == type && !strncmp(list->buf + i + 1, name, len) &&
+            !list->buf[i + 1 + len])
+            return true;
+    return false;
+}
+
+/// Turn untracked cache node `ucpos` into a listing
+static int untr_listing(struct walk *w, int32_t ucpos, const struct tracked *tracked,
+                        struct listing *list)
+{
+    const struct untracked_dir *ud = &w->uc->dirs[ucpos];
+    const char *name = ud->untracked;
+    for (uint32_t i = 0; i < ud->nr_untracked; ++i) {
+        size_t len = strlen(name);
+        bool is_dir = len && name[len - 1] == '/';
+        if (!listing_add(list, is_dir ? ENTRY_DIR : ENTRY_FILE, name, len - is_dir)) return 0;
+        name += len + 1;
+    }
+    // untracked directories git looked into: files appearing further down
+    // leave the mtime of this one alone
+    uint32_t child = ucpos + 1;
+    for (uint32_t i = 0; i < ud->subdir_nr && child < w->uc->nr; ++i) {
+        const struct untracked_dir *sub = &w->uc->dirs[child];
+        size_t len = strlen(sub->name);
+        const struct tracked_child *tc = find_child(tracked, sub->name, len);
+        if ((!tc || tc->type != 'd') && !listing_has(list, ENTRY_DIR, sub->name, len) &&
+            !listing_add(list, ENTRY_DIR, sub->name, len))
+            return 0;
+        child += sub->size;
+    }
+    return 1;
+}
+
+/// Whether directory stat data is as the untracked cache recorded it
+static bool untr_stat_eq(const struct walk *w, const struct index_stat *sd, const struct stat *st)
+{
+    if (sd->mtime_sec != (uint32_t)st->st_mtim.tv_sec ||
+        sd->mtime_nsec != (uint32_t)st->st_mtim.tv_nsec || sd->ino != (uint32_t)st->st_ino ||
+        sd->uid != (uint32_t)st->st_uid || sd->gid != (uint32_t)st->st_gid ||
+        sd->size != (uint32_t)st->st_size)
+        return false;
+    if (w->trustctime && (sd->ctime_sec != (uint32_t)st->st_ctim.tv_sec ||
+                          sd->ctime_nsec != (uint32_t)st->st_ctim.tv_nsec))
+        return false;
+    // changed in the same instant the index was written: git may have missed it
+    const struct timespec *written = &w->index->mtime;
+    return st->st_mtim.tv_sec < written->tv_sec ||
+           (st->st_mtim.tv_sec == written->tv_sec && st->st_mtim.tv_nsec < written->tv_nsec);
+}
+
+static int cmp_record(const void *a, const void *b)
+{
+    return strcmp(((const struct dir_record *)a)->path, ((const struct dir_record *)b)->path);
+}
+
+static bool key_eq(const struct dir_key *a, const struct dir_key *b)
+{
+    return a->ino == b->ino && a->size == b->size && a->mtime.tv_sec == b->mtime.tv_sec &&
+           a->mtime.tv_nsec == b->mtime.tv_nsec && a->ctime.tv_sec == b->ctime.tv_sec &&
+           a->ctime.tv_nsec == b->ctime.tv_nsec && a->rules == b->rules &&
+           a->tracked == b->tracked && a->check_only == b->check_only;
+}
+
+static int keep_record(struct walk *w, const struct dir_record *rec)
+{
+    if (w->nr_fresh == w->alloc_fresh) {
+        size_t alloc = w->alloc_fresh ? w->alloc_fresh * 2 : 64;
+        void *tmp = realloc(w->fresh, alloc * sizeof(*w->fresh));
+        if (!tmp) return 0;
+        w->fresh = tmp;
+        w->alloc_fresh = alloc;
+    }
+    w->fresh[w->nr_fresh++] = *rec;
+    return 1;
+}
+
+/// Take the listing from untracked cache node `ucpos`, for get_listing()
+static int use_untr(struct walk *w, int32_t ucpos, const struct tracked *tracked,
+                    struct listing *list, const char **entries, size_t *size, bool *from_untr)
+{
+    if (!untr_listing(w, ucpos, tracked, list)) return 0;
+    *entries = list->buf ? list->buf : "";
+    *size = list->len;
+    *from_untr = true;
+    ++w->untr_hits;
+    return 1;
+}
+
+/// Get the untracked entries of the directory at `len` bytes of w->path
+///
+/// Take them from git's untracked cache or our own if still valid, else
+/// read the directory. Set `entries` and `size`, and `from_untr` if they
+/// come from git's cache (which does not know about ignored tracked
+/// directories). Fill `key` from the directory's stat data, unless the
+/// fsmonitor makes looking at the directory unnecessary.
+static int get_listing(struct walk *w, size_t len, size_t depth, struct dir_key *key,
+                       int32_t ucpos, const struct tracked *tracked, struct listing *list,
+                       const char **entries, size_t *size, bool *from_untr)
+{
+    struct stat st;
+    *entries = "";
+    *size = 0;
+    *from_untr = false;
+    const struct untracked_dir *ud =
+        ucpos >= 0 && w->levels[depth].untr_ok ? &w->uc->dirs[ucpos] : NULL;
+    bool untr = ud && ud->valid && ud->check_only == key->check_only;
+    // nothing in or above it reported since git listed it: not even a stat
+    if (untr && w->fsm && !fsmonitor_dir_changed(w->fsm, w->path, len))
+        return use_untr(w, ucpos, tracked, list, entries, size, from_untr);
+
+    int ret = stat_dir(w, len, &st);
+    if (ret <= 0) return ret == 0;
+    key->ino = st.st_ino;
+    key->size = st.st_size;
+    key->mtime = st.st_mtim;
+    key->ctime = st.st_ctim;
+    if (untr && untr_stat_eq(w, &ud->stat, &st))
+        return use_untr(w, ucpos, tracked, list, entries, size, from_untr);
+
+    struct dir_record probe = {.path = w->path}, *rec = NULL;
+    if (w->nr_old) rec = bsearch(&probe, w->old, w->nr_old, sizeof(probe), cmp_record);
+    if (rec && key_eq(&rec->key, key) && rec->key.mtime.tv_sec < rec->listed) {
+        rec->used = true;
+        if (!keep_record(w, rec)) return 0;
+        *entries = rec->entries;
+        *size = rec->len;
+        ++w->cache_hits;
+        return 1;
+    }
+
+    if (!read_listing(w, len, depth, key->check_only, tracked, list)) return 0;
+    ++w->reads;
+    *entries = list->buf ? list->buf : "";
+    *size = list->len;
+    struct dir_record fresh = {.key = *key, .listed = w->start.tv_sec, .len = list->len,
+                               .owned = true};
+    // the path ends a line of the cache file
+    if (memchr(w->path, '\n', len)) return 1;
+    char *copy = malloc(list->len + 1);
+    if (!copy || !(fresh.path = str_dup(w->path))) {
+        free(copy);
+        return 0;
+    }
+    if (list->len) memcpy(copy, list->buf, list->len);
+    fresh.entries = copy;
+    if (!keep_record(w, &fresh)) {
+        free((char *)fresh.path);
+        free(copy);
+        return 0;
+    }
+    return 1;
+}
+
+void untracked_dirs_clear(struct untracked_dirs *dirs)
+{
+    for (size_t i = 0; i < dirs->nr; ++i) free(dirs->paths[i]);
+    free(dirs->paths);
+    memset(dirs, 0, sizeof(*dirs));
+}
+
+/// List the untracked directory at `len` bytes of w->path (with its slash) in w->dirs
+static void note_dir(struct walk *w, size_t len)
+{
+    struct untracked_dirs *dirs = w->dirs;
+    if (!dirs || dirs->lost) return;
+    if (dirs->nr == dirs->alloc) {
+        size_t alloc = dirs->alloc ? dirs->alloc * 2 : 16;
+        char **tmp = realloc(dirs->paths, alloc * sizeof(char *));
+        if (!tmp) goto lost;
+        dirs->paths = tmp;
+        dirs->alloc = alloc;
+    }
+    if (!(dirs->paths[dirs->nr] = str_ndup(w->path, len - 1))) goto lost;
+    ++dirs->nr;
+    return;
+lost:
+    dirs->lost = true;
+}
+
+/// Whether the untracked directory at `len` bytes of w->path holds anything
+/// not ignored; -1 on error
+static int has_content(struct walk *w, size_t len, size_t depth, uint64_t rules, int32_t ucpos)
+{
+    struct tracked none = {.hash = FNV_OFFSET};
+    struct listing list = {0};
+    const char *entries;
+    size_t size;
+    bool from_untr;
+    int found = -1;
+    note_dir(w, len);
+    if (!enter_dir(w, len, depth, &rules, ucpos)) goto out;
+    struct dir_key key = {.rules = rules, .tracked = none.hash, .check_only = true};
+    if (!get_listing(w, len, depth, &key, ucpos, &none, &list, &entries, &size, &from_untr))
+        goto out;
+    found = 0;
+    for (const char *p = entries; p < entries + size && !found; p += strlen(p) + 1) {
+        if (*p != ENTRY_DIR) {
+            found = 1;
+            break;
+        }
+        size_t name_len = strlen(p + 1);
+        if (len + name_len + 2 > sizeof(w->path)) {
+            found = -1;
+            break;
+        }
+        memcpy(w->path + len, p + 1, name_len);
+        memcpy(w->path + len + name_len, "/", 2);
+        int32_t child = ucpos >= 0 ? untracked_dir_child(w->uc, ucpos, p + 1, name_len) : -1;
+        found = has_content(w, len + name_len + 1, depth + 1, rules, child);
+    }
+out:
+    w->path[len] = '\0';
+    free(list.buf);
+    return found;
+}
+
+/// Count untracked entries in and below the tracked directory at `len`
+/// bytes of w->path; return 0 on error
+static int walk_tracked(struct walk *w, size_t len, size_t depth, uint64_t rules, int32_t ucpos)
+{
+    struct tracked tracked = {0};
+    struct listing list = {0};
+    const char *entries;
+    size_t size;
+    bool from_untr;
+    int ok = 0;
+    if (!enter_dir(w, len, depth, &rules, ucpos) || !collect_tracked(w, len, &tracked)) goto out;
+    struct dir_key key = {.rules = rules, .tracked = tracked.hash};
+    if (!get_listing(w, len, depth, &key, ucpos, &tracked, &list, &entries, &size, &from_untr))
+        goto out;
+
+    for (const char *p = entries; p < entries + size; p += strlen(p) + 1) {
+        const char *name = p + 1;
+        size_t name_len = strlen(name);
+        if (*p == ENTRY_IGNORED) {
+            struct tracked_child *child = find_child(&tracked, name, name_len);
+            if (child) child->ignored = true;
+            continue;
+        }
+        if (*p == ENTRY_DIR) {
+            if (len + name_len + 2 > sizeof(w->path)) goto out;
+            memcpy(w->path + len, name, name_len);
+            memcpy(w->path + len + name_len, "/", 2);
+            int32_t child = ucpos >= 0 ? untracked_dir_child(w->uc, ucpos, name, name_len) : -1;
+            int found = has_content(w, len + name_len + 1, depth + 1, rules, child);
+            w->path[len] = '\0';
+            if (found < 0) goto out;
+            if (!found) continue;
+        }
+        if (++w->count == w->limit) {
+            w->early = true;
+            ok = 1;
+            goto out;
+        }
+    }
+
+    for (size_t i = 0; i < tracked.nr; ++i) {
+        const struct tracked_child *child = &tracked.children[i];
+        if (child->type != 'd' || child->ignored) continue;
+        if (len + child->len + 2 > sizeof(w->path)) goto out;
+        memcpy(w->path + len, child->name, child->len);
+        w->path[len + child->len] = '\0';
+        int32_t sub = ucpos >= 0 ? untracked_dir_child(w->uc, ucpos, child->name, child->len) : -1;
+        // git's cache only has directories it did not find ignored
+        if (from_untr && sub < 0) {
+            int excluded = is_excluded(w, depth, true);
+            if (excluded < 0) goto out;
+            if (excluded) continue;
+        }
+        memcpy(w->path + len + child->len, "/", 2);
+        if (!walk_tracked(w, len + child->len + 1, depth + 1, rules, sub)) goto out;
+        if (w->early) break;
+    }
+    ok = 1;
+out:
+    w->path[len] = '\0';
+    free(tracked.children);
+    free(list.buf);
+    return ok;
+}
+
+/// Parse the next space-terminated number of a cache record line
+static bool parse_num(char **p, unsigned long long *val, int base)
+{
+    char *end;
+    *val = strtoull(*p, &end, base);
+    if (end == *p || (*end != ' ' && *end != '.')) return false;
+    *p = end + 1;
+    return true;
+}
+
+/// Parse one record at `*p` (before `end`); advance `p` past it
+static bool parse_record(char **p, char *end, struct dir_record *rec)
+{
+    unsigned long long v[11];
+    char *q = *p;
+    if (end - q < 2 || q[0] != 'd' || q[1] != ' ') return false;
+    q += 2;
+    static const int bases[11] = {10, 10, 10, 10, 10, 10, 16, 16, 10, 10, 10};
+    for (int i = 0; i < 11; ++i)
+        if (!parse_num(&q, &v[i], bases[i])) return false;
+    char *nl = memchr(q, '\n', end - q);
+    if (!nl || (size_t)(end - nl) < v[10] + 2 || nl[1 + v[10]] != '\n') return false;
+    *nl = '\0';
+    *rec = (struct dir_record){
+        .path = q,
+        .key = {.ino = v[0],
+                .size = v[1],
+                .mtime = {.tv_sec = v[2], .tv_nsec = v[3]},
+                .ctime = {.tv_sec = v[4], .tv_nsec = v[5]},
+                .rules = v[6],
+                .tracked = v[7],
+                .check_only = v[8]},
+        .listed = v[9],
+        .entries = nl + 1,
+        .len = v[10],
+    };
+    *p = nl + 2 + v[10];
+    return true;
+}
+
+/// Load listings kept by earlier runs
+static void load_records(struct walk *w)
+{
+    int fd = open(w->cache_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st;
+    size_t size = 0;
+    if (fstat(fd, &st) < 0 || !(w->old_buf = malloc(st.st_size + 1))) goto out;
+    while (size < (size_t)st.st_size) {
+        ssize_t n = read(fd, w->old_buf + size, st.st_size - size);
+        if (n <= 0) goto out;
+        size += n;
+    }
+    w->old_buf[size] = '\0';
+
+    char *p = w->old_buf, *end = p + size, *nl;
+    int version;
+    if (sscanf(p, "git-prompt-dirs %d\n", &version) != 1 || version != DIRS_CACHE_VERSION ||
+        !(nl = memchr(p, '\n', size)))
+        goto out;
+    // a different repository whose git dir hashes the same
+    p = nl + 1;
+    size_t len = strlen(w->repo->gitdir);
+    if ((size_t)(end - p) <= len || memcmp(p, w->repo->gitdir, len) || p[len] != '\n') goto out;
+    p += len + 1;
+    size_t alloc = 0;
+    while (p < end) {
+        if (w->nr_old == alloc) {
+            alloc = alloc ? alloc * 2 : 64;
+            void *tmp = realloc(w->old, alloc * sizeof(*w->old));
+            if (!tmp) break;
+            w->old = tmp;
+        }
+        if (!parse_record(&p, end, &w->old[w->nr_old])) break;
+        ++w->nr_old;
+    }
+    if (w->nr_old) qsort(w->old, w->nr_old, sizeof(*w->old), cmp_record);
+out:
+    close(fd);
+}
+
+static void write_record(FILE *file, const struct dir_record *rec)
+{
+    const struct dir_key *key = &rec->key;
+    fprintf(file, "d %llu %lld %lld.%09ld %lld.%09ld %016llx %016llx %d %lld %zu %s\n",
+            (unsigned long long)key->ino, (long long)key->size, (long long)key->mtime.tv_sec,
+            key->mtime.tv_nsec, (long long)key->ctime.tv_sec, key->ctime.tv_nsec,
+            (unsigned long long)key->rules, (unsigned long long)key->tracked, key->check_only,
+            (long long)rec->listed, rec->len, rec->path);
+    fwrite(rec->entries, 1, rec->len, file);
+    fputc('\n', file);
+}
+
+/// Replace the kept listings with those of this run, if anything changed
+///
+/// After an early stop, unvisited listings are kept too.
+static void save_records(struct walk *w)
+{
+    bool changed = w->reads > 0;
+    for (size_t i = 0; i < w->nr_old && !changed; ++i) changed = !w->old[i].used && !w->early;
+    if (!changed || !w->cache_path[0]) return;
+
+    char tmp[PATH_MAX];
+    int len = snprintf(tmp, sizeof(tmp), "%s.XXXXXX", w->cache_path);
+    if (len < 0 || (size_t)len >= sizeof(tmp)) return;
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    FILE *file = fd < 0 ? NULL : fdopen(fd, "w");
+    if (!file) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp);
+        }
+        log_warn("untracked: cannot write %s: %s", tmp, strerror(errno));
+        return;
+    }
+    fprintf(file, "git-prompt-dirs %d\n%s\n", DIRS_CACHE_VERSION, w->repo->gitdir);
+    for (size_t i = 0; i < w->nr_fresh; ++i) write_record(file, &w->fresh[i]);
+    for (size_t i = 0; i < w->nr_old && w->early; ++i)
+        if (!w->old[i].used) write_record(file, &w->old[i]);
+    if (fclose(file) != 0 || rename(tmp, w->cache_path) < 0) {
+        log_warn("untracked: cannot replace %s: %s", w->cache_path, strerror(errno));
+        unlink(tmp);
+    }
+}
+
+/// Use git's untracked cache only if it holds the same walk we are doing
+static const struct untracked_cache *usable_untr(const struct walk *w, const char *info_exclude,
+                                                 const char *excludes_file)
+{
+    const struct untracked_cache *uc = w->index->untracked_cache;
+    struct utsname uts;
+    char ident[PATH_MAX + 64];
+    if (!uc || !uc->nr || uname(&uts) < 0) return NULL;
+    snprintf(ident, sizeof(ident), "Location %s, system %s", w->repo->workdir, uts.sysname);
+    if (strcmp(uc->ident, ident) || uc->dir_flags != UNTR_FLAGS_NORMAL ||
+        strcmp(uc->exclude_per_dir, ".gitignore")) {
+        log_debug("untracked: untracked cache is for a different walk");
+        return NULL;
+    }
+    if (!same_blob(AT_FDCWD, info_exclude, 0, uc->info_exclude_oid) ||
+        !same_blob(AT_FDCWD, excludes_file, 0, uc->excludes_file_oid)) {
+        log_debug("untracked: global ignore files changed since the untracked cache");
+        return NULL;
+    }
+    return uc;
+}
+
+/// Set `buf` to the global ignore file: core.excludesFile or git's default
+static void excludes_file_path(const char *commondir, char *buf, size_t bufsize)
+{
+    const char *home = getenv("HOME"), *xdg = getenv("XDG_CONFIG_HOME");
+    char *val = config_get_all(commondir, "core.excludesfile");
+    buf[0] = '\0';
+    if (val && val[0] == '~' && val[1] == '/' && home)
+        snprintf(buf, bufsize, "%s%s", home, val + 1);
+    else if (val)
+        snprintf(buf, bufsize, "%s", val);
+    else if (xdg && *xdg)
+        snprintf(buf, bufsize, "%s/git/ignore", xdg);
+    else if (home)
+        snprintf(buf, bufsize, "%s/.config/git/ignore", home);
+    free(val);
+}
+
+int count_untracked(const struct git_repo *repo, const struct git_index *index,
+                    const struct fsmonitor *fsm, unsigned limit, unsigned *count,
+                    struct untracked_dirs *dirs)
+{
+    struct walk w = {.repo = repo, .index = index, .limit = limit, .workdir_fd = -1, .dirs = dirs};
+    char info_exclude[PATH_MAX], excludes_file[PATH_MAX];
+    int ok = 0;
+    char *val = config_get_all(repo->commondir, "core.ignorecase");
+    bool ignorecase = config_bool(val, false);
+    free(val);
+    // case-folded lookups of the index are not worth it for a prompt
+    if (ignorecase) return 0;
+    val = config_get_all(repo->commondir, "core.trustctime");
+    w.trustctime = config_bool(val, true);
+    free(val);
+
+    clock_gettime(CLOCK_REALTIME, &w.start);
+    if (dirs) dirs->start = w.start;
+    excludes_file_path(repo->commondir, excludes_file, sizeof(excludes_file));
+    if (!path_join(info_exclude, sizeof(info_exclude), repo->commondir, "info/exclude")) goto out;
+    if (!ignore_list_load(&w.global[0], AT_FDCWD, excludes_file, "", 0, true) ||
+        !ignore_list_load(&w.global[1], AT_FDCWD, info_exclude, "", 0, true))
+        goto out;
+    bool exists;
+    uint64_t rules = fnv(FNV_OFFSET, excludes_file, strlen(excludes_file));
+    rules = mix_stat(rules, AT_FDCWD, excludes_file, 0, &exists);
+    rules = mix_stat(rules, AT_FDCWD, info_exclude, 0, &exists);
+    if ((w.workdir_fd = open(repo->workdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) goto out;
+
+    w.uc = usable_untr(&w, info_exclude, excludes_file);
+    // the fsmonitor only speaks for the state git saved with its untracked cache
+    if (w.uc) w.fsm = fsm;
+    if (cache_file_path(w.cache_path, sizeof(w.cache_path), repo->gitdir, "-dirs"))
+        load_records(&w);
+    else
+        w.cache_path[0] = '\0';
+    if (!walk_tracked(&w, 0, 0, rules, w.uc ? 0 : -1)) goto out;
+    save_records(&w);
+    *count = w.count;
+    // directories past the stop were never looked into
+    if (dirs && w.early) dirs->lost = true;
+    ok = 1;
+    log_debug("untracked: %u found%s; %zu directories read, %zu from git's untracked cache, "
+              "%zu from our cache",
+              w.count, w.early ? " (stopped early)" : "", w.reads, w.untr_hits, w.cache_hits);
+out:
+    if (w.workdir_fd >= 0) close(w.workdir_fd);
+    for (int i = 0; i < 2; ++i) ignore_list_clear(&w.global[i]);
+    for (size_t i = 0; i < w.alloc_levels; ++i)
+        if (w.levels[i].loaded) ignore_list_clear(&w.levels[i].list);
+    free(w.levels);
+    for (size_t i = 0; i < w.nr_fresh; ++i) {
+        if (!w.fresh[i].owned) continue;
+        free((char *)w.fresh[i].path);
+        free((char *)w.fresh[i].entries);
+    }
+    free(w.fresh);
+    free(w.old);
+    free(w.old_buf);
+    return ok;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdbool.h> // for bool
+#include <stddef.h>  // for size_t
+#include <time.h>    // for timespec
+
+struct fsmonitor;
+struct git_index;
+struct git_repo;
+
+/// Untracked directories an untracked scan looked into, relative to the worktree root
+///
+/// Files appearing in or vanishing from any of them can change the count;
+/// no other directory outside the index can.
+struct untracked_dirs
+{
+    char **paths;
+    size_t nr;
+    size_t alloc;
+    /// Not every directory is listed (the scan stopped early, or memory ran out)
+    bool lost;
+    /// When the scan started; a directory modified since may have been listed too early
+    struct timespec start;
+};
+
+/// Free the paths of `dirs` and empty it
+void untracked_dirs_clear(struct untracked_dirs *dirs);
+
+/// Count untracked files as `git status --untracked-files=normal` would, without git
+///
+/// An untracked directory counts once if it holds anything that is not
+/// ignored. Directory listings are reused from git's untracked cache (the
+/// UNTR index extension) where it is still valid, else from listings kept
+/// on disk by earlier runs, so only directories whose mtime changed are
+/// read again. With `fsm` (may be NULL), directories the fsmonitor reported
+/// nothing in are taken from git's cache without looking at them. Stop at
+/// `limit` (0: count all). With `dirs` (may be NULL), also list the
+/// untracked directories looked into. Return 1 and set `count` on success,
+/// 0 if git has to be asked.
+int count_untracked(const struct git_repo *repo, const struct git_index *index,
+                    const struct fsmonitor *fsm, unsigned limit, unsigned *count,
+                    struct untracked_dirs *dirs);
@@ -1,8 +1,15 @@
 #include "util.h"
-#include <ctype.h>  // for isspace
-#include <stdio.h>  // for perror, NULL, size_t
-#include <stdlib.h> // for malloc, realloc
-#include <string.h> // for memcpy, strlen, strchr, strnlen
+#include "arena.h"    // for arena_alloc, arena_grow, arena_strndup
+#include "log.h"      // for log_warn
+#include <ctype.h>    // for isspace
+#include <errno.h>    // for errno, EINTR
+#include <fcntl.h>    // for open, openat, AT_FDCWD, O_RDONLY, O_CLOEXEC
+#include <stdio.h>    // for perror, NULL, size_t, snprintf
+#include <stdlib.h>   // for malloc, realloc, getenv
+#include <string.h>   // for memcpy, strlen, strchr, strnlen
+#include <sys/mman.h> // for mmap, MAP_FAILED, MAP_PRIVATE, PROT_READ
+#include <sys/stat.h> // for fstat, lstat, stat, mkdir, S_ISDIR
+#include <unistd.h>   // for close, read, write, getuid
 
 int strtoint_n(const char *str, int n)
 {
@@ -53,7 +60,7 @@ char *str_ndup(const char *str, const size_t n)
     return memcpy(p, str, len);
 }
 
-char **str_split(const char *src, const char *delim, size_t *n)
+char **str_split(struct arena *arena, const char *src, const char *delim, size_t *n)
 {
     int i = 0;      // index
     int in = 0;     // in/out flag
@@ -63,7 +70,7 @@ char **str_split(const char *src, const char *delim, size_t *n)
     const char *ep = p;
 
     // allocate ptrs
-    if (!(dest = malloc(nptrs * sizeof *dest))) {
+    if (!(dest = arena_alloc(arena, nptrs * sizeof *dest))) {
         perror("malloc-dest");
         return NULL;
     }
@@ -74,8 +81,9 @@ char **str_split(const char *src, const char *delim, size_t *n)
             size_t len = ep - p;
             if (in && len) {
                 if (i == nptrs - 1) {
-                    // realloc dest to temporary pointer/validate
-                    void *tmp = realloc(dest, 2 * nptrs * sizeof *dest);
+                    // grow dest into temporary pointer/validate
+                    void *tmp = arena_grow(arena, dest, nptrs * sizeof *dest,
+                                           2 * nptrs * sizeof *dest);
                     if (!tmp) {
                         perror("realloc-dest");
                         break; // don't exit, original dest still valid
@@ -84,13 +92,11 @@ char **str_split(const char *src, const char *delim, size_t *n)
                     nptrs *= 2; // increment allocated pointer count
                 }
                 // allocate/validate storage for token
-                if (!(dest[i] = malloc(len + 1))) {
+                if (!(dest[i] = arena_strndup(arena, p, len))) {
                     perror("malloc-dest[i]");
                     break;
                 }
-                memcpy(dest[i], p, len); // copy len chars to storage
-                dest[i++][len] = 0;      // nul-terminate, advance index
-                dest[i] = NULL;          // set next pointer NULL
+                dest[++i] = NULL; // advance index, set next pointer NULL
             }
             if (!*ep) // if at end, break
                 break;
@@ -110,12 +116,126 @@ size_t str_squish(char *str, bool trim)
     char *save = str;
     char *from = str;
     if (trim)
-        while (isspace(*from)) ++from;
+        while (isspace((unsigned char)*from)) ++from;
     for (; *from; ++from) {
-        if (isspace(*from) && isspace(*(from - 1))) continue;
+        if (from > save && isspace((unsigned char)*from) && isspace((unsigned char)*(from - 1)))
+            continue;
         *str++ = *from;
     }
-    if (trim && isspace(*(str - 1))) --str;
+    // nothing left if it was all whitespace
+    if (trim && str > save && isspace((unsigned char)*(str - 1))) --str;
     *str = '\0';
     return (str - save);
 }
+
+void *map_file(const char *path, size_t *size)
+{
+    *size = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    struct stat st;
+    void *map = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+            map = NULL;
+        else
+            *size = st.st_size;
+    } else {
+        errno = 0;
+    }
+    close(fd);
+    return map;
+}
+
+ssize_t read_file(const char *path, char *buf, size_t bufsize)
+{
+    return read_file_at(AT_FDCWD, path, buf, bufsize);
+}
+
+ssize_t read_file_at(int dirfd, const char *name, char *buf, size_t bufsize)
+{
+    int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t len = 0, nread;
+    while ((size_t)len < bufsize - 1 &&
+           (nread = read(fd, buf + len, bufsize - 1 - len)) != 0) {
+        if (nread < 0) {
+            if (errno == EINTR) continue;
+            close(fd);
+            return -1;
+        }
+        len += nread;
+    }
+    close(fd);
+    while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == '\r')) --len;
+    buf[len] = '\0';
+    return len;
+}
+
+int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+int path_join(char *buf, size_t bufsize, const char *dir, const char *name)
+{
+    int len = snprintf(buf, bufsize, "%s/%s", dir, name);
+    return len >= 0 && (size_t)len < bufsize;
+}
+
+int private_dir(const char *path)
+{
+    struct stat st;
+    if (mkdir(path, 0700) < 0 && errno != EEXIST) return 0;
+    // anyone may have made it first in a shared directory such as /tmp
+    if (lstat(path, &st) < 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() ||
+        st.st_mode & 077) {
+        log_warn("%s is not a private directory of this user", path);
+        return 0;
+    }
+    return 1;
+}
+
+int runtime_path(char *buf, size_t bufsize, const char *name)
+{
+    const char *xdg = getenv("XDG_RUNTIME_DIR");
+    int len = xdg && *xdg ? snprintf(buf, bufsize, "%s/git-prompt", xdg)
+                          : snprintf(buf, bufsize, "/tmp/git-prompt-%u", (unsigned)getuid());
+    if (len < 0 || (size_t)len >= bufsize) return 0;
+    if (!private_dir(buf)) return 0;
+    if (!name) return 1;
+    int sublen = snprintf(buf + len, bufsize - len, "/%s", name);
+    return sublen >= 0 && (size_t)sublen < bufsize - len;
+}
+
+void deadline_set(struct timespec *deadline, unsigned ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += ms / 1000;
+    deadline->tv_nsec += (long)(ms % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_nsec -= 1000000000;
+        ++deadline->tv_sec;
+    }
+}
+
+long deadline_remaining_ms(const struct timespec *deadline)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ms = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+    // round up so that a sub-millisecond remainder does not read as expired
+    if (ms == 0 && (deadline->tv_sec > now.tv_sec || deadline->tv_nsec > now.tv_nsec)) ms = 1;
+    return ms;
+}
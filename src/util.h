@@ -1,7 +1,12 @@
 #pragma once
 
-#include <stdbool.h> // for bool
-#include <stdio.h>   // for size_t
+#include <stdbool.h>   // for bool
+#include <stdint.h>    // for uint32_t, uint16_t
+#include <stdio.h>     // for size_t
+#include <sys/types.h> // for ssize_t
+#include <time.h>      // for timespec
+
+struct arena;
 
 /// Alternative to strtol which allows '+' and '-' prefixes
 int strtoint_n(const char *str, int n);
@@ -16,15 +21,68 @@ char *str_ndup(const char *str, size_t n);
 
 /// Split `src` into tokens with sentinel `NULL` after last token.
 ///
-/// Return allocated pointer-to-pointer with sentinel `NULL` on success,
-/// or `NULL` on failure to allocate initial block of pointers. The number
-/// of allocated pointers are doubled each time reallocation required.
+/// Return pointer-to-pointer with sentinel `NULL` on success, or `NULL` on
+/// failure to allocate initial block of pointers. The number of allocated
+/// pointers are doubled each time reallocation required. Pointers and
+/// tokens come from `arena` (see arena_alloc()).
 ///
 /// Set `n` to the size of pointer-to-pointer array if `n != NULL`
 /// Based on: https://stackoverflow.com/a/60409814
-char **str_split(const char *src, const char *delim, size_t *n);
+char **str_split(struct arena *arena, const char *src, const char *delim, size_t *n);
 
 /// Collapse whitespace in char array in place and return new size
 ///
 /// Also removes leading whitespace if trim is true
 size_t str_squish(char *str, bool trim);
+
+/// Read big-endian 32-bit integer from unaligned buffer
+static inline uint32_t get_be32(const void *ptr)
+{
+    const unsigned char *p = ptr;
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+/// Read big-endian 16-bit integer from unaligned buffer
+static inline uint16_t get_be16(const void *ptr)
+{
+    const unsigned char *p = ptr;
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+/// Map file at `path` read-only into memory
+///
+/// Return pointer to mapping and set `size`, or `NULL` on failure. An empty
+/// file is reported as failure with `size == 0` and `errno == 0`.
+void *map_file(const char *path, size_t *size);
+
+/// Read up to `bufsize - 1` bytes of small file into `buf` and NULL-terminate
+///
+/// Trailing newline is stripped. Return bytes read, or -1 on failure.
+ssize_t read_file(const char *path, char *buf, size_t bufsize);
+
+/// Like read_file(), with `name` relative to directory descriptor `dirfd`
+ssize_t read_file_at(int dirfd, const char *name, char *buf, size_t bufsize);
+
+/// Write all `len` bytes of `buf` to `fd`, retrying after interrupts; return 0 on error
+int write_all(int fd, const void *buf, size_t len);
+
+/// Join `dir` and `name` with '/' into `buf`; return 0 if truncated
+int path_join(char *buf, size_t bufsize, const char *dir, const char *name);
+
+/// Create directory `path` with mode 0700 unless it exists
+///
+/// Return 0 on failure, or if `path` is not a directory (symlinks included)
+/// owned by this user and closed to everyone else.
+int private_dir(const char *path);
+
+/// Join `name` onto the per-user runtime directory, creating the directory
+///
+/// The directory is `$XDG_RUNTIME_DIR/git-prompt`, or `/tmp/git-prompt-<uid>`
+/// if that is unset, and must pass private_dir(). Return 0 on failure.
+int runtime_path(char *buf, size_t bufsize, const char *name);
+
+/// Set `deadline` to `ms` milliseconds from now on CLOCK_MONOTONIC
+void deadline_set(struct timespec *deadline, unsigned ms);
+
+/// Milliseconds left until `deadline` (CLOCK_MONOTONIC), negative if passed
+long deadline_remaining_ms(const struct timespec *deadline);
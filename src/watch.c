@@ -0,0 +1,389 @@
+#include "watch.h"
+#include "index.h"       // for git_index, index_entry, read_index, CE_SKIP_WORKTREE
+#include "log.h"         // for log_debug, log_warn
+#include "plan.h"        // for PLAN_REFS, PLAN_INDEX, PLAN_WORKTREE, PLAN_UNTRACKED, PLAN_UPSTREAM
+#include "repo.h"        // for git_repo
+#include "untracked.h"   // for untracked_dirs
+#include "util.h"        // for path_join, str_ndup
+#include <dirent.h>      // for opendir, readdir, closedir, DT_DIR
+#include <errno.h>       // for errno, EAGAIN, ENOENT, ENOSPC, ENOTDIR, EINTR
+#include <limits.h>      // for PATH_MAX
+#include <stdio.h>       // for snprintf
+#include <stdlib.h>      // for calloc, free, realloc
+#include <string.h>      // for memcpy, memmove, strchr, strcmp, strerror, strlen
+#include <sys/inotify.h> // for inotify_init1, inotify_add_watch, inotify_rm_watch, inotify_event
+#include <sys/stat.h>    // for stat
+#include <unistd.h>      // for close, read
+
+// Worktree paths kept per repository before falling back to a full rescan
+#define MAX_PATHS 4096
+
+#define ALL_SOURCES (PLAN_REFS | PLAN_INDEX | PLAN_WORKTREE | PLAN_UNTRACKED | PLAN_UPSTREAM)
+// moving a ref can change the HEAD tree as well as ahead/behind
+#define REF_SOURCES (PLAN_REFS | PLAN_INDEX | PLAN_UPSTREAM)
+
+#define GITDIR_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE)
+#define REFS_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_CREATE)
+#define WORKTREE_MASK                                                                              \
+    (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+#define UNTRACKED_MASK (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+enum watch_kind {
+    WATCH_GITDIR,    // HEAD, index, config, packed-refs
+    WATCH_INFO,      // info/exclude, info/attributes
+    WATCH_REFS,      // anything under refs/, relative to commondir
+    WATCH_WORKTREE,  // directory with tracked files, relative to workdir
+    WATCH_UNTRACKED, // untracked directory the untracked count looked into
+};
+
+/// One watched directory of one repository
+///
+/// The same directory watched for several repositories (e.g. the daemon
+/// serving two subdirectories of one worktree) shares its watch descriptor,
+/// so there may be several entries per `wd`.
+struct watch_entry
+{
+    int wd;
+    enum watch_kind kind;
+    struct repo_watch *owner;
+    char *dir;
+};
+
+static int inotify_fd = -1;
+/// Sorted by `wd`
+static struct watch_entry *entries;
+static size_t nr_entries, alloc_entries;
+static bool warned_limit;
+
+int watch_init(void)
+{
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) log_warn("watch: inotify unavailable: %s", strerror(errno));
+    return inotify_fd;
+}
+
+void watch_close(void)
+{
+    if (inotify_fd >= 0) close(inotify_fd);
+    inotify_fd = -1;
+    free(entries);
+    entries = NULL;
+    nr_entries = alloc_entries = 0;
+}
+
+/// Index of first entry with `wd`, or where it would go
+static size_t lower_bound(int wd)
+{
+    size_t lo = 0, hi = nr_entries;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (entries[mid].wd < wd)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/// Drop every entry of `owner`, removing watches nobody else uses
+static void remove_owner(struct repo_watch *owner)
+{
+    for (size_t i = 0; i < nr_entries; ++i) {
+        if (entries[i].owner != owner) continue;
+        bool shared = false;
+        for (size_t j = lower_bound(entries[i].wd); j < nr_entries && entries[j].wd == entries[i].wd; ++j)
+            if (entries[j].owner != owner) shared = true;
+        if (!shared) inotify_rm_watch(inotify_fd, entries[i].wd);
+    }
+    size_t out = 0;
+    for (size_t i = 0; i < nr_entries; ++i) {
+        if (entries[i].owner == owner)
+            free(entries[i].dir);
+        else
+            entries[out++] = entries[i];
+    }
+    nr_entries = out;
+}
+
+/// Give up on watching `w` after the watch limit ran out
+static void set_incomplete(struct repo_watch *w)
+{
+    if (!warned_limit) {
+        log_warn("watch: out of inotify watches, rescanning on every query; "
+                 "raise fs.inotify.max_user_watches to avoid this");
+        warned_limit = true;
+    }
+    w->incomplete = true;
+    remove_owner(w);
+}
+
+/// Watch `path` as `kind` for `w`; `dir` is kept to name events relative to it
+static int add_watch(struct repo_watch *w, const char *path, enum watch_kind kind, const char *dir)
+{
+    static const uint32_t masks[] = {
+        [WATCH_GITDIR] = GITDIR_MASK,
+        [WATCH_INFO] = GITDIR_MASK,
+        [WATCH_REFS] = REFS_MASK,
+        [WATCH_WORKTREE] = WORKTREE_MASK,
+        [WATCH_UNTRACKED] = UNTRACKED_MASK,
+    };
+    if (w->incomplete) return 0;
+    int wd = inotify_add_watch(inotify_fd, path, masks[kind] | IN_ONLYDIR | IN_EXCL_UNLINK);
+    if (wd < 0) {
+        if (errno == ENOSPC) {
+            set_incomplete(w);
+            return 0;
+        }
+        // directories may vanish between listing and watching
+        if (errno != ENOENT && errno != ENOTDIR)
+            log_debug("watch: cannot watch %s: %s", path, strerror(errno));
+        return 1;
+    }
+    size_t pos = lower_bound(wd);
+    for (; pos < nr_entries && entries[pos].wd == wd; ++pos)
+        if (entries[pos].owner == w && entries[pos].kind == kind) return 1;
+    if (nr_entries == alloc_entries) {
+        size_t alloc = alloc_entries ? alloc_entries * 2 : 64;
+        struct watch_entry *tmp = realloc(entries, alloc * sizeof(*entries));
+        if (!tmp) return 0;
+        entries = tmp;
+        alloc_entries = alloc;
+    }
+    char *copy = str_ndup(dir, 0);
+    if (!copy) return 0;
+    memmove(&entries[pos + 1], &entries[pos], (nr_entries - pos) * sizeof(*entries));
+    entries[pos] = (struct watch_entry){.wd = wd, .kind = kind, .owner = w, .dir = copy};
+    ++nr_entries;
+    return 1;
+}
+
+/// Watch `dir` (relative to `repo->commondir`) and every directory below it
+static int add_refs_tree(struct repo_watch *w, const char *dir)
+{
+    char path[PATH_MAX];
+    if (!path_join(path, sizeof(path), w->repo->commondir, dir)) return 1;
+    if (!add_watch(w, path, WATCH_REFS, dir)) return 0;
+    DIR *d = opendir(path);
+    if (!d) return 1;
+    struct dirent *de;
+    int ok = 1;
+    while (ok && (de = readdir(d))) {
+        if (de->d_type != DT_DIR || !strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        char sub[PATH_MAX];
+        if (path_join(sub, sizeof(sub), dir, de->d_name)) ok = add_refs_tree(w, sub);
+    }
+    closedir(d);
+    return ok;
+}
+
+void watch_refresh(struct repo_watch *w)
+{
+    char path[PATH_MAX];
+    w->rewatch = false;
+    if (!add_refs_tree(w, "refs") || !w->repo->workdir) return;
+    if (!path_join(path, sizeof(path), w->repo->gitdir, "index")) return;
+    struct git_index *index = read_index(path);
+    if (!index) return;
+    if (!add_watch(w, w->repo->workdir, WATCH_WORKTREE, "")) goto out;
+    // entries are sorted, so each directory shows up in one run of entries;
+    // a directory is new where the path stops sharing a prefix with the last one
+    const char *prev = "";
+    for (uint32_t i = 0; i < index->nr; ++i) {
+        const struct index_entry *ce = &index->entries[i];
+        if (ce->xflags & CE_SKIP_WORKTREE) continue;
+        size_t common = 0;
+        for (size_t k = 0; ce->path[k] && ce->path[k] == prev[k]; ++k)
+            if (ce->path[k] == '/') common = k + 1;
+        for (const char *slash = ce->path + common; (slash = strchr(slash, '/')); ++slash) {
+            char dir[PATH_MAX];
+            size_t len = slash - ce->path;
+            if (len >= sizeof(dir)) break;
+            memcpy(dir, ce->path, len);
+            dir[len] = '\0';
+            if (!path_join(path, sizeof(path), w->repo->workdir, dir)) break;
+            if (!add_watch(w, path, WATCH_WORKTREE, dir)) goto out;
+        }
+        prev = ce->path;
+    }
+out:
+    index->free(index);
+}
+
+struct repo_watch *watch_repo(struct git_repo *repo)
+{
+    if (inotify_fd < 0 || !repo->gitdir) return NULL;
+    struct repo_watch *w = calloc(1, sizeof(struct repo_watch));
+    if (!w) return NULL;
+    w->repo = repo;
+    char path[PATH_MAX];
+    add_watch(w, repo->gitdir, WATCH_GITDIR, "");
+    if (strcmp(repo->gitdir, repo->commondir)) add_watch(w, repo->commondir, WATCH_GITDIR, "");
+    if (path_join(path, sizeof(path), repo->commondir, "info"))
+        add_watch(w, path, WATCH_INFO, "info");
+    watch_refresh(w);
+    log_debug("watch: %s: %zu watches%s", repo->gitdir, nr_entries,
+              w->incomplete ? " (incomplete)" : "");
+    return w;
+}
+
+void watch_untracked(struct repo_watch *w, const struct untracked_dirs *dirs)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    w->untracked_unwatched = !dirs;
+    for (size_t i = 0; dirs && i < dirs->nr; ++i) {
+        if (!path_join(path, sizeof(path), w->repo->workdir, dirs->paths[i])) continue;
+        if (!add_watch(w, path, WATCH_UNTRACKED, dirs->paths[i])) return;
+        // changed since the scan started, maybe after it was listed and before
+        // the watch; whole seconds, as some filesystems keep no more
+        if (stat(path, &st) == 0 && st.st_mtim.tv_sec >= dirs->start.tv_sec)
+            w->dirty |= PLAN_UNTRACKED;
+    }
+}
+
+void watch_clear(struct repo_watch *w, unsigned plan)
+{
+    w->dirty &= ~plan;
+    if (!(plan & PLAN_WORKTREE)) return;
+    for (size_t i = 0; i < w->nr_paths; ++i) free(w->paths[i]);
+    w->nr_paths = 0;
+    w->paths_lost = false;
+}
+
+void watch_free(struct repo_watch *w)
+{
+    if (!w) return;
+    remove_owner(w);
+    watch_clear(w, ALL_SOURCES);
+    free(w->paths);
+    free(w);
+}
+
+/// Remember changed worktree path `dir`/`name` for an incremental update
+static void add_path(struct repo_watch *w, const char *dir, const char *name)
+{
+    char path[PATH_MAX];
+    w->dirty |= PLAN_WORKTREE;
+    if (w->paths_lost) return;
+    if (*dir)
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+    else
+        snprintf(path, sizeof(path), "%s", name);
+    // editors and `cp` produce bursts of events for the same file
+    if (w->nr_paths && !strcmp(w->paths[w->nr_paths - 1], path)) return;
+    if (w->nr_paths == MAX_PATHS) goto lost;
+    if (w->nr_paths == w->alloc_paths) {
+        size_t alloc = w->alloc_paths ? w->alloc_paths * 2 : 16;
+        char **tmp = realloc(w->paths, alloc * sizeof(char *));
+        if (!tmp) goto lost;
+        w->paths = tmp;
+        w->alloc_paths = alloc;
+    }
+    if (!(w->paths[w->nr_paths] = str_ndup(path, 0))) goto lost;
+    ++w->nr_paths;
+    return;
+lost:
+    w->paths_lost = true;
+}
+
+/// Mark sources of `e->owner` affected by `ev` dirty
+///
+/// Must not add or remove watches: the caller is iterating over `entries`.
+static void dispatch(const struct watch_entry *e, const struct inotify_event *ev)
+{
+    struct repo_watch *w = e->owner;
+    const char *name = ev->len ? ev->name : "";
+    switch (e->kind) {
+    case WATCH_GITDIR:
+        if (!strcmp(name, "HEAD") || !strcmp(name, "packed-refs")) {
+            w->dirty |= REF_SOURCES;
+        } else if (!strcmp(name, "index")) {
+            w->dirty |= PLAN_INDEX | PLAN_WORKTREE | PLAN_UNTRACKED;
+            w->rewatch = true;
+        } else if (!strcmp(name, "config")) {
+            w->dirty |= ALL_SOURCES;
+        }
+        break;
+    case WATCH_INFO:
+        if (!strcmp(name, "exclude"))
+            w->dirty |= PLAN_UNTRACKED;
+        else if (!strcmp(name, "attributes"))
+            w->dirty |= PLAN_INDEX | PLAN_WORKTREE;
+        break;
+    case WATCH_REFS:
+        if (ev->mask & IN_ISDIR) {
+            // refs may have been written before the new directory is watched
+            if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                w->dirty |= REF_SOURCES;
+                w->rewatch = true;
+            }
+        } else {
+            size_t len = strlen(name);
+            if (len < 5 || strcmp(name + len - 5, ".lock")) w->dirty |= REF_SOURCES;
+        }
+        break;
+    case WATCH_WORKTREE:
+        if (!strcmp(name, ".git")) break;
+        if (!strcmp(name, ".gitignore")) {
+            w->dirty |= PLAN_UNTRACKED;
+        } else if (!strcmp(name, ".gitattributes")) {
+            w->dirty |= PLAN_INDEX | PLAN_WORKTREE;
+        }
+        if (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+            w->dirty |= PLAN_UNTRACKED;
+            // a recreated directory may hold tracked files again
+            if (ev->mask & IN_ISDIR && ev->mask & (IN_CREATE | IN_MOVED_TO)) w->rewatch = true;
+        }
+        if (*name) add_path(w, e->dir, name);
+        break;
+    case WATCH_UNTRACKED:
+        // only entries coming and going, and ignore rules, change the count
+        if (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO) ||
+            !strcmp(name, ".gitignore"))
+            w->dirty |= PLAN_UNTRACKED;
+        break;
+    }
+}
+
+/// Forget entries for `wd` after the kernel dropped the watch
+static void forget_wd(int wd)
+{
+    size_t pos = lower_bound(wd), end = pos;
+    while (end < nr_entries && entries[end].wd == wd) free(entries[end++].dir);
+    memmove(&entries[pos], &entries[end], (nr_entries - end) * sizeof(*entries));
+    nr_entries -= end - pos;
+}
+
+void watch_read(void)
+{
+    char buf[16 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    if (inotify_fd < 0) return;
+    for (;;) {
+        ssize_t len = read(inotify_fd, buf, sizeof(buf));
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) log_warn("watch: read: %s", strerror(errno));
+            return;
+        }
+        for (char *p = buf; p < buf + len;) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                log_warn("watch: inotify queue overflowed, rescanning");
+                for (size_t i = 0; i < nr_entries; ++i) {
+                    entries[i].owner->dirty |= ALL_SOURCES;
+                    entries[i].owner->paths_lost = true;
+                    entries[i].owner->rewatch = true;
+                }
+                continue;
+            }
+            if (ev->mask & IN_IGNORED) {
+                forget_wd(ev->wd);
+                continue;
+            }
+            for (size_t i = lower_bound(ev->wd); i < nr_entries && entries[i].wd == ev->wd; ++i)
+                dispatch(&entries[i], ev);
+        }
+    }
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdbool.h> // for bool
+#include <stddef.h>  // for size_t
+
+struct git_repo;
+struct untracked_dirs;
+
+/// Changes seen on one repository since its results were last brought up to date
+struct repo_watch
+{
+    struct git_repo *repo;
+    /// `plan_source` bits whose results may be out of date
+    unsigned dirty;
+    /// Not every directory could be watched; nothing can be trusted
+    bool incomplete;
+    /// Directories must be watched again (index changed, directory created)
+    bool rewatch;
+    /// The untracked directories of the last untracked count are not all
+    /// watched, so that count cannot be trusted on the next query
+    bool untracked_unwatched;
+    /// Worktree paths changed since the last update, relative to the worktree root
+    char **paths;
+    size_t nr_paths;
+    size_t alloc_paths;
+    /// More paths changed than are kept in `paths`
+    bool paths_lost;
+};
+
+/// Open the inotify instance shared by all watched repositories
+///
+/// Return its file descriptor (to poll for readability) or -1.
+int watch_init(void);
+
+/// Close the inotify instance; every repo_watch must have been freed
+void watch_close(void);
+
+/// Watch HEAD, index, config and refs of `repo` and its tracked worktree directories
+///
+/// `repo` must already be discovered. Return NULL if watching is not
+/// available at all. If the inotify watch limit (fs.inotify.max_user_watches)
+/// runs out, the returned watch is marked `incomplete` and the caller should
+/// recompute everything on every query.
+struct repo_watch *watch_repo(struct git_repo *repo);
+
+/// Add watches for directories that appeared since (new ref namespaces,
+/// worktree directories new in the index); call when `w->rewatch` is set
+void watch_refresh(struct repo_watch *w);
+
+/// Watch the untracked directories `dirs` the untracked count just looked into
+///
+/// Files created in or removed from them mark PLAN_UNTRACKED dirty. With
+/// `dirs` NULL (unknown), PLAN_UNTRACKED is stale on every query until the
+/// directories are known.
+void watch_untracked(struct repo_watch *w, const struct untracked_dirs *dirs);
+
+/// Forget changes to the sources in `plan` after their results were recomputed
+void watch_clear(struct repo_watch *w, unsigned plan);
+
+/// Remove all watches of `w` and free it
+void watch_free(struct repo_watch *w);
+
+/// Read pending inotify events without blocking and mark affected sources dirty
+void watch_read(void);
@@ -13,5 +13,17 @@ target("git-prompt")
     add_files("src/*.c")
     set_languages("gnu99")
     set_warnings("all", "extra")
+    add_links("z")
+    add_syslinks("pthread")
     add_defines("LOG_USE_COLOR", "GIT_HASH_LEN=7", "FMT_STRING=\"%b@%c\"")
     set_installdir("$(env HOME)/.local")
+
+-- benchmark harness: xmake build bench && xmake run bench REPO...
+-- (repositories from bench/gen-repo.sh)
+target("bench")
+    set_kind("binary")
+    set_default(false)
+    add_deps("git-prompt")
+    add_files("bench/bench.c")
+    set_languages("gnu99")
+    set_warnings("all", "extra")